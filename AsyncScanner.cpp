@@ -0,0 +1,223 @@
+/*
+ * AsyncScanner.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#include <chrono>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+#include "AsyncScanner.h"
+
+// keeps the first match
+static int firstMatch(const SignatureMatch &Match, void* Context)
+{
+	*(string*)Context = Match.Tool;
+	return MATCH_STOP;
+}
+
+AsyncScanner::AsyncScanner(PackiD &iD, unsigned int Threads, ScanCache* Cache) : iD(iD), Cache(Cache), Pool(Threads)
+{
+	NextTicket = 1;
+#ifdef __linux__
+	EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+	EventFd = -1;
+#endif
+}
+
+AsyncScanner::~AsyncScanner()
+{
+	// scans still queued finish at once as cancelled
+	{
+		lock_guard<mutex> Guard(Lock);
+		for(unordered_map<ULONGLONG, shared_ptr<atomic<bool> > >::iterator it = InFlight.begin(); it != InFlight.end(); ++it)
+			it->second->store(true);
+	}
+	Pool.stop();
+
+#ifdef __linux__
+	if(EventFd >= 0)	close(EventFd);
+#endif
+}
+
+ULONGLONG AsyncScanner::submit(const char* Path, int Mode, void* UserData)
+{
+	Job J;
+	J.Path = Path;
+	J.Buffer = NULL;
+	J.Size = 0;
+	J.Mode = Mode;
+	J.UserData = UserData;
+	J.Result = NULL;
+	J.Resume = NULL;
+
+	return queue(J);
+}
+
+ULONGLONG AsyncScanner::submit(const BYTE* Buffer, DWORD Size, int Mode, void* UserData)
+{
+	Job J;
+	J.Buffer = Buffer;
+	J.Size = Size;
+	J.Mode = Mode;
+	J.UserData = UserData;
+	J.Result = NULL;
+	J.Resume = NULL;
+
+	return queue(J);
+}
+
+ULONGLONG AsyncScanner::queue(Job &J)
+{
+	J.Cancel.reset(new atomic<bool>(false));
+	{
+		lock_guard<mutex> Guard(Lock);
+		J.Ticket = NextTicket++;
+		InFlight[J.Ticket] = J.Cancel;
+	}
+
+	if(!Pool.submit(std::bind(&AsyncScanner::run, this, J))) {
+		lock_guard<mutex> Guard(Lock);
+		InFlight.erase(J.Ticket);
+		return 0;
+	}
+	return J.Ticket;
+}
+
+bool AsyncScanner::cancel(ULONGLONG Ticket)
+{
+	lock_guard<mutex> Guard(Lock);
+
+	unordered_map<ULONGLONG, shared_ptr<atomic<bool> > >::iterator it = InFlight.find(Ticket);
+	if(it == InFlight.end())	return false;
+
+	it->second->store(true);
+	return true;
+}
+
+// pool thread
+void AsyncScanner::run(Job J)
+{
+	ScanCompletion C;
+	C.Ticket = J.Ticket;
+	C.UserData = J.UserData;
+	C.Status = ASYNC_CANCELLED;
+
+	if(!J.Cancel->load())
+	{
+		PE P;
+		bool Loaded = J.Buffer ? P.loadBuffer(J.Buffer, J.Size) != NULL : P.loadPE(&J.Path[0]) != NULL;
+
+		if(!Loaded)
+			C.Status = ASYNC_NOT_PE;
+		else if(Cache) {
+			// a cached scan can't be stopped once started
+			C.Tool = Cache->scanPE(iD, P, J.Mode);
+			C.Status = C.Tool.compare(NO_MATCH) ? ASYNC_MATCH : ASYNC_NO_MATCH;
+		}
+		else if(iD.scanPE(P, J.Mode, firstMatch, &C.Tool, J.Cancel.get()) != SCAN_CANCELLED)
+			C.Status = C.Tool.length() ? ASYNC_MATCH : ASYNC_NO_MATCH;
+	}
+
+	if(C.Status != ASYNC_MATCH)	C.Tool.clear();
+
+	{
+		lock_guard<mutex> Guard(Lock);
+		InFlight.erase(J.Ticket);
+		Completed.push_back(make_pair(C, J));
+
+#ifdef __linux__
+		// under the lock, poll() clears it under the lock when it finds the queue empty
+		uint64_t One = 1;
+		if(EventFd >= 0 && write(EventFd, &One, sizeof(One)) < 0) {}
+#endif
+	}
+	Ready.notify_all();
+}
+
+bool AsyncScanner::take(unique_lock<mutex> &Guard, ScanCompletion &C)
+{
+	while(!Completed.empty())
+	{
+		pair<ScanCompletion, Job> Done = Completed.front();
+		Completed.pop_front();
+
+		if(!Done.second.Resume) {
+			C = Done.first;
+			return true;
+		}
+
+#ifdef ASYNC_COROUTINES
+		// a coroutine is waiting for it, resume it here without holding the lock, it may submit more scans
+		*Done.second.Result = Done.first;
+		Guard.unlock();
+		coroutine_handle<>::from_address(Done.second.Resume).resume();
+		Guard.lock();
+#else
+		(void)Guard;					// only coroutines are resumed without the lock
+#endif
+	}
+
+#ifdef __linux__
+	uint64_t Count;
+	if(EventFd >= 0 && read(EventFd, &Count, sizeof(Count)) < 0) {}
+#endif
+	return false;
+}
+
+bool AsyncScanner::poll(ScanCompletion &C)
+{
+	unique_lock<mutex> Guard(Lock);
+	return take(Guard, C);
+}
+
+bool AsyncScanner::wait(ScanCompletion &C, int TimeoutMs)
+{
+	unique_lock<mutex> Guard(Lock);
+	chrono::steady_clock::time_point Deadline = chrono::steady_clock::now() + chrono::milliseconds(TimeoutMs);
+
+	for(;;) {
+		if(take(Guard, C))				return true;
+		if(InFlight.empty())			return false;		// nothing will ever complete
+
+		if(TimeoutMs < 0)
+			Ready.wait(Guard);
+		else if(Ready.wait_until(Guard, Deadline) == cv_status::timeout && Completed.empty())
+			return false;
+	}
+}
+
+size_t AsyncScanner::pending()
+{
+	lock_guard<mutex> Guard(Lock);
+	return InFlight.size() + Completed.size();
+}
+
+#ifdef ASYNC_COROUTINES
+
+AsyncScanner::Awaitable AsyncScanner::scan(const char* Path, int Mode)
+{
+	Awaitable A = { *this, Job(), ScanCompletion() };
+	A.J.Path = Path;
+	A.J.Buffer = NULL;
+	A.J.Size = 0;
+	A.J.Mode = Mode;
+	A.J.UserData = NULL;
+	return A;
+}
+
+AsyncScanner::Awaitable AsyncScanner::scan(const BYTE* Buffer, DWORD Size, int Mode)
+{
+	Awaitable A = { *this, Job(), ScanCompletion() };
+	A.J.Buffer = Buffer;
+	A.J.Size = Size;
+	A.J.Mode = Mode;
+	A.J.UserData = NULL;
+	return A;
+}
+
+#endif
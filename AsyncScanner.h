@@ -0,0 +1,137 @@
+/*
+ * AsyncScanner.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _AsyncScanner_
+#define _AsyncScanner_
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include "ScanCache.h"
+#include "ThreadPool.h"
+#include "PackiD.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+	#include <coroutine>
+	#define ASYNC_COROUTINES
+#endif
+
+// ScanCompletion.Status
+#define ASYNC_MATCH			0
+#define ASYNC_NO_MATCH		1
+#define ASYNC_NOT_PE		2					// is not a PE or file cannot be opened
+#define ASYNC_CANCELLED		3
+
+struct ScanCompletion
+{
+	ULONGLONG						Ticket;			// returned by submit()
+	int								Status;			// ASYNC_*
+	string							Tool;			// the match if Status is ASYNC_MATCH
+	void*							UserData;		// given to submit()
+};
+
+/* Scans without blocking the caller: submit() queues a scan on an internal pool and returns a ticket at once.
+ * Finished scans are queued as ScanCompletion, the caller takes them with poll() or wait(). An event loop can watch
+ * getEventFd() (linux), it's readable while completions are waiting.
+ * The PackiD (and the ScanCache if any) must outlive the AsyncScanner.
+ */
+class AsyncScanner
+{
+private:
+	struct Job
+	{
+		ULONGLONG					Ticket;
+		string						Path;			// scan the file at Path, or
+		const BYTE*					Buffer;			// the Size bytes at Buffer
+		DWORD						Size;
+		int							Mode;
+		void*						UserData;
+		shared_ptr<atomic<bool> >	Cancel;
+		ScanCompletion*				Result;			// awaitable: store the completion here and
+		void*						Resume;			// resume this coroutine from poll()/wait()
+	};
+
+	PackiD							&iD;
+	ScanCache*						Cache;
+	ThreadPool						Pool;
+
+	mutex							Lock;
+	condition_variable				Ready;
+	deque<pair<ScanCompletion, Job> >	Completed;
+	unordered_map<ULONGLONG, shared_ptr<atomic<bool> > >	InFlight;		// cancel flags of submitted scans
+	ULONGLONG						NextTicket;
+	int								EventFd;
+
+	ULONGLONG queue(Job &J);
+	void run(Job J);
+
+	// hands a completion to the caller, or resumes the coroutine waiting for it. Lock must be held
+	bool take(unique_lock<mutex> &Guard, ScanCompletion &C);
+
+public:
+	AsyncScanner(PackiD &iD, unsigned int Threads, ScanCache* Cache = NULL);
+	~AsyncScanner();
+
+	// scans the file at Path
+	ULONGLONG submit(const char* Path, int Mode, void* UserData = NULL);
+
+	// scans a buffer, which must stay valid until its completion is taken
+	ULONGLONG submit(const BYTE* Buffer, DWORD Size, int Mode, void* UserData = NULL);
+
+	// the scan completes as ASYNC_CANCELLED, unless it finished already. false if the ticket is unknown or finished
+	bool cancel(ULONGLONG Ticket);
+
+	// takes a completion if one is waiting
+	bool poll(ScanCompletion &C);
+
+	// waits up to TimeoutMs (-1: no limit) for a completion
+	bool wait(ScanCompletion &C, int TimeoutMs = -1);
+
+	// scans submitted and not taken yet
+	size_t pending();
+
+	// readable while completions are waiting, -1 if not available
+	inline int getEventFd() {
+		return EventFd;
+	}
+
+#ifdef ASYNC_COROUTINES
+	/* co_await Scanner.scan(Path, Mode) suspends the coroutine until the scan completes. It's resumed by the
+	 * thread calling poll() or wait(), e.g. the event loop, not by a pool thread.
+	 */
+	struct Awaitable
+	{
+		AsyncScanner				&Scanner;
+		Job							J;
+		ScanCompletion				Result;
+
+		bool await_ready()	{ return false; }
+		bool await_suspend(coroutine_handle<> Handle) {
+			J.Result = &Result;
+			J.Resume = Handle.address();
+			if(Scanner.queue(J))	return true;
+
+			// the scanner is shutting down, don't suspend
+			Result.Ticket = 0;
+			Result.Status = ASYNC_CANCELLED;
+			Result.UserData = NULL;
+			return false;
+		}
+		ScanCompletion await_resume()	{ return Result; }
+	};
+
+	Awaitable scan(const char* Path, int Mode);
+	Awaitable scan(const BYTE* Buffer, DWORD Size, int Mode);
+#endif
+};
+
+#endif
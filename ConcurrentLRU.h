@@ -0,0 +1,89 @@
+/*
+ * ConcurrentLRU.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ConcurrentLRU_
+#define _ConcurrentLRU_
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "headers/PE.h"
+
+#define LRU_SHARDS		16					// independent locks of a ConcurrentLRU
+
+/* A bounded map shared by worker threads. It is split in shards, each with its own lock and its own
+ * least recently used list, so workers hitting different keys rarely wait for each other.
+ */
+template <class K, class V, class H>
+class ConcurrentLRU
+{
+private:
+	typedef list<pair<K, V> >								EntryList;
+
+	struct Shard
+	{
+		mutex												Lock;
+		EntryList											Order;		// most recently used first
+		unordered_map<K, typename EntryList::iterator, H>	Map;
+	};
+
+	Shard			Shards[LRU_SHARDS];
+	size_t			ShardCapacity;
+
+	inline Shard& getShard(const K &Key) {
+		size_t h = H()(Key);
+		return Shards[(h ^ (h >> 17)) % LRU_SHARDS];
+	}
+
+public:
+	ConcurrentLRU(size_t Capacity) {
+		ShardCapacity = max(Capacity / LRU_SHARDS, (size_t)1);
+	}
+
+	bool get(const K &Key, V &Value) {
+		Shard &S = getShard(Key);
+		lock_guard<mutex> Guard(S.Lock);
+
+		typename unordered_map<K, typename EntryList::iterator, H>::iterator it = S.Map.find(Key);
+		if(it == S.Map.end())	return false;
+
+		S.Order.splice(S.Order.begin(), S.Order, it->second);
+		Value = it->second->second;
+		return true;
+	}
+
+	void put(const K &Key, const V &Value) {
+		Shard &S = getShard(Key);
+		lock_guard<mutex> Guard(S.Lock);
+
+		typename unordered_map<K, typename EntryList::iterator, H>::iterator it = S.Map.find(Key);
+		if(it != S.Map.end()) {
+			it->second->second = Value;
+			S.Order.splice(S.Order.begin(), S.Order, it->second);
+			return;
+		}
+
+		if(S.Map.size() >= ShardCapacity) {
+			S.Map.erase(S.Order.back().first);
+			S.Order.pop_back();
+		}
+
+		S.Order.push_front(make_pair(Key, Value));
+		S.Map[Key] = S.Order.begin();
+	}
+
+	void clear() {
+		for(int i = 0; i < LRU_SHARDS; i++) {
+			lock_guard<mutex> Guard(Shards[i].Lock);
+			Shards[i].Map.clear();
+			Shards[i].Order.clear();
+		}
+	}
+};
+
+#endif
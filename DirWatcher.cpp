@@ -0,0 +1,193 @@
+/*
+ * DirWatcher.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "DirWatcher.h"
+
+static int SignalPipe[2] = { -1, -1 };		// the signal handler writes the signal number, run() reads it
+
+static void onSignal(int Signal)
+{
+	int Saved = errno;
+	char c = (char)Signal;
+	if(write(SignalPipe[1], &c, 1) < 0) {}
+	errno = Saved;
+}
+
+DirWatcher::DirWatcher(PackiD &iD, unsigned int Threads, int Mode, WatchSink Sink, void* Context, ScanCache* Cache)
+	: Scanner(iD, Threads, Cache), Mode(Mode), Sink(Sink), Context(Context)
+{
+	InotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+DirWatcher::~DirWatcher()
+{
+	if(InotifyFd >= 0)	close(InotifyFd);
+}
+
+bool DirWatcher::watch(const char* Dir, bool Existing)
+{
+	if(InotifyFd < 0)	return false;
+
+	// a file counts once its writer closed it, or once it was moved in complete. Removed or moved away, it's forgotten
+	int Wd = inotify_add_watch(InotifyFd, Dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+	if(Wd < 0)	return false;
+
+	Dirs[Wd] = Dir;
+	if(Existing)	submitExisting(Dir);
+	return true;
+}
+
+void DirWatcher::submit(const string &Path)
+{
+	struct stat st;
+	if(stat(Path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))	return;
+
+	WatchedFile File = { st.st_dev, st.st_ino, st.st_size, st.st_mtim };
+	map<string, WatchedFile>::iterator Last = Taken.find(Path);
+	if(Last != Taken.end() && Last->second == File)	return;
+	Taken[Path] = File;
+
+	ULONGLONG Ticket = Scanner.submit(Path.c_str(), Mode);
+	if(Ticket)	Pending[Ticket] = Path;
+}
+
+void DirWatcher::submitExisting(const string &Dir)
+{
+	DIR* d = opendir(Dir.c_str());
+	if(!d)	return;
+
+	struct dirent* Entry;
+	while((Entry = readdir(d)) != NULL)
+	{
+		if(Entry->d_name[0] == '.')		continue;
+
+		submit(Dir + "/" + Entry->d_name);
+	}
+	closedir(d);
+}
+
+void DirWatcher::readEvents()
+{
+	// aligned for the inotify_event structs read into it
+	alignas(struct inotify_event) char Buffer[WATCH_EVENT_BUFFER];
+
+	for(;;)
+	{
+		ssize_t Size = read(InotifyFd, Buffer, sizeof(Buffer));
+		if(Size <= 0)	return;
+
+		for(char* p = Buffer; p < Buffer + Size; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+		{
+			const struct inotify_event* Event = (const struct inotify_event*)p;
+
+			// the queue overflowed, events were lost: look at every directory again, submit() skips what was taken
+			if(Event->mask & IN_Q_OVERFLOW) {
+				for(map<int, string>::iterator it = Dirs.begin(); it != Dirs.end(); ++it)
+					submitExisting(it->second);
+				continue;
+			}
+
+			map<int, string>::iterator Dir = Dirs.find(Event->wd);
+			if(Dir == Dirs.end())	continue;
+
+			// the directory was removed or unmounted, with the files in it
+			if(Event->mask & IN_IGNORED) {
+				string Prefix = Dir->second + "/";
+				map<string, WatchedFile>::iterator it = Taken.lower_bound(Prefix);
+				while(it != Taken.end() && !it->first.compare(0, Prefix.size(), Prefix)) {
+					// not the files of another watched directory below this one
+					if(it->first.find('/', Prefix.size()) == string::npos)	Taken.erase(it++);
+					else													++it;
+				}
+
+				Dirs.erase(Dir);
+				continue;
+			}
+
+			if(!Event->len || (Event->mask & IN_ISDIR) || Event->name[0] == '.')	continue;
+
+			string Path = Dir->second + "/" + Event->name;
+			if(Event->mask & (IN_DELETE | IN_MOVED_FROM))	Taken.erase(Path);
+			else											submit(Path);
+		}
+	}
+}
+
+void DirWatcher::finish(const ScanCompletion &C)
+{
+	map<ULONGLONG, string>::iterator it = Pending.find(C.Ticket);
+	if(it == Pending.end())	return;
+
+	Sink(it->second, C, Context);
+	Pending.erase(it);
+}
+
+int DirWatcher::run()
+{
+	if(InotifyFd < 0 || Dirs.empty())		return 1;
+
+	if(pipe2(SignalPipe, O_CLOEXEC) != 0)	return 1;
+
+	struct sigaction Action;
+	memset(&Action, 0, sizeof(Action));
+	Action.sa_handler = onSignal;
+	sigemptyset(&Action.sa_mask);
+	sigaction(SIGINT, &Action, NULL);
+	sigaction(SIGTERM, &Action, NULL);
+
+	bool Running = true;
+	while(Running)
+	{
+		struct pollfd fds[3];
+		fds[0].fd = InotifyFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = Scanner.getEventFd();
+		fds[1].events = POLLIN;
+		fds[2].fd = SignalPipe[0];
+		fds[2].events = POLLIN;
+
+		if(poll(fds, 3, -1) < 0) {
+			if(errno == EINTR)	continue;
+			break;
+		}
+
+		if(fds[2].revents & POLLIN) {
+			char Signal;
+			if(read(SignalPipe[0], &Signal, 1) == 1)	Running = false;
+		}
+
+		if(fds[0].revents & POLLIN)		readEvents();
+
+		ScanCompletion C;
+		while(Scanner.poll(C))	finish(C);
+	}
+
+	// no new files, the scans already queued still reach the sink
+	ScanCompletion C;
+	while(Pending.size() && Scanner.wait(C))	finish(C);
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	close(SignalPipe[0]);
+	close(SignalPipe[1]);
+	SignalPipe[0] = SignalPipe[1] = -1;
+
+	return 0;
+}
+
+#endif
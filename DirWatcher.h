@@ -0,0 +1,84 @@
+/*
+ * DirWatcher.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _DirWatcher_
+#define _DirWatcher_
+
+#ifdef __linux__
+
+#include <string>
+#include <map>
+#include <sys/stat.h>
+#include "AsyncScanner.h"
+
+#define WATCH_EVENT_BUFFER		65536			// bytes of inotify events read at once
+
+// a version of a file: the same path is scanned again only if it's another file or it was written since
+struct WatchedFile
+{
+	dev_t		Dev;
+	ino_t		Ino;
+	off_t		Size;
+	timespec	Modified;
+
+	bool operator==(const WatchedFile &Other) const
+	{
+		return Dev == Other.Dev && Ino == Other.Ino && Size == Other.Size &&
+			Modified.tv_sec == Other.Modified.tv_sec && Modified.tv_nsec == Other.Modified.tv_nsec;
+	}
+};
+
+// where the results of a DirWatcher go, called from the thread of run() one result at a time
+typedef void (*WatchSink)(const string &Path, const ScanCompletion &Result, void* Context);
+
+/* Scans the files dropped into spool directories as soon as they are complete: a file is taken when it's closed
+ * after writing, or moved into the directory. Hidden files (.name) are skipped, a writer can write one and rename
+ * it once done. The scans run on an AsyncScanner, the database is loaded once for all of them.
+ * run() watches until SIGINT or SIGTERM, then waits for the scans already queued.
+ * A file is taken once per version, rescanning a directory after an inotify overflow skips what was already taken.
+ * That's kept in memory only: watch() with Existing takes every file in the directory again, so a watcher that is
+ * restarted reports the whole spool again. Consumers should remove or move away the files they processed.
+ */
+class DirWatcher
+{
+private:
+	AsyncScanner					Scanner;
+	int								Mode;
+	WatchSink						Sink;
+	void*							Context;
+
+	int								InotifyFd;
+	map<int, string>				Dirs;				// watch descriptor -> directory
+	map<ULONGLONG, string>			Pending;			// ticket -> file being scanned
+	map<string, WatchedFile>		Taken;				// path -> version last submitted, until the file is gone
+
+	// queues Path unless this version of it was already taken
+	void submit(const string &Path);
+
+	// queues every file already in Dir, e.g. the spool backlog or events lost by an overflow
+	void submitExisting(const string &Dir);
+
+	void readEvents();
+
+	// hands a finished scan to the sink
+	void finish(const ScanCompletion &C);
+
+public:
+	// the PackiD and the ScanCache (if any) must outlive the DirWatcher
+	DirWatcher(PackiD &iD, unsigned int Threads, int Mode, WatchSink Sink, void* Context, ScanCache* Cache = NULL);
+	~DirWatcher();
+
+	// Existing also scans the files already in the directory
+	bool watch(const char* Dir, bool Existing = true);
+
+	int run();
+};
+
+#endif
+
+#endif
@@ -10,33 +10,41 @@
 #include <fstream>
 #include <exception>
 #include <algorithm>
+#include <climits>
+#include <thread>
+#include <functional>
+#include "PackiD.h"
 #include "headers/PE.h"
 #include "headers/Util.h"
-#include "PackiD.h"
+#include "headers/Hash.h"
 
 void PackiD::init()
 {
-	SigSize = 0;
+	MaxSigSize = 0;
+	HasConstraints = false;
 	DbLoaded = false;
+	DbHash = 0;
 	Mode = MODE_DEEP;
+	SectionThreads = max(thread::hardware_concurrency(), 1u);
+	CarveDepth = CARVE_MAX_DEPTH;
+	CarveImages = CARVE_MAX_IMAGES;
 	Signatures.reserve(EXPECTED_NUM_OF_SIGS);		// expected number of signatures, apprx.
 }
 
-PackiD::PackiD()
+PackiD::PackiD() : EPCache(EP_CACHE_ENTRIES)
 {
 	init();
 }
 
-PackiD::PackiD(char* db_file)
+PackiD::PackiD(char* db_file) : EPCache(EP_CACHE_ENTRIES)
 {
 	init();
 	loadDB(db_file);
 }
 
-// remove spaces and preprocess the signature
-void PackiD::preprocessSignature(string s, Signature *sig)
+// convert every two characters to one byte, and convert every '?' to F and mark the wildcard in WildCards
+static void parseBytes(const string &s, vector<BYTE> &Values, vector<BYTE> &WildCards)
 {
-	string s2;
 	BYTE wbyte = 0;
 	BYTE sbyte = 0;
 	map<char, unsigned char> Char2Num;
@@ -57,7 +65,6 @@ void PackiD::preprocessSignature(string s, Signature *sig)
 	Char2Num['E'] = 0x0E;
 	Char2Num['F'] = 0x0F;
 
-	//step1 --- convert every two characters to one byte, and convert every '?' to F and mark the wildcard in WildCardMap
 	for(unsigned int i = 0; i < s.length(); i++)
 	{
 		if(isspace(s[i]))
@@ -85,11 +92,169 @@ void PackiD::preprocessSignature(string s, Signature *sig)
 
 		i++;
 
-		sig->SignatureValues.push_back(sbyte);
-		sig->SignatureWildCards.push_back(wbyte);
+		Values.push_back(sbyte);
+		WildCards.push_back(wbyte);
 	}	
 }
 
+// compiles the gaps and alternations that follow the prefix of a signature
+static bool compileTokens(const string &s, vector<SigToken> &Tokens, DWORD &MinSize, DWORD &MaxSize)
+{
+	size_t i = 0;
+
+	while(i < s.length())
+	{
+		SigToken Token;
+		Token.GapMin = Token.GapMax = 0;
+
+		if(s[i] == '[')
+		{
+			size_t End = s.find(']', i);
+			if(End == string::npos)	return false;
+
+			string Gap = s.substr(i + 1, End - i - 1);
+			char* p;
+			Token.GapMin = Token.GapMax = strtoul(Gap.c_str(), &p, 10);
+			if(*p == '-')	Token.GapMax = strtoul(p + 1, &p, 10);
+			if(*p || Gap.empty() || !isdigit(Gap[Gap.length() - 1]) || Token.GapMin > Token.GapMax || Token.GapMax > SIG_MAX_GAP)
+				return false;
+
+			MinSize += Token.GapMin;
+			MaxSize += Token.GapMax;
+			i = End + 1;
+		}
+		else if(s[i] == '(')
+		{
+			size_t End = s.find(')', i);
+			if(End == string::npos)	return false;
+
+			string Group = s.substr(i + 1, End - i - 1);
+			if(Group.find_first_of("[(") != string::npos)	return false;
+
+			DWORD Shortest = (DWORD)-1, Longest = 0;
+			size_t From = 0;
+			for(;;) {
+				size_t To = Group.find('|', From);
+				Token.Alternatives.resize(Token.Alternatives.size() + 1);
+				parseBytes(Group.substr(From, To == string::npos ? string::npos : To - From), Token.Alternatives.back().first, Token.Alternatives.back().second);
+
+				Shortest = min(Shortest, (DWORD)Token.Alternatives.back().first.size());
+				Longest = max(Longest, (DWORD)Token.Alternatives.back().first.size());
+				if(To == string::npos)	break;
+				From = To + 1;
+			}
+
+			MinSize += Shortest;
+			MaxSize += Longest;
+			i = End + 1;
+		}
+		else
+		{
+			// bytes up to the next gap or alternation
+			size_t End = s.find_first_of("[(", i);
+			if(End == string::npos)	End = s.length();
+			if(s.find_first_of("])|", i) < End)	return false;
+
+			Token.Alternatives.resize(1);
+			parseBytes(s.substr(i, End - i), Token.Alternatives[0].first, Token.Alternatives[0].second);
+			i = End;
+
+			if(Token.Alternatives[0].first.empty())	continue;			// only spaces
+			MinSize += Token.Alternatives[0].first.size();
+			MaxSize += Token.Alternatives[0].first.size();
+		}
+
+		Tokens.push_back(Token);
+	}
+
+	return MaxSize <= SIG_MAX_SPAN;
+}
+
+// remove spaces and preprocess the signature
+void PackiD::preprocessSignature(string s, Signature *sig)
+{
+	DWORD MinSize = 0, MaxSize = 0;
+
+	//step1 --- the fixed prefix, then the gaps and alternations if any. A signature that doesn't follow
+	// their syntax is read as PEiD reads it, some PEiD databases have junk in their signatures
+	size_t Extended = s.find_first_of("[(");
+	if(Extended != string::npos && (s.find_first_of("])|") < Extended || !compileTokens(s.substr(Extended), sig->Tokens, MinSize, MaxSize))) {
+		sig->Tokens.clear();
+		Extended = string::npos;
+		MinSize = MaxSize = 0;
+	}
+
+	parseBytes(s.substr(0, Extended), sig->SignatureValues, sig->SignatureWildCards);
+	sig->MinSize = sig->SignatureValues.size() + MinSize;
+	sig->MaxSize = sig->SignatureValues.size() + MaxSize;
+
+	//step2 --- the same in 8 byte chunks for scanBatch(), a wildcard matches anything past the end of the signature
+	size_t Chunks = (sig->SignatureValues.size() + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG);
+	vector<BYTE> Values(Chunks * sizeof(ULONGLONG), 0xFF), WildCards(Chunks * sizeof(ULONGLONG), 0xFF);
+	copy(sig->SignatureValues.begin(), sig->SignatureValues.end(), Values.begin());
+	copy(sig->SignatureWildCards.begin(), sig->SignatureWildCards.end(), WildCards.begin());
+
+	sig->BatchValues.resize(Chunks);
+	sig->BatchWildCards.resize(Chunks);
+	if(Chunks) {
+		memcpy(sig->BatchValues.data(), Values.data(), Values.size());
+		memcpy(sig->BatchWildCards.data(), WildCards.data(), WildCards.size());
+	}
+}
+
+
+bool PackiD::parseConstraint(const string &Line, Signature* sig)
+{
+	char* End;
+
+	if(Line.find(SCOPEFIELD) == 0)
+	{
+		if(Line.compare(SCOPEFIELD_LEN, string::npos, "overlay"))	return false;
+		sig->OverlayOnly = true;
+		return true;
+	}
+
+	if(Line.find(RANGEFIELD) == 0)
+	{
+		const char* p = Line.c_str() + RANGEFIELD_LEN;
+		ULONGLONG Start = strtoull(p, &End, 0);
+		if(End == p || *End != '-')		return false;
+
+		p = End + 1;
+		ULONGLONG Stop = strtoull(p, &End, 0);
+		if(End == p || *End || Start >= Stop || Stop > (DWORD)-1)	return false;
+
+		sig->RangeStart = (DWORD)Start;
+		sig->RangeEnd = (DWORD)Stop;
+		return true;
+	}
+
+	static const struct { const char* Name; int Anchor; } Anchors[] = {
+		{ "ep", ANCHOR_EP }, { "section_start", ANCHOR_SECTION_START }, { "section_end", ANCHOR_SECTION_END },
+		{ "overlay", ANCHOR_OVERLAY }, { "imports", ANCHOR_IMPORTS }
+	};
+
+	string Value = Line.substr(ANCHORFIELD_LEN);
+	size_t NameEnd = Value.find_first_of("+-");
+	string Name = Value.substr(0, NameEnd);
+
+	sig->Anchor = ANCHOR_NONE;
+	for(unsigned int i = 0; i < sizeof(Anchors) / sizeof(Anchors[0]); i++)
+		if(Name == Anchors[i].Name)	sig->Anchor = Anchors[i].Anchor;
+	if(sig->Anchor == ANCHOR_NONE)		return false;
+
+	sig->AnchorDelta = 0;
+	if(NameEnd == string::npos)			return true;
+	if(sig->Anchor == ANCHOR_IMPORTS)	return false;
+
+	// the sign is kept, strtoll reads it
+	const char* p = Value.c_str() + NameEnd;
+	long long Delta = strtoll(p, &End, 0);
+	if(End == p || *End || Delta < INT_MIN || Delta > INT_MAX)	return false;
+
+	sig->AnchorDelta = (LONG)Delta;
+	return true;
+}
 
 bool PackiD::loadDB(char* FileName)
 {
@@ -109,13 +274,16 @@ bool PackiD::loadDB(char* FileName)
     FileHandle.read ((char *)LoadAddr, FileSize);
     FileHandle.close();
 
+	DbHash = hash64(LoadAddr, FileSize);
+	EPCache.clear();
+
 	// ---- Load DB ---- //
 	bool failure = false;
 	char* cLine = 0;
 	DWORD LineSize = 0;
-	char* BoundAddr = (char*)((DWORD)LoadAddr + FileSize);
+	char* BoundAddr = (char*)((ULONG_PTR)LoadAddr + FileSize);
 	int i = 0;
-	while(((DWORD)mp < (DWORD)BoundAddr) && !failure)
+	while(((ULONG_PTR)mp < (ULONG_PTR)BoundAddr) && !failure)
 	{		
 		//cout << i++ << '\r';
 		string Line = getLineFromMem((LPVOID &)mp, BoundAddr);
@@ -128,6 +296,11 @@ bool PackiD::loadDB(char* FileName)
 			continue;
 		
 		Signature signat;
+		signat.Anchor = ANCHOR_NONE;
+		signat.AnchorDelta = 0;
+		signat.RangeStart = 0;
+		signat.RangeEnd = (DWORD)-1;
+		signat.OverlayOnly = false;
 
 		// get tool name
 		signat.Tool = Line;
@@ -158,6 +331,24 @@ bool PackiD::loadDB(char* FileName)
 		else
 			failure = true;
 
+		// optional anchor =, range = and scope = lines
+		for(;;) {
+			LPBYTE Next = mp;
+			Line = getLineFromMem((LPVOID &)mp, BoundAddr);
+			Line = trim(Line);
+
+			if(Line.find(ANCHORFIELD) != 0 && Line.find(RANGEFIELD) != 0 && Line.find(SCOPEFIELD) != 0) {
+				mp = Next;
+				break;
+			}
+
+			// ep_only = true signatures are tried at the entry point only
+			if(signat.isEP || !parseConstraint(Line, &signat))
+				failure = true;
+		}
+		HasConstraints |= signat.Anchor != ANCHOR_NONE || signat.RangeStart != 0 || signat.RangeEnd != (DWORD)-1;
+
+		MaxSigSize = max(MaxSigSize, signat.MaxSize);
 		Signatures.push_back(signat);
 	}
 	delete[] LoadAddr;
@@ -170,36 +361,50 @@ bool PackiD::loadDB(char* FileName)
 }
 
 
-string PackiD::scanPE(PE &P)
+// the raw data of a section as it's mapped: the offset rounded down and the size rounded up to FileAlignment, within VirtualSize
+static void getSectionRange(PE &P, PIMAGE_SECTION_HEADER Section, DWORD &PointerToRawData, DWORD &SizeOfRawData)
 {
-	DWORD EPSizeOfRawData;
-	DWORD EPVirtualAddress;
-	DWORD EPPointerToRawData;
-	DWORD FileSize, oFileSize, SizeOfHeaders;
-	string result = NO_MATCH;						// default value if no match found
-	LPBYTE EPAddr, SecAddr, oLoadAddr, LoadAddr;
+	// a mapped image has it at its virtual address already
+	if(P.isMapped()) {
+		PointerToRawData = P.getSectionOffset(Section);
+		SizeOfRawData = P.getSectionDataSize(Section);
+		return;
+	}
 
 	// get FileAlignment
-	DWORD FileAlignment;
-	if(P.isPE64()) {
-		FileAlignment = P.PEheader64->OptionalHeader.FileAlignment;
-		SizeOfHeaders = P.PEheader64->OptionalHeader.SizeOfHeaders;
-	} else {
-		FileAlignment = P.PEheader->OptionalHeader.FileAlignment;
-		SizeOfHeaders = P.PEheader->OptionalHeader.SizeOfHeaders;
-	}
+	DWORD FileAlignment = P.Header.FileAlignment;
 
 	if (FileAlignment == 0) FileAlignment = 0x200;	// valid for both 32/64 bit.
 
-	// if no section found
-	if(P.getExecSection() == NULL || P.getEntryPoint() > P.FileSize)	return result;
-		
 	// round up SizeOfRawData
-	EPSizeOfRawData = roundUp(P.getExecSection()->SizeOfRawData, FileAlignment);
-	EPSizeOfRawData = min(P.getExecSection()->Misc.VirtualSize, EPSizeOfRawData);
+	SizeOfRawData = roundUp(Section->SizeOfRawData, FileAlignment);
+	SizeOfRawData = min(Section->Misc.VirtualSize, SizeOfRawData);
 
 	// round down PointerToRawData to nearest FileAlignment		
-	EPPointerToRawData = roundDown(P.getExecSection()->PointerToRawData, FileAlignment);
+	PointerToRawData = roundDown(Section->PointerToRawData, FileAlignment);
+}
+
+// index in PE::getSections() of the section whose raw data holds Offset, -1 if none
+static int findSection(PE &P, DWORD Offset)
+{
+	const vector<PIMAGE_SECTION_HEADER>& Secs = P.getSections();
+
+	for(unsigned int i = 0; i < Secs.size(); i++)
+		if(Offset >= P.getSectionOffset(Secs[i]) && Offset - P.getSectionOffset(Secs[i]) < P.getSectionDataSize(Secs[i]))
+			return i;
+	return -1;
+}
+
+bool PackiD::getLayout(PE &P, int Mode, ScanLayout &L)
+{
+	DWORD EPSizeOfRawData;
+	DWORD EPVirtualAddress;
+	DWORD EPPointerToRawData;
+
+	// if no section found
+	if(P.getExecSection() == NULL || P.getEntryPoint() > P.FileSize)	return false;
+
+	getSectionRange(P, P.getExecSection(), EPPointerToRawData, EPSizeOfRawData);
 	EPVirtualAddress = P.getExecSection()->VirtualAddress;
 
 	// not a valid pe
@@ -208,59 +413,848 @@ string PackiD::scanPE(PE &P)
 		(P.getEntryPoint() - EPVirtualAddress > P.FileSize) ||
 		(P.getEntryPoint() - EPVirtualAddress) + EPPointerToRawData > P.FileSize
 		)
-		return result;
+		return false;
 
 	if( (EPSizeOfRawData > P.FileSize) || (EPPointerToRawData + EPSizeOfRawData > P.FileSize) )
 		EPSizeOfRawData = P.FileSize - EPPointerToRawData;
 
-	EPAddr = P.LoadAddr + (P.getEntryPoint() - EPVirtualAddress) + EPPointerToRawData;
+	L.Base = P.LoadAddr;
+	L.EPAddr = P.LoadAddr + (P.getEntryPoint() - EPVirtualAddress) + EPPointerToRawData;
+	L.EPSize = P.FileSize - (DWORD)(L.EPAddr - P.LoadAddr);						// bytes from the entry point to the end of file
+
+	// an image with unreadable ranges is only matched where it could be read
+	if(P.getReadable().size())
+		L.EPSize = P.getReadableEnd((DWORD)(L.EPAddr - P.LoadAddr)) - (DWORD)(L.EPAddr - P.LoadAddr);
 
 	// scan the whole file with signatures that have ep_only = false
 	if(Mode == MODE_HARDCORE)
 	{
-		oFileSize = P.FileSize;
-		oLoadAddr = P.LoadAddr;
+		L.Region = REGION_FILE;
+		L.RegionSize = P.FileSize;
+		L.RegionAddr = P.LoadAddr;
+	}
+	else if(Mode == MODE_OVERLAY)
+	{
+		DWORD Offset, Size;
+		P.getOverlay(Offset, Size);
+		L.Region = REGION_OVERLAY;
+		L.RegionSize = Size;
+		L.RegionAddr = P.LoadAddr + Offset;
+	}
+	else if(Mode == MODE_DEEP)
+	{
+		L.Region = REGION_EP_SECTION;
+		L.RegionSize = EPSizeOfRawData;
+		L.RegionAddr = P.LoadAddr + EPPointerToRawData;					// scan the whole section of entry point with signatures that have ep_oly = false
+	}
+	else																// MODE_NORMAL, every signature is tried at the entry point only
+	{
+		L.Region = REGION_EP;
+		L.RegionSize = 0;
+		L.RegionAddr = L.EPAddr;
+	}
+
+	L.SkipEP = false;
+	L.File = &P;
+	L.PieceStart = 0;
+	L.PieceEnd = (DWORD)-1;
+
+	const vector<PIMAGE_SECTION_HEADER>& Secs = P.getSections();
+	L.EPSection = (int)(find(Secs.begin(), Secs.end(), P.getExecSection()) - Secs.begin());
+	L.Section = (L.Region == REGION_FILE || L.Region == REGION_OVERLAY) ? -1 : L.EPSection;
+
+	if(!HasConstraints)	return true;
+
+	// the anchors of this file
+	L.EPOffset = (DWORD)(L.EPAddr - L.Base);
+	DWORD OverlaySize;
+	P.getOverlay(L.Overlay, OverlaySize);
+	L.SectionRaw.clear();
+	for(unsigned int i = 0; i < Secs.size(); i++) {
+		DWORD Start = P.getSectionOffset(Secs[i]);
+		if(Start >= P.FileSize || !P.getSectionDataSize(Secs[i]))	continue;
+
+		DWORD End = Start + min(P.getSectionDataSize(Secs[i]), P.FileSize - Start);
+		L.SectionRaw.push_back(make_pair(Start, End));
+	}
+
+	L.ImportStart = L.ImportEnd = 0;
+	DWORD ImportRva = P.Header.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
+	DWORD ImportSize = P.Header.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size;
+	const SectionRange* Range = ImportRva ? P.getSectionRange(ImportRva) : NULL;
+	if(Range && ImportRva - Range->VirtualAddress < Range->RawEnd - Range->RawStart) {
+		L.ImportStart = Range->RawStart + (ImportRva - Range->VirtualAddress);
+		L.ImportEnd = L.ImportStart + min(ImportSize, Range->RawEnd - L.ImportStart);
+	}
+
+	return true;
+}
+
+bool PackiD::getSectionLayouts(PE &P, vector<ScanLayout> &Layouts)
+{
+	ScanLayout L;
+
+	Layouts.clear();
+	if(!getLayout(P, MODE_DEEP, L))	return false;
+
+	// only the section of the entry point tries ep_only = true signatures, at the entry point
+	L.Region = REGION_EXEC_SECTION;
+	Layouts.push_back(L);
+	L.SkipEP = true;
+
+	const vector<PIMAGE_SECTION_HEADER>& Secs = P.getSections();
+	for(unsigned int i = 0; i < Secs.size(); i++)
+	{
+		if((int)i == L.EPSection)	continue;
+		if(!(Secs[i]->Characteristics & (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)))	continue;
+
+		DWORD PointerToRawData, SizeOfRawData;
+		getSectionRange(P, Secs[i], PointerToRawData, SizeOfRawData);
+
+		if(PointerToRawData >= P.FileSize || SizeOfRawData == 0)	continue;
+		if(SizeOfRawData > P.FileSize - PointerToRawData)	SizeOfRawData = P.FileSize - PointerToRawData;
+
+		L.RegionAddr = P.LoadAddr + PointerToRawData;
+		L.RegionSize = SizeOfRawData;
+		L.Section = i;
+
+		// sections sharing their raw data are scanned once
+		bool Seen = false;
+		for(size_t j = 0; j < Layouts.size() && !Seen; j++)
+			Seen = Layouts[j].RegionAddr == L.RegionAddr && Layouts[j].RegionSize == L.RegionSize;
+		if(!Seen)	Layouts.push_back(L);
+	}
+
+	return true;
+}
+
+// keeps the first match
+static int firstMatch(const SignatureMatch &Match, void* Context)
+{
+	*(string*)Context = Match.Tool;
+	return MATCH_STOP;
+}
+
+string PackiD::scanPE(PE &P, int Mode, int &Status)
+{
+	string result = NO_MATCH;						// default value if no match found
+	ScanLayout L;
+	ScanControl Control = { NULL, false, chrono::steady_clock::time_point(), NULL };
+
+	Mode = validMode(Mode);
+	Status = SCAN_DONE;
+
+	if(Mode & MODE_WITH_OVERLAY)
+	{
+		result = scanPE(P, Mode & ~MODE_WITH_OVERLAY, Status);
+		if(!result.compare(NO_MATCH))	result = scanPE(P, MODE_OVERLAY);
+		return result;
+	}
+
+	if(Mode == MODE_ADAPTIVE)
+	{
+		// the first tier goes through the entry point cache
+		result = scanPE(P, MODE_NORMAL);
+		if(!result.compare(NO_MATCH) && Adaptive.LastTier > MODE_NORMAL)
+			Status = escalate(P, MODE_DEEP, firstMatch, &result, NULL);
+		if(Status == SCAN_STOPPED)	Status = SCAN_DONE;
+		return result;
+	}
+
+	if(Mode == MODE_EXEC_SECTIONS)
+	{
+		vector<SignatureMatch> Matches;
+		matchSections(P, true, Matches, NULL);
+		if(Matches.size())	result = Matches[0].Tool;
+		return result;
+	}
+
+	if(!getLayout(P, Mode, L))	return result;
+
+	// the bytes at the entry point give the result, unless anchors and ranges also depend on where it is
+	if(Mode == MODE_NORMAL && !HasConstraints)
+	{
+		EPWindowKey Key;
+		Key.Size = min(L.EPSize, MaxSigSize);
+		Key.Window = hash64(L.EPAddr, Key.Size);
+		Key.Db = DbHash;
+
+		if(EPCache.get(Key, result))	return result;
+
+		matchSignatures(L, firstMatch, &result, Control);
+		EPCache.put(Key, result);
+		return result;
 	}
+
+	matchSignatures(L, firstMatch, &result, Control);
+	return result;
+}
+
+// the caller's callback and context, remembering whether a tier reported anything
+struct TierMatches
+{
+	MatchCallback					Callback;
+	void*							Context;
+	bool							Found;
+};
+
+static int forwardTierMatch(const SignatureMatch &Match, void* Context)
+{
+	TierMatches* t = (TierMatches*)Context;
+	t->Found = true;
+	return t->Callback(Match, t->Context);
+}
+
+int PackiD::scanPE(PE &P, int Mode, MatchCallback Callback, void* Context, const atomic<bool>* Cancel)
+{
+	ScanLayout L;
+	ScanControl Control = { Cancel, false, chrono::steady_clock::time_point(), NULL };
+
+	Mode = validMode(Mode);
+
+	if(Mode & MODE_WITH_OVERLAY)
+	{
+		// the overlay only when the mode found nothing, as the other overloads do
+		TierMatches Tier = { Callback, Context, false };
+		int Status = scanPE(P, Mode & ~MODE_WITH_OVERLAY, forwardTierMatch, &Tier, Cancel);
+		if(Status == SCAN_STOPPED || Status == SCAN_CANCELLED || Tier.Found)	return Status;
+
+		// a base mode that timed out still has the overlay scanned, and still reports the timeout
+		int Overlay = scanPE(P, MODE_OVERLAY, Callback, Context, Cancel);
+		return (Overlay == SCAN_DONE) ? Status : Overlay;
+	}
+
+	if(Mode == MODE_ADAPTIVE)	return escalate(P, MODE_NORMAL, Callback, Context, Cancel);
+
+	if(Mode == MODE_EXEC_SECTIONS)
+	{
+		// the sections are matched in parallel, the matches are reported from this thread in database order
+		vector<SignatureMatch> Matches;
+		bool Skipped[REGION_COUNT] = { false };
+
+		if(matchSections(P, false, Matches, Cancel) == SCAN_CANCELLED)	return SCAN_CANCELLED;
+
+		for(size_t i = 0; i < Matches.size(); i++) {
+			if(Skipped[Matches[i].Region])	continue;
+
+			int Next = Callback(Matches[i], Context);
+			if(Next == MATCH_STOP)			return SCAN_STOPPED;
+			if(Next == MATCH_SKIP_REGION)	Skipped[Matches[i].Region] = true;
+		}
+		return SCAN_DONE;
+	}
+
+	if(!getLayout(P, Mode, L))	return SCAN_DONE;
+
+	return matchSignatures(L, Callback, Context, Control);
+}
+
+int PackiD::escalate(PE &P, int FirstTier, MatchCallback Callback, void* Context, const atomic<bool>* Cancel)
+{
+	TierMatches Tier = { Callback, Context, false };
+	int LastTier = min(max(Adaptive.LastTier, MODE_NORMAL), MODE_HARDCORE);
+	int Done = SCAN_DONE;					// SCAN_TIMEOUT once a tier was cut short
+
+	for(int Mode = FirstTier; Mode <= LastTier; Mode++)
+	{
+		ScanLayout L;
+		ScanControl Control = { Cancel, false, chrono::steady_clock::time_point(), NULL };
+		DWORD Bytes = 0, Ms = 0;
+
+		if(!getLayout(P, Mode, L))			return Done;
+		if(!allowTier(P, Mode, Bytes, Ms))	return Done;
+
+		// ep_only = true signatures were tried at the ep by the first tier, they can't match anything new
+		L.SkipEP = Mode > MODE_NORMAL;
+		if(Bytes && L.RegionSize > Bytes)	L.RegionSize = Bytes;
+		if(Ms) {
+			Control.Timed = true;
+			Control.Deadline = chrono::steady_clock::now() + chrono::milliseconds(Ms);
+		}
+
+		int Status = matchSignatures(L, forwardTierMatch, &Tier, Control);
+		if(Status == SCAN_CANCELLED)	return Status;
+		if(Status == SCAN_STOPPED)		return (Done == SCAN_TIMEOUT) ? Done : Status;
+		if(Status == SCAN_TIMEOUT)		Done = SCAN_TIMEOUT;
+		if(Tier.Found)	return Done;
+	}
+
+	return Done;
+}
+
+bool PackiD::allowTier(PE &P, int Tier, DWORD &Bytes, DWORD &Ms)
+{
+	Bytes = Ms = 0;
+
+	if(Tier == MODE_DEEP) {
+		// a low entropy ep section is likely plain compiled code, nothing is hidden deeper
+		if(Adaptive.MinEntropy > 0 && P.getSectionEntropy(P.getExecSection()) < Adaptive.MinEntropy)
+			return false;
+		Bytes = Adaptive.SectionBytes;
+		Ms = Adaptive.SectionMs;
+	}
+	else if(Tier == MODE_HARDCORE) {
+		if(Adaptive.SuspiciousMask) {
+			// import flags are only known once the imports were walked
+			if(Adaptive.SuspiciousMask & (NO_IMPORTS | CORRUPTED_IMPORTS | SUSPICIOUS_IMPORTS))
+				P.getImports();
+			if(!(P.Suspicious & Adaptive.SuspiciousMask))	return false;
+		}
+		Bytes = Adaptive.FileBytes;
+		Ms = Adaptive.FileMs;
+	}
+
+	return true;
+}
+
+int PackiD::scanPE(PE &P, int Mode, const ScanLimits &Limits, MatchCallback Callback, void* Context, ScanCoverage &Coverage,
+				   const atomic<bool>* Cancel)
+{
+	ScanControl Control = { Cancel, Limits.TimeMs != 0, chrono::steady_clock::now() + chrono::milliseconds(Limits.TimeMs), NULL };
+	ULONGLONG Budget = Limits.Bytes ? Limits.Bytes : (ULONGLONG)-1;
+	TierMatches Tier = { Callback, Context, false };
+
+	Coverage.EP = false;
+	Coverage.Covered.clear();
+	Coverage.Bytes = 0;
+
+	// the modes tried in turn, each only if the ones before found nothing
+	Mode = validMode(Mode);
+	int Base = Mode & ~MODE_WITH_OVERLAY;
+	vector<int> Tiers;
+	if(Base == MODE_ADAPTIVE)
+		for(int t = MODE_NORMAL; t <= min(max(Adaptive.LastTier, MODE_NORMAL), MODE_HARDCORE); t++)	Tiers.push_back(t);
 	else
-	{			
-		oFileSize = EPSizeOfRawData;
-		SecAddr = P.LoadAddr + EPPointerToRawData;
+		Tiers.push_back(Base);
+	if(Mode & MODE_WITH_OVERLAY)	Tiers.push_back(MODE_OVERLAY);
 
-		if(Mode == MODE_DEEP) {
-			oFileSize = EPSizeOfRawData;
-			oLoadAddr = SecAddr;										// scan the whole section of entry point with signatures that have ep_oly = false
+	bool Gated = false;					// the adaptive policy stopped escalating
+	int Done = SCAN_DONE;				// SCAN_TIMEOUT once an adaptive tier ran out of its own time
+	for(size_t t = 0; t < Tiers.size() && !Tier.Found; t++)
+	{
+		vector<ScanLayout> Layouts(1);
+		ScanControl TierControl = Control;
+		DWORD Bytes = 0, Ms = 0;
+
+		if(Tiers[t] == MODE_EXEC_SECTIONS)					getSectionLayouts(P, Layouts);
+		else if(!getLayout(P, Tiers[t], Layouts[0]))		Layouts.clear();
+
+		if(Base == MODE_ADAPTIVE && Tiers[t] != MODE_OVERLAY && t > 0) {
+			if(!Gated)	Gated = !allowTier(P, Tiers[t], Bytes, Ms);
+			if(Gated)	continue;
+
+			// ep_only = true signatures were tried at the ep by the first tier
+			for(size_t l = 0; l < Layouts.size(); l++) {
+				Layouts[l].SkipEP = true;
+				if(Bytes && Layouts[l].RegionSize > Bytes)	Layouts[l].RegionSize = Bytes;
+			}
+			chrono::steady_clock::time_point TierDeadline = chrono::steady_clock::now() + chrono::milliseconds(Ms);
+			if(Ms && (!TierControl.Timed || TierDeadline < TierControl.Deadline)) {
+				TierControl.Timed = true;
+				TierControl.Deadline = TierDeadline;
+			}
 		}
-		else {															// MODE_NORMAL
-			oLoadAddr = EPAddr;
+
+		for(size_t l = 0; l < Layouts.size(); l++)
+		{
+			int Status = matchPieces(Layouts[l], forwardTierMatch, &Tier, TierControl, Limits.Prioritize, Budget, Coverage);
+
+			// a tier that ran out of its own time ends as in escalate(), the next one is tried
+			if(Status == SCAN_TIMEOUT && !(Control.Timed && chrono::steady_clock::now() >= Control.Deadline)) {
+				Done = SCAN_TIMEOUT;
+				break;
+			}
+			if(Status != SCAN_DONE)	return Status;
 		}
+	}
 
-	}	
-		
+	return Done;
+}
+
+// adds [Start, End) to the ranges covered, keeping them sorted and merged
+static void addCovered(ScanCoverage &Coverage, DWORD Start, DWORD End)
+{
+	vector<pair<DWORD, DWORD> > &Covered = Coverage.Covered;
+	Coverage.Bytes += End - Start;
+
+	vector<pair<DWORD, DWORD> >::iterator it = Covered.insert(lower_bound(Covered.begin(), Covered.end(), make_pair(Start, End)), make_pair(Start, End));
+	if(it != Covered.begin() && (it - 1)->second >= it->first) {
+		(it - 1)->second = max((it - 1)->second, it->second);
+		it = Covered.erase(it) - 1;
+	}
+	if(it + 1 != Covered.end() && it->second >= (it + 1)->first) {
+		it->second = max(it->second, (it + 1)->second);
+		Covered.erase(it + 1);
+	}
+}
+
+// a piece of a region and how soon it's covered by a scan with ScanLimits::Prioritize
+struct PiecePriority
+{
+	int								Rank;				// 0 the piece of the entry point, 1 its section, 2 the others
+	float							Entropy;			// of the others, higher first
+	DWORD							Start;
+
+	bool operator<(const PiecePriority &p) const {
+		return Rank != p.Rank ? Rank < p.Rank : Entropy > p.Entropy;
+	}
+};
+
+int PackiD::matchPieces(const ScanLayout &L, MatchCallback Callback, void* Context, const ScanControl &Control, bool Prioritize,
+						ULONGLONG &Budget, ScanCoverage &Coverage)
+{
+	if(L.Region == REGION_EP) {
+		int Status = matchSignatures(L, Callback, Context, Control);
+		if(Status == SCAN_DONE)		Coverage.EP = true;
+		return Status;
+	}
+
+	DWORD RegionOffset = (DWORD)(L.RegionAddr - L.Base);
+	vector<PiecePriority> Pieces;
+
+	for(DWORD p = 0; p < L.RegionSize; p = (L.RegionSize - p > SCAN_PIECE) ? p + SCAN_PIECE : L.RegionSize) {
+		PiecePriority Piece = { 2, 0, p };
+		Pieces.push_back(Piece);
+	}
+
+	if(Prioritize && Pieces.size() > 1) {
+		PIMAGE_SECTION_HEADER EPSection = L.File->getExecSection();
+		DWORD EPOffset = (DWORD)(L.EPAddr - L.Base);
+		DWORD SectionStart = L.File->getSectionOffset(EPSection);
+		DWORD SectionEnd = SectionStart + L.File->getSectionDataSize(EPSection);
+
+		for(size_t i = 0; i < Pieces.size(); i++) {
+			DWORD Start = RegionOffset + Pieces[i].Start;
+			DWORD Size = min((DWORD)SCAN_PIECE, L.RegionSize - Pieces[i].Start);
+
+			if(EPOffset >= Start && EPOffset - Start < Size)			Pieces[i].Rank = 0;
+			else if(Start < SectionEnd && Start + Size > SectionStart)	Pieces[i].Rank = 1;
+			else {
+				// the readable bytes only, in an image with holes
+				DWORD Counts[256];
+				memset(Counts, 0, sizeof(Counts));
+				DWORD Counted = L.File->readableHistogram(Start, Size, Counts);
+				Pieces[i].Entropy = histogramEntropy(Counts, Counted);
+			}
+		}
+		stable_sort(Pieces.begin(), Pieces.end());
+	}
+
+	ScanLayout Piece = L;
+	for(size_t i = 0; i < Pieces.size(); i++)
+	{
+		DWORD Size = min((DWORD)SCAN_PIECE, L.RegionSize - Pieces[i].Start);
+		Piece.PieceStart = Pieces[i].Start;
+		Piece.PieceEnd = Pieces[i].Start + Size;
+
+		// out of bytes: the signatures of the entry point cost none, they're still tried
+		bool Spent = Budget < Size;
+		if(Spent && Piece.SkipEP)	return SCAN_BUDGET;
+		if(Spent)	Piece.PieceEnd = Piece.PieceStart;
+
+		int Status = matchSignatures(Piece, Callback, Context, Control);
+		if(Status == SCAN_DONE && !Piece.SkipEP)	Coverage.EP = true;
+		if(Status != SCAN_DONE)	return Status;
+		if(Spent)				return SCAN_BUDGET;
+
+		Piece.SkipEP = true;
+		Budget -= Size;
+		addCovered(Coverage, RegionOffset + Piece.PieceStart, RegionOffset + Piece.PieceEnd);
+	}
+
+	return SCAN_DONE;
+}
+
+int PackiD::collectMatch(const SignatureMatch &Match, void* Context)
+{
+	SectionMatches* m = (SectionMatches*)Context;
+	m->Matches.push_back(Match);
+	if(!m->First)	return MATCH_CONTINUE;
+
+	// signatures after the first found can't come first, the other sections stop before them
+	DWORD First = m->First->load();
+	while(Match.SignatureId < First && !m->First->compare_exchange_weak(First, Match.SignatureId));
+	return MATCH_STOP;
+}
+
+static bool bySignature(const SignatureMatch &a, const SignatureMatch &b)
+{
+	return a.SignatureId < b.SignatureId;
+}
+
+int PackiD::matchSections(PE &P, bool FirstOnly, vector<SignatureMatch> &Matches, const atomic<bool>* Cancel)
+{
+	vector<ScanLayout> Layouts;
+	Matches.clear();
+
+	if(!getSectionLayouts(P, Layouts))	return SCAN_DONE;
+
+	atomic<DWORD> First((DWORD)-1);
+	atomic<size_t> Next(0);
+	vector<SectionMatches> Found(Layouts.size());
+
+	ScanControl Control = { Cancel, false, chrono::steady_clock::time_point(), NULL };
+	if(FirstOnly)	Control.Bound = &First;
+
+	for(size_t i = 0; i < Layouts.size(); i++)
+		Found[i].First = FirstOnly ? &First : NULL;
+
+	// this thread scans too
+	vector<thread> Threads;
+	for(size_t t = 1; t < min((size_t)SectionThreads, Layouts.size()); t++)
+		Threads.push_back(thread(&PackiD::matchSectionQueue, this, cref(Layouts), ref(Found), ref(Next), cref(Control)));
+	matchSectionQueue(Layouts, Found, Next, Control);
+	for(size_t t = 0; t < Threads.size(); t++)
+		Threads[t].join();
+
+	for(size_t i = 0; i < Layouts.size(); i++) {
+		if(Found[i].Status == SCAN_CANCELLED)	return SCAN_CANCELLED;
+		Matches.insert(Matches.end(), Found[i].Matches.begin(), Found[i].Matches.end());
+	}
+
+	// the matches of each section are in database order already, a stable sort keeps sections in layout order
+	stable_sort(Matches.begin(), Matches.end(), bySignature);
+	return SCAN_DONE;
+}
+
+void PackiD::matchSectionQueue(const vector<ScanLayout> &Layouts, vector<SectionMatches> &Found, atomic<size_t> &Next, const ScanControl &Control)
+{
+	for(size_t i = Next++; i < Layouts.size(); i = Next++)
+		Found[i].Status = matchSignatures(Layouts[i], collectMatch, &Found[i], Control);
+}
+
+int PackiD::carvePE(PE &P, int Mode, vector<EmbeddedImage> &Images, const atomic<bool>* Cancel)
+{
+	Images.clear();
+	if(!P.LoadAddr || !CarveDepth || !CarveImages)	return SCAN_DONE;
+
+	// the file's own MZ header is at 0
+	return carveImages(P, 2, P.FileSize, 1, -1, Mode, Images, Cancel);
+}
+
+int PackiD::carveImages(PE &P, DWORD From, DWORD To, unsigned int Depth, int Parent, int Mode, vector<EmbeddedImage> &Images,
+						const atomic<bool>* Cancel)
+{
+	const BYTE* Base = P.LoadAddr;
+	DWORD Offset = From;
+
+	while(Offset + 1 < To && Images.size() < CarveImages)
+	{
+		// the holes of an image with a region map are skipped, nothing past the readable range is searched or parsed
+		Offset = P.getReadableStart(Offset);
+		if(Offset + 1 >= To)	break;
+		DWORD RunEnd = P.getReadableEnd(Offset);
+		DWORD SearchEnd = min(To, RunEnd);
+
+		// memchr is the C library's vectorized search, the bytes between two candidates are read once
+		const BYTE* p = (SearchEnd > Offset + 1) ? (const BYTE*)memchr(Base + Offset, 'M', SearchEnd - 1 - Offset) : NULL;
+		if(!p) {
+			Offset = SearchEnd;
+			continue;
+		}
+
+		Offset = (DWORD)(p - Base);
+		if(p[1] != 'Z') {
+			Offset++;
+			continue;
+		}
+
+		// most candidates are random bytes, check the PE signature before parsing anything
+		DWORD Rest = RunEnd - Offset;
+		DWORD PEOffset;
+		if(Rest < sizeof(IMAGE_DOS_HEADER)) {
+			Offset++;
+			continue;
+		}
+		memcpy(&PEOffset, p + FIELD_OFFSET(IMAGE_DOS_HEADER, e_lfanew), sizeof(PEOffset));
+		if(PEOffset >= Rest || Rest - PEOffset < sizeof(DWORD) || memcmp(p + PEOffset, "PE\0\0", sizeof(DWORD))) {
+			Offset++;
+			continue;
+		}
+
+		PE Child;
+		DWORD End, Overlay;
+		if(!Child.loadBuffer(p, Rest) || Child.getSections().empty()) {
+			Offset++;
+			continue;
+		}
+
+		// the image ends with the raw data of its last section, what follows belongs to the file holding it
+		Child.getOverlay(End, Overlay);
+		if(End <= PEOffset || !Child.loadBuffer(p, End)) {
+			Offset++;
+			continue;
+		}
+
+		if(Cancel && Cancel->load())	return SCAN_CANCELLED;
+
+		EmbeddedImage Image;
+		Image.Offset = Offset;
+		Image.Size = End;
+		Image.Depth = Depth;
+		Image.Parent = Parent;
+		Image.Tool = NO_MATCH;
+		if(scanPE(Child, Mode, firstMatch, &Image.Tool, Cancel) == SCAN_CANCELLED)	return SCAN_CANCELLED;
+		Images.push_back(Image);
+
+		if(Depth < CarveDepth) {
+			int Status = carveImages(P, Offset + 2, Offset + End, Depth + 1, (int)Images.size() - 1, Mode, Images, Cancel);
+			if(Status != SCAN_DONE)	return Status;
+		}
+
+		Offset += End;
+	}
+
+	return SCAN_DONE;
+}
+
+int PackiD::validMode(int Mode)
+{
+	int Base = Mode & ~MODE_WITH_OVERLAY;
+
+	if(Base < MODE_NORMAL || Base > MODE_OVERLAY)	return MODE_NORMAL;
+	if(Base == MODE_OVERLAY)						return MODE_OVERLAY;
+	return Mode;
+}
+
+DWORD PackiD::getResultTag(int Mode)
+{
+	Mode = validMode(Mode);
+	if((Mode & ~MODE_WITH_OVERLAY) != MODE_ADAPTIVE)	return Mode;
+
+	DWORD Entropy;
+	memcpy(&Entropy, &Adaptive.MinEntropy, sizeof(Entropy));
+	// the time limits are left out, the results they cut short are not cached
+	DWORD Fields[] = { (DWORD)Adaptive.LastTier, Adaptive.SectionBytes, Adaptive.FileBytes, Entropy, (BYTE)Adaptive.SuspiciousMask };
+
+	// the mode in the low bits, the policy above them
+	return Mode | ((DWORD)hash64(Fields, sizeof(Fields)) & ~0xFFFu);
+}
+
+static inline bool matchBytes(const BYTE* p, const vector<BYTE> &Values, const vector<BYTE> &WildCards)
+{
+	for(size_t j = 0; j < Values.size(); j++)
+		if((BYTE)(WildCards[j] | p[j]) != Values[j])	return false;
+	return true;
+}
+
+/* true if Tokens match at p, without reading past End. Rather than backtracking, which retries the rest of the
+ * signature for every length of a gap and every alternative, the offsets from p each token can end at are tracked
+ * all at once, like an NFA: a token is checked at most once per offset, at most SIG_MAX_SPAN offsets.
+ */
+static bool matchTokens(const vector<SigToken> &Tokens, const BYTE* p, const BYTE* End)
+{
+	BYTE Sets[2][SIG_MAX_SPAN + 1];
+	BYTE* Reach = Sets[0];				// Reach[r]: the tokens so far can end at p + r
+	BYTE* Next = Sets[1];
+	size_t Width = min((size_t)(End - p), (size_t)SIG_MAX_SPAN);
+	size_t Last = 0;					// highest offset in Reach
+
+	if(End < p)	return Tokens.empty();
+	Reach[0] = 1;
+	for(size_t t = 0; t < Tokens.size(); t++)
+	{
+		const SigToken &Token = Tokens[t];
+		size_t Longest = Token.GapMax;
+		for(size_t a = 0; a < Token.Alternatives.size(); a++)
+			Longest = max(Longest, Token.Alternatives[a].first.size());
+
+		size_t Top = min(Width, Last + Longest);
+		memset(Next, 0, Top + 1);
+		bool Any = false;
+		size_t NextLast = 0;
+
+		for(size_t r = 0, Filled = 0; r <= Last; r++)
+		{
+			if(!Reach[r])	continue;
+
+			if(Token.Alternatives.empty()) {
+				// the ranges of consecutive offsets overlap, each offset is filled once
+				size_t Lo = max(r + Token.GapMin, Filled), Hi = min(r + Token.GapMax, Width);
+				if(Lo > Hi)	continue;
+				memset(Next + Lo, 1, Hi - Lo + 1);
+				Filled = Hi + 1;
+				NextLast = Hi;
+				Any = true;
+				continue;
+			}
+
+			for(size_t a = 0; a < Token.Alternatives.size(); a++) {
+				const vector<BYTE> &Values = Token.Alternatives[a].first;
+				if(r + Values.size() > Width || !matchBytes(p + r, Values, Token.Alternatives[a].second))	continue;
+				Next[r + Values.size()] = 1;
+				NextLast = max(NextLast, r + Values.size());
+				Any = true;
+			}
+		}
+
+		if(!Any)	return false;
+		swap(Reach, Next);
+		Last = NextLast;
+	}
+	return true;
+}
+
+static inline bool isConstrained(const Signature &Sig)
+{
+	return Sig.Anchor != ANCHOR_NONE || Sig.RangeStart != 0 || Sig.RangeEnd != (DWORD)-1;
+}
+
+// adds the starts [From, To) to Windows, within [Lo, Hi) and relative to Base
+static void addWindow(vector<pair<DWORD, DWORD> > &Windows, long long From, long long To, long long Lo, long long Hi, long long Base)
+{
+	From = max(From, Lo);
+	To = min(To, Hi);
+	if(From < To)	Windows.push_back(make_pair((DWORD)(From - Base), (DWORD)(To - Base)));
+}
+
+void PackiD::planWindows(const Signature &Sig, const ScanLayout &L, DWORD RegionOffset, DWORD RegionSize, DWORD SigSize,
+						 vector<pair<DWORD, DWORD> > &Windows)
+{
+	// the starts the region and the range allow, file offsets
+	long long Base = RegionOffset;
+	long long Lo = max(Base, (long long)Sig.RangeStart);
+	long long Hi = min(Base + RegionSize - SigSize + 1, (long long)Sig.RangeEnd);
+	long long Delta = Sig.AnchorDelta;
+
+	Windows.clear();
+
+	switch(Sig.Anchor) {
+	case ANCHOR_EP:
+		addWindow(Windows, L.EPOffset + Delta, L.EPOffset + Delta + 1, Lo, Hi, Base);
+		break;
+	case ANCHOR_SECTION_START:
+	case ANCHOR_SECTION_END:
+		for(size_t i = 0; i < L.SectionRaw.size(); i++) {
+			long long At = (Sig.Anchor == ANCHOR_SECTION_START) ? L.SectionRaw[i].first : (long long)L.SectionRaw[i].second - SigSize;
+			addWindow(Windows, At + Delta, At + Delta + 1, Lo, Hi, Base);
+		}
+		break;
+	case ANCHOR_OVERLAY:
+		addWindow(Windows, L.Overlay + Delta, L.Overlay + Delta + 1, Lo, Hi, Base);
+		break;
+	case ANCHOR_IMPORTS:
+		addWindow(Windows, L.ImportStart, (long long)L.ImportEnd - SigSize + 1, Lo, Hi, Base);
+		break;
+	default:
+		addWindow(Windows, Lo, Hi, Lo, Hi, Base);
+	}
+
+	// sections sharing their raw data give the same start twice
+	sort(Windows.begin(), Windows.end());
+	size_t n = 0;
+	for(size_t i = 0; i < Windows.size(); i++) {
+		if(n && Windows[i].first <= Windows[n - 1].second)
+			Windows[n - 1].second = max(Windows[n - 1].second, Windows[i].second);
+		else
+			Windows[n++] = Windows[i];
+	}
+	Windows.resize(n);
+}
+
+bool PackiD::allowsEP(const Signature &Sig, const ScanLayout &L)
+{
+	if(!isConstrained(Sig))	return true;
+
+	vector<pair<DWORD, DWORD> > Windows;
+	planWindows(Sig, L, 0, L.File->FileSize, Sig.MinSize, Windows);
+	for(size_t w = 0; w < Windows.size(); w++)
+		if(L.EPOffset >= Windows[w].first && L.EPOffset < Windows[w].second)	return true;
+
+	return false;
+}
+
+// keeps the starts of Windows, relative to Base, where SigSize bytes are within one of the Readable ranges
+static void clipWindows(const vector<pair<DWORD, DWORD> > &Readable, DWORD Base, DWORD SigSize, vector<pair<DWORD, DWORD> > &Windows)
+{
+	vector<pair<DWORD, DWORD> > Clipped;
+
+	for(size_t w = 0; w < Windows.size(); w++)
+		for(size_t r = 0; r < Readable.size(); r++) {
+			if(Readable[r].second - Readable[r].first < SigSize)	continue;
+			addWindow(Clipped, Windows[w].first, Windows[w].second, (long long)Readable[r].first - Base,
+					  (long long)Readable[r].second - SigSize + 1 - Base, 0);
+		}
+
+	Windows.swap(Clipped);
+}
+
+// SCAN_CANCELLED or SCAN_TIMEOUT if the scan has to end now, otherwise SCAN_DONE
+static inline int checkControl(const atomic<bool>* Cancel, bool Timed, const chrono::steady_clock::time_point &Deadline)
+{
+	if(Cancel && Cancel->load(memory_order_relaxed))					return SCAN_CANCELLED;
+	if(Timed && chrono::steady_clock::now() >= Deadline)				return SCAN_TIMEOUT;
+	return SCAN_DONE;
+}
+
+int PackiD::matchSignatures(const ScanLayout &L, MatchCallback Callback, void* Context, const ScanControl &Control)
+{
+	DWORD SigSize, MinSize, FileSize;
+	LPBYTE LoadAddr;
+	bool Skipped[REGION_COUNT] = { false };
+	SignatureMatch Match;
+	vector<pair<DWORD, DWORD> > Windows;
 
 	for(unsigned int k = 0; k < Signatures.size(); k++)
 	{
+		int Stop = checkControl(Control.Cancel, Control.Timed, Control.Deadline);
+		if(Stop != SCAN_DONE)	return Stop;
+
+		if(L.SkipEP && Signatures[k].isEP)	continue;
+		if(Signatures[k].OverlayOnly != (L.Region == REGION_OVERLAY))	continue;
+		if(Control.Bound && k > Control.Bound->load(memory_order_relaxed))	return SCAN_STOPPED;
+
 		//cout << "Checking " << Signatures[k].Tool << endl;
-		SigSize = Signatures[k].SignatureValues.size();
+		SigSize = Signatures[k].SignatureValues.size();			// the fixed prefix
+		MinSize = Signatures[k].MinSize;
 
 		// Even if current mode is MODE_HARDCORE, if the signature set to ep_only=true, scan only the ep. Other that that, follow the mode.
-		if(Signatures[k].isEP || Mode == MODE_NORMAL)	{									
-			FileSize = SigSize;
-			LoadAddr = EPAddr;
+		if(Signatures[k].isEP || L.Region == REGION_EP)	{
+			Match.Region = REGION_EP;
+			FileSize = min(Signatures[k].MaxSize, L.EPSize);
+			LoadAddr = L.EPAddr;
 		}
 		else {
-			FileSize = oFileSize;
-			LoadAddr = oLoadAddr;
+			Match.Region = L.Region;
+			FileSize = L.RegionSize;
+			LoadAddr = L.RegionAddr;
 		}
 
-		if(SigSize > FileSize)	continue;
+		if(Skipped[Match.Region])	continue;
+		if(MinSize > FileSize || !MinSize)	continue;
+		if(Match.Region == REGION_EP && !allowsEP(Signatures[k], L))	continue;
+
+		// offsets from LoadAddr the signature is tried at, all of them unless it has an anchor or a range
+		Windows.assign(1, make_pair((DWORD)0, Match.Region == REGION_EP ? 1 : FileSize - MinSize + 1));
+		if(Match.Region != REGION_EP && isConstrained(Signatures[k]))
+			planWindows(Signatures[k], L, (DWORD)(LoadAddr - L.Base), FileSize, MinSize, Windows);
+		if(Match.Region != REGION_EP && L.File->getReadable().size())
+			clipWindows(L.File->getReadable(), (DWORD)(LoadAddr - L.Base), MinSize, Windows);
+
+		// a scan with ScanLimits covers the region piece by piece
+		if(Match.Region != REGION_EP && L.PieceEnd != (DWORD)-1) {
+			size_t n = 0;
+			for(size_t w = 0; w < Windows.size(); w++) {
+				DWORD From = max(Windows[w].first, L.PieceStart);
+				DWORD To = min(Windows[w].second, L.PieceEnd);
+				if(From < To)	Windows[n++] = make_pair(From, To);
+			}
+			Windows.resize(n);
+		}
 
 		CHUNK* tbyte = (CHUNK *) LoadAddr;
 		CHUNK* sbyte = (CHUNK*) Signatures[k].SignatureValues.data();
 		CHUNK* wbyte = (CHUNK*) Signatures[k].SignatureWildCards.data();
 
-		for(unsigned int i = 0; (i + SigSize - 1) < FileSize; i++)
+		for(size_t w = 0; w < Windows.size() && !Skipped[Match.Region]; w++)
+		for(unsigned int i = Windows[w].first; i < Windows[w].second; i++)
 		{
-			tbyte = (CHUNK*) ((DWORD)LoadAddr + i);
+			if((i % CANCEL_CHECK_STEP) == CANCEL_CHECK_STEP - 1) {
+				int Stop = checkControl(Control.Cancel, Control.Timed, Control.Deadline);
+				if(Stop != SCAN_DONE)	return Stop;
+			}
+
+			tbyte = (CHUNK*) ((ULONG_PTR)LoadAddr + i);
 			bool match = true;
 
 			// loop over part of the file equal to signature 
@@ -291,13 +1285,168 @@ string PackiD::scanPE(PE &P)
 				}
 			}
 
+			// the gaps and alternations after the prefix
+			if(match && Signatures[k].Tokens.size()) {
+				const BYTE* End = LoadAddr + FileSize;
+				if(Match.Region != REGION_EP && L.File->getReadable().size())
+					End = min(End, (const BYTE*)L.Base + L.File->getReadableEnd((DWORD)(LoadAddr + i - L.Base)));
+				match = matchTokens(Signatures[k].Tokens, LoadAddr + i + SigSize, End);
+			}
+
 			if(match)	{
-				return Signatures[k].Tool;
+				Match.SignatureId = k;
+				Match.Tool = Signatures[k].Tool.c_str();
+				Match.Offset = (DWORD)(LoadAddr + i - L.Base);
+				Match.Section = (Match.Region == REGION_EP) ? L.EPSection : L.Section;
+				if(Match.Section < 0)	Match.Section = findSection(*L.File, Match.Offset);
+
+				int Next = Callback(Match, Context);
+				if(Next == MATCH_STOP)			return SCAN_STOPPED;
+				if(Next == MATCH_SKIP_REGION) {
+					Skipped[Match.Region] = true;
+					break;
+				}
 			}
 			// else shift to the right
 			
 		}
 	}
-	return result;
+	return SCAN_DONE;
 }
 
+
+void PackiD::scanBatch(const vector<PE*> &Files, int Mode, vector<string> &Results)
+{
+	Results.assign(Files.size(), NO_MATCH);
+
+	Mode = validMode(Mode);
+
+	if(Mode & MODE_WITH_OVERLAY) {
+		scanBatch(Files, Mode & ~MODE_WITH_OVERLAY, Results);
+		for(size_t i = 0; i < Files.size(); i++)
+			if(Files[i] && !Results[i].compare(NO_MATCH))	Results[i] = scanPE(*Files[i], MODE_OVERLAY);
+		return;
+	}
+
+	if(Mode == MODE_ADAPTIVE) {
+		// the first tier for the whole batch, then file by file for the misses
+		scanBatch(Files, MODE_NORMAL, Results);
+		if(Adaptive.LastTier > MODE_NORMAL)
+			for(size_t i = 0; i < Files.size(); i++)
+				if(Files[i] && !Results[i].compare(NO_MATCH))	escalate(*Files[i], MODE_DEEP, firstMatch, &Results[i], NULL);
+		return;
+	}
+
+	if(Mode != MODE_NORMAL) {
+		for(size_t i = 0; i < Files.size(); i++)
+			if(Files[i])	Results[i] = scanPE(*Files[i], Mode);
+		return;
+	}
+
+	DWORD Chunks = (MaxSigSize + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG);
+	vector<ULONGLONG> Windows((size_t)Chunks * BATCH_BLOCK);
+	DWORD Available[BATCH_BLOCK];
+	int Found[BATCH_BLOCK];
+	size_t Index[BATCH_BLOCK];
+	EPWindowKey Keys[BATCH_BLOCK];
+	vector<ScanLayout> Layouts(BATCH_BLOCK);		// where anchored and ranged signatures may match
+	BYTE Window[sizeof(ULONGLONG)];
+
+	size_t Next = 0;
+	while(Next < Files.size())
+	{
+		// gather the windows of the next block of files, column f of Windows is file f
+		unsigned int Count = 0;
+		for(; Next < Files.size() && Count < BATCH_BLOCK; Next++)
+		{
+			ScanLayout &L = Layouts[Count];
+			if(!Files[Next] || !getLayout(*Files[Next], Mode, L))	continue;
+
+			EPWindowKey &Key = Keys[Count];
+			Key.Size = min(L.EPSize, MaxSigSize);
+			Key.Window = hash64(L.EPAddr, Key.Size);
+			Key.Db = DbHash;
+			if(!HasConstraints && EPCache.get(Key, Results[Next]))	continue;
+
+			for(DWORD c = 0; c < Chunks; c++) {
+				DWORD Start = c * sizeof(ULONGLONG);
+				DWORD n = (Start < Key.Size) ? min(Key.Size - Start, (DWORD)sizeof(ULONGLONG)) : 0;
+				memset(Window, 0, sizeof(Window));
+				memcpy(Window, L.EPAddr + Start, n);
+				memcpy(&Windows[(size_t)c * BATCH_BLOCK + Count], Window, sizeof(Window));
+			}
+
+			Available[Count] = Key.Size;
+			Index[Count] = Next;
+			Count++;
+		}
+
+		if(!Count)	continue;
+
+		matchBatch(Windows.data(), Available, Layouts.data(), Count, Found);
+
+		for(unsigned int f = 0; f < Count; f++) {
+			if(Found[f] >= 0)	Results[Index[f]] = Signatures[Found[f]].Tool;
+			if(!HasConstraints)	EPCache.put(Keys[f], Results[Index[f]]);
+		}
+	}
+}
+
+void PackiD::matchBatch(const ULONGLONG* Windows, const DWORD* Available, const ScanLayout* Layouts, unsigned int Count, int* Found)
+{
+	BYTE Alive[BATCH_BLOCK];
+	unsigned int Unresolved = Count;
+	vector<BYTE> Window((size_t)(MaxSigSize + sizeof(ULONGLONG)));		// the window of one file
+
+	for(unsigned int f = 0; f < Count; f++)
+		Found[f] = -1;
+
+	for(unsigned int k = 0; k < Signatures.size() && Unresolved; k++)
+	{
+		const Signature &Sig = Signatures[k];
+		if(!Sig.MinSize || Sig.OverlayOnly)	continue;		// scanPE() never matches an empty signature, nor an overlay one at the ep
+
+		// files with no match yet and a window long enough for the signature
+		BYTE Any = 0;
+		for(unsigned int f = 0; f < Count; f++) {
+			Alive[f] = (Found[f] < 0) & (Available[f] >= Sig.MinSize);
+			Any |= Alive[f];
+		}
+
+		// one chunk of the signature against the same chunk of every file, a loop the compiler vectorizes
+		for(size_t c = 0; c < Sig.BatchValues.size() && Any; c++) {
+			const ULONGLONG* Row = Windows + c * BATCH_BLOCK;
+			ULONGLONG Value = Sig.BatchValues[c];
+			ULONGLONG WildCard = Sig.BatchWildCards[c];
+
+			Any = 0;
+			for(unsigned int f = 0; f < Count; f++) {
+				Alive[f] &= ((Row[f] | WildCard) == Value);
+				Any |= Alive[f];
+			}
+		}
+
+		if(!Any)	continue;
+
+		// an anchor or a range may rule out the entry point of some files
+		if(isConstrained(Sig))
+			for(unsigned int f = 0; f < Count; f++)
+				if(Alive[f])	Alive[f] = allowsEP(Sig, Layouts[f]);
+
+		// the prefix matched, the gaps and alternations are checked file by file on its window
+		if(Sig.Tokens.size())
+			for(unsigned int f = 0; f < Count; f++) {
+				if(!Alive[f])	continue;
+
+				for(size_t c = 0; c * sizeof(ULONGLONG) < Available[f]; c++)
+					memcpy(&Window[c * sizeof(ULONGLONG)], &Windows[c * BATCH_BLOCK + f], sizeof(ULONGLONG));
+				Alive[f] = matchTokens(Sig.Tokens, Window.data() + Sig.SignatureValues.size(), Window.data() + Available[f]);
+			}
+
+		for(unsigned int f = 0; f < Count; f++)
+			if(Alive[f]) {
+				Found[f] = k;
+				Unresolved--;
+			}
+	}
+}
@@ -12,14 +12,35 @@
 #include <vector>
 #include <map>
 #include <cstring>
+#include <atomic>
+#include <chrono>
 #include "headers/PE.h"
+#include "ConcurrentLRU.h"
+
+// a part of a signature after its fixed prefix: a gap of GapMin to GapMax bytes, or one of Alternatives
+struct SigToken
+{
+	DWORD							GapMin;
+	DWORD							GapMax;
+	vector<pair<vector<BYTE>, vector<BYTE> > >	Alternatives;		// values and wildcards of each, empty for a gap
+};
 
 struct Signature
 {
 	string							Tool;
-	vector<BYTE>					SignatureValues;
+	vector<BYTE>					SignatureValues;	// the fixed prefix, up to the first gap or alternation
 	vector<BYTE>					SignatureWildCards;
+	vector<SigToken>				Tokens;				// the rest, empty for PEiD signatures
+	DWORD							MinSize;			// bytes a match spans, at least and at most
+	DWORD							MaxSize;
+	vector<ULONGLONG>				BatchValues;		// the signature in 8 byte chunks for scanBatch(), the last one padded with wildcards
+	vector<ULONGLONG>				BatchWildCards;
 	bool							isEP;
+	int								Anchor;				// ANCHOR_*, where an ep_only = false signature is tried
+	LONG							AnchorDelta;		// added to the anchor
+	DWORD							RangeStart;			// file offsets the signature may start at: [RangeStart, RangeEnd)
+	DWORD							RangeEnd;
+	bool							OverlayOnly;		// scope = overlay, tried in the overlay and nowhere else
 };
 
 #define CHUNK			unsigned int
@@ -30,40 +51,363 @@ struct Signature
 #define SIGFIELD		"signature = "
 #define SIGFIELD_LEN	sizeof(SIGFIELD) - 1	// minus 1 because sizeof() counts null
 
+/* Signatures may also use, a PackiD extension of the PEiD format:
+ *	[4]					any 4 bytes, like ?? ?? ?? ??
+ *	[2-6]				any 2 to 6 bytes
+ *	( 90 90 | EB ?? | )	one of the byte groups, an empty alternative matches no bytes, making the group optional
+ * The bytes before the first of them are matched as usual, the rest only where that prefix matched. A signature
+ * that doesn't follow this syntax, or whose gaps and alternations span more than SIG_MAX_SPAN bytes, is read as
+ * PEiD reads it.
+ */
+#define SIG_MAX_GAP		255						// longest gap
+#define SIG_MAX_SPAN	4096					// most bytes the gaps and alternations of a signature may span
+
+/* Optional lines after ep_only = false, a PackiD extension of the PEiD format. They narrow where the signature is tried,
+ * within the region of the scanning mode:
+ *	anchor = ep+0x10				at the entry point + 0x10 only (ep, ep-N too)
+ *	anchor = section_start			at the start of the raw data of any section (section_start+N, section_start-N too)
+ *	anchor = section_end			ending at the end of the raw data of any section (section_end+N, section_end-N too)
+ *	anchor = overlay				at the first byte after the raw data of the last section (overlay+N, overlay-N too)
+ *	anchor = imports				anywhere inside the import directory
+ *	range = 0x400-0x1000			starting at file offsets 0x400 up to 0x1000, excluded
+ *	scope = overlay					in the overlay only, by MODE_OVERLAY or MODE_WITH_OVERLAY. No other signature is tried there
+ * Numbers are decimal or 0x hex. Signatures without them are tried everywhere in the region, as before.
+ */
+#define ANCHORFIELD		"anchor = "
+#define ANCHORFIELD_LEN	sizeof(ANCHORFIELD) - 1
+#define RANGEFIELD		"range = "
+#define RANGEFIELD_LEN	sizeof(RANGEFIELD) - 1
+#define SCOPEFIELD		"scope = "
+#define SCOPEFIELD_LEN	sizeof(SCOPEFIELD) - 1
+
+#define ANCHOR_NONE				0				// anywhere in the region
+#define ANCHOR_EP				1
+#define ANCHOR_SECTION_START	2
+#define ANCHOR_SECTION_END		3
+#define ANCHOR_OVERLAY			4
+#define ANCHOR_IMPORTS			5
+
 #define MODE_NORMAL		0						// Scan only with signatures with ep_only = true, only at the ep
 #define MODE_DEEP		1						// Normal mode + use signatures with ep_only = false to scan with them the whole section of the ep
 #define MODE_HARDCORE	2						// Normal mode + use signatures with ep_only = false to scan with them the entire file
+#define MODE_ADAPTIVE	3						// MODE_NORMAL, then the section of the ep, then the entire file, each only if the one before found nothing. See AdaptivePolicy
+#define MODE_EXEC_SECTIONS	4					// Normal mode + use signatures with ep_only = false to scan with them every code section and the section of the ep, in parallel
+#define MODE_OVERLAY	5						// only the data appended after the last section, with scope = overlay signatures
+#define MODE_WITH_OVERLAY	0x100				// or'ed with another mode: the overlay too, when that mode found nothing
+
+// regions a signature is tried on
+#define REGION_EP			0					// at the entry point only: ep_only = true signatures, and every signature in MODE_NORMAL
+#define REGION_EP_SECTION	1					// anywhere in the section of the entry point, MODE_DEEP
+#define REGION_FILE			2					// anywhere in the file, MODE_HARDCORE
+#define REGION_EXEC_SECTION	3					// anywhere in a code section or the section of the entry point, MODE_EXEC_SECTIONS
+#define REGION_OVERLAY		4					// anywhere after the last section, MODE_OVERLAY
+#define REGION_COUNT		5
+
+// what a MatchCallback tells the scanner
+#define MATCH_CONTINUE		0					// report the next match
+#define MATCH_STOP			1					// end the scan
+#define MATCH_SKIP_REGION	2					// no more matches in this region, go on with the others
+
+// scanPE() with a callback returns
+#define SCAN_DONE			0					// every signature was tried
+#define SCAN_STOPPED		1					// the callback returned MATCH_STOP
+#define SCAN_CANCELLED		2					// the cancel flag was set
+#define SCAN_TIMEOUT		3					// the time allowed to the scan ran out
+#define SCAN_BUDGET			4					// the bytes allowed to the scan ran out
+
+#define CANCEL_CHECK_STEP	4096				// offsets tried between two checks of the cancel flag
+
+struct SignatureMatch
+{
+	DWORD							SignatureId;	// index of the signature in the database
+	const char*						Tool;			// valid as long as the database is loaded
+	int								Region;			// REGION_*
+	DWORD							Offset;			// file offset of the match
+	int								Section;		// index in PE::getSections() of the section holding the match, -1 if none does
+};
+
+typedef int (*MatchCallback)(const SignatureMatch &Match, void* Context);
+
+/* How MODE_ADAPTIVE escalates from one tier to the next. A tier is only tried when the ones before it matched nothing,
+ * and only on ep_only = false signatures, ep_only = true ones were tried at the entry point by the first tier.
+ * The default escalates every miss up to MODE_HARDCORE with no limits.
+ */
+struct AdaptivePolicy
+{
+	int								LastTier;			// MODE_NORMAL, MODE_DEEP or MODE_HARDCORE
+	DWORD							SectionBytes;		// bytes of the ep section scanned by the MODE_DEEP tier, 0: all of it
+	DWORD							FileBytes;			// bytes of the file scanned by the MODE_HARDCORE tier, 0: all of it
+	DWORD							SectionMs;			// time allowed to the MODE_DEEP tier, 0: no limit
+	DWORD							FileMs;				// time allowed to the MODE_HARDCORE tier, 0: no limit
+	float							MinEntropy;			// escalate past the ep only if the ep section entropy is at least this, 0: always
+	char							SuspiciousMask;		// scan the entire file only if one of these PE::Suspicious flags is set, 0: always
+
+	AdaptivePolicy() : LastTier(MODE_HARDCORE), SectionBytes(0), FileBytes(0), SectionMs(0), FileMs(0), MinEntropy(0), SuspiciousMask(0) {}
+};
+
+// an executable found inside a scanned file by carvePE()
+struct EmbeddedImage
+{
+	DWORD							Offset;			// file offset of its MZ header in the scanned file
+	DWORD							Size;			// its headers and the raw data of its sections, without its overlay
+	unsigned int					Depth;			// 1 inside the scanned file, 2 inside an image of depth 1...
+	int								Parent;			// index of the image holding it, -1 for the scanned file
+	string							Tool;			// the first match, NO_MATCH if none
+};
+
+#define CARVE_MAX_DEPTH		1					// default nesting carvePE() looks into
+#define CARVE_MAX_IMAGES	64					// default images carvePE() scans per file
+
+/* Limits of one scan, to bound its latency, 0: no limit. The region of the mode is covered piece by piece, each piece
+ * tried with every signature before the next one, so a scan cut short by a limit still covers whole pieces.
+ */
+struct ScanLimits
+{
+	DWORD							TimeMs;				// wall time of the scan
+	ULONGLONG						Bytes;				// bytes of the region tried, a multiple of SCAN_PIECE but for the last piece
+	bool							Prioritize;			// the piece of the entry point, then its section, then the pieces of highest entropy first, rather than file order
+
+	ScanLimits() : TimeMs(0), Bytes(0), Prioritize(false) {}
+};
+
+// what a scan with ScanLimits covered
+struct ScanCoverage
+{
+	bool							EP;					// the entry point was tried with the signatures of the entry point
+	vector<pair<DWORD, DWORD> >		Covered;			// file offsets [first, second) every ep_only = false signature of the mode was tried at, sorted
+	ULONGLONG						Bytes;				// bytes tried, a range tried by two tiers of MODE_ADAPTIVE counts twice
+};
+
+#define SCAN_PIECE			0x10000				// bytes of a piece of a scan with ScanLimits
+
+#define EP_CACHE_ENTRIES	4096				// entry point windows remembered in MODE_NORMAL
+
+#define BATCH_BLOCK			256					// files matched together by scanBatch()
+
+// In MODE_NORMAL every signature is only tried at the entry point, so the result depends only on the bytes from
+// the entry point up to the longest signature. Files packed by the same packer build share that window.
+struct EPWindowKey
+{
+	ULONGLONG						Window;			// hash of the window
+	DWORD							Size;			// window size, shorter than the longest signature near the end of file
+	ULONGLONG						Db;				// database the result was computed with
+
+	bool operator==(const EPWindowKey &k) const {
+		return Window == k.Window && Size == k.Size && Db == k.Db;
+	}
+};
+
+struct EPWindowKeyHasher
+{
+	size_t operator()(const EPWindowKey &k) const {
+		return (size_t)(k.Window ^ (k.Db * 31) ^ k.Size);
+	}
+};
 
 
 class PackiD {
 
 private:
 
+	// the parts of a file the signatures are tried on, found once per scan
+	struct ScanLayout
+	{
+		LPBYTE						Base;				// the file
+		LPBYTE						EPAddr;
+		DWORD						EPSize;				// bytes from the entry point to the end of file
+		int							Region;				// where ep_only = false signatures are tried
+		LPBYTE						RegionAddr;
+		DWORD						RegionSize;
+		bool						SkipEP;				// ep_only = true signatures were tried by an earlier tier
+		PE*							File;
+		int							EPSection;			// index in PE::getSections() of the section of the entry point
+		int							Section;			// the section of the region, -1 if the region isn't one section
+		DWORD						PieceStart;			// offsets from RegionAddr ep_only = false signatures start at, [PieceStart, PieceEnd)
+		DWORD						PieceEnd;			// (DWORD)-1 for the whole region
+
+		// where anchored signatures are tried, file offsets. Only filled if the database has anchored signatures
+		DWORD						EPOffset;
+		vector<pair<DWORD, DWORD> >	SectionRaw;			// start and end of the raw data of each section
+		DWORD						Overlay;
+		DWORD						ImportStart;		// the import directory, empty if there's none
+		DWORD						ImportEnd;
+	};
+
+	// what ends a scan early, besides the callback
+	struct ScanControl
+	{
+		const atomic<bool>*			Cancel;				// set by another thread, or NULL
+		bool						Timed;
+		chrono::steady_clock::time_point	Deadline;		// if Timed
+		const atomic<DWORD>*		Bound;				// signatures after this one can't be the first match anymore, or NULL
+	};
+
 	vector<Signature> Signatures;
-	DWORD SigSize;
+	DWORD MaxSigSize;						// longest signature, the entry point window of MODE_NORMAL
+	bool HasConstraints;					// some signatures have an anchor or a range
 	int Mode;								// scanning mode
 	bool DbLoaded;
+	ULONGLONG DbHash;						// hash of the database file, identifies the signatures results were computed with
+	ConcurrentLRU<EPWindowKey, string, EPWindowKeyHasher> EPCache;		// MODE_NORMAL results by entry point window
+	AdaptivePolicy Adaptive;
+	unsigned int SectionThreads;			// threads scanning the sections of one file in MODE_EXEC_SECTIONS
+	unsigned int CarveDepth;				// limits of carvePE()
+	unsigned int CarveImages;
 	
 	void init();
 
 	// preprocess the signature for fast scanning afterwards
 	void preprocessSignature(string s, Signature* sig);		
 
+	// the mode, MODE_NORMAL if it's not valid
+	static int validMode(int Mode);
+
+	// reads an anchor =, a range = or a scope = line into sig, false if it's not valid
+	bool parseConstraint(const string &Line, Signature* sig);
+
+	/* Windows gets the ranges of offsets from the region where a constrained signature of SigSize bytes may start, within
+	 * the RegionSize bytes at file offset RegionOffset, sorted and not overlapping. [first, second)
+	 */
+	void planWindows(const Signature &Sig, const ScanLayout &L, DWORD RegionOffset, DWORD RegionSize, DWORD SigSize,
+					 vector<pair<DWORD, DWORD> > &Windows);
+
+	// false if the anchor or the range of Sig rule out the entry point of L, the only place REGION_EP tries it
+	bool allowsEP(const Signature &Sig, const ScanLayout &L);
+
+	// false if the entry point is not in the file
+	bool getLayout(PE &P, int Mode, ScanLayout &L);
+
+	// MODE_EXEC_SECTIONS: the section of the entry point first, then the code sections in section table order
+	bool getSectionLayouts(PE &P, vector<ScanLayout> &Layouts);
+
+	/* MODE_EXEC_SECTIONS, the sections are matched in parallel. Matches gets them in database order, matches of the
+	 * same signature in the order of getSectionLayouts(). FirstOnly stops once no other match can come first.
+	 */
+	int matchSections(PE &P, bool FirstOnly, vector<SignatureMatch> &Matches, const atomic<bool>* Cancel);
+
+	// what one section of MODE_EXEC_SECTIONS found
+	struct SectionMatches
+	{
+		vector<SignatureMatch>		Matches;
+		atomic<DWORD>*				First;				// if only the first match is wanted: the first signature matched in any section
+		int							Status;
+	};
+
+	// MatchCallback of matchSections(), Context is a SectionMatches
+	static int collectMatch(const SignatureMatch &Match, void* Context);
+
+	// on each thread of matchSections(), takes the next section not scanned yet until none is left
+	void matchSectionQueue(const vector<ScanLayout> &Layouts, vector<SectionMatches> &Found, atomic<size_t> &Next, const ScanControl &Control);
+
+	// try every signature in database order, reporting each match to Callback
+	int matchSignatures(const ScanLayout &L, MatchCallback Callback, void* Context, const ScanControl &Control);
+
+	// MODE_ADAPTIVE: false if the policy stops before Tier on P, otherwise Bytes and Ms get the limits of Tier
+	bool allowTier(PE &P, int Tier, DWORD &Bytes, DWORD &Ms);
+
+	/* the region of L piece by piece, for scanPE() with ScanLimits. Budget is the bytes left, the pieces covered are
+	 * added to Coverage.
+	 */
+	int matchPieces(const ScanLayout &L, MatchCallback Callback, void* Context, const ScanControl &Control, bool Prioritize,
+					ULONGLONG &Budget, ScanCoverage &Coverage);
+
+	/* MODE_ADAPTIVE from FirstTier on, until a tier reports a match or a gate or the policy stops it. SCAN_TIMEOUT if a
+	 * tier ran out of its time, the result may then differ from a scan without time limits.
+	 */
+	int escalate(PE &P, int FirstTier, MatchCallback Callback, void* Context, const atomic<bool>* Cancel);
+
+	/* MODE_NORMAL for Count files at once. Row c of Windows holds the 8 byte chunk c of every file's entry point window,
+	 * Available[f] is the size of the window of file f, Layouts[f] its layout. Found[f] gets the first matching signature,
+	 * -1 if none.
+	 */
+	void matchBatch(const ULONGLONG* Windows, const DWORD* Available, const ScanLayout* Layouts, unsigned int Count, int* Found);
+
+	/* carvePE() of the images whose MZ header is at offsets From up to To of P, the scanned file. Each image found is
+	 * searched in turn by the next depth, and skipped here. In an image with a region map, an embedded image is read
+	 * within the readable range it starts in.
+	 */
+	int carveImages(PE &P, DWORD From, DWORD To, unsigned int Depth, int Parent, int Mode, vector<EmbeddedImage> &Images,
+					const atomic<bool>* Cancel);
+
 public:
 	PackiD();
 	PackiD(char* db_file);
 
 	inline void setMode(int mode) {
-		if(mode >= MODE_NORMAL && mode <= MODE_HARDCORE)
-			Mode = mode;
-		else Mode = MODE_NORMAL;
+		Mode = validMode(mode);
+	}
+
+	// 1 scans the sections of a file one by one, for callers already running a scan per thread
+	inline void setSectionThreads(unsigned int Threads) {
+		SectionThreads = Threads ? Threads : 1;
+	}
+
+	// carvePE() looks Depth images deep, 0 turns it off, and scans up to Images images per file
+	inline void setCarveLimits(unsigned int Depth, unsigned int Images) {
+		CarveDepth = Depth;
+		CarveImages = Images;
+	}
+
+	inline int getMode() {
+		return Mode;
+	}
+
+	inline void setAdaptivePolicy(const AdaptivePolicy &Policy) {
+		Adaptive = Policy;
+	}
+
+	inline const AdaptivePolicy& getAdaptivePolicy() {
+		return Adaptive;
 	}
 
+	/* Identifies the results of Mode, for caches keeping results across scans. MODE_ADAPTIVE results also depend on
+	 * the policy, but not on its time limits: a scan they cut short is SCAN_TIMEOUT and must not be kept.
+	 */
+	DWORD getResultTag(int Mode);
+
 	inline bool isDbLoaded() {
 		return DbLoaded;
 	}
 
-	string scanPE(PE &P);
+	inline ULONGLONG getDbHash() {
+		return DbHash;
+	}
+
+	string scanPE(PE &P)	{ return scanPE(P, Mode); }
+
+	// scans with the given mode rather than the one set by setMode(), for callers sharing one PackiD
+	string scanPE(PE &P, int Mode)		{ int Status; return scanPE(P, Mode, Status); }
+
+	// Status is SCAN_DONE, or SCAN_TIMEOUT if a MODE_ADAPTIVE tier ran out of time and the result can't be cached
+	string scanPE(PE &P, int Mode, int &Status);
+
+	/* Calls Callback for every match, in database order, until it returns MATCH_STOP. Cancel can be set by another
+	 * thread to abort the scan. Returns SCAN_DONE, SCAN_STOPPED or SCAN_CANCELLED. In MODE_ADAPTIVE every match of
+	 * the first tier that has any is reported, a tier that runs out of time ends with the matches it found and the next
+	 * one is tried, the scan then returns SCAN_TIMEOUT.
+	 */
+	int scanPE(PE &P, int Mode, MatchCallback Callback, void* Context, const atomic<bool>* Cancel = NULL);
+
+	/* scanPE() within Limits. Returns SCAN_TIMEOUT or SCAN_BUDGET when a limit cut the scan short, SCAN_TIMEOUT also
+	 * when an adaptive tier ran out of its own time. Coverage tells what was covered before. Matches are reported in
+	 * database order within a piece, pieces in the order they are covered, and MODE_EXEC_SECTIONS scans its sections
+	 * one after the other.
+	 */
+	int scanPE(PE &P, int Mode, const ScanLimits &Limits, MatchCallback Callback, void* Context, ScanCoverage &Coverage,
+			   const atomic<bool>* Cancel = NULL);
+
+	/* Results[i] = scanPE(*Files[i], Mode), NO_MATCH for NULL entries. In MODE_NORMAL the entry point windows of many files
+	 * are matched together, each signature is loaded once for the whole block of files. Other modes scan file by file.
+	 */
+	void scanBatch(const vector<PE*> &Files, int Mode, vector<string> &Results);
+
+	/* Finds the executables embedded in the loaded file, in resources, data sections or the overlay, and scans each with
+	 * Mode. They are read in place from the file's buffer, nothing is copied. Images gets them in file order, an image
+	 * followed by those inside it. The file itself is not scanned, scanPE() does that. Returns SCAN_DONE, or
+	 * SCAN_CANCELLED with the images scanned so far. Images stops at the limit of setCarveLimits(), there may be more.
+	 */
+	int carvePE(PE &P, int Mode, vector<EmbeddedImage> &Images, const atomic<bool>* Cancel = NULL);
+
 	bool loadDB(char* FileName);
 
 };
@@ -0,0 +1,363 @@
+/*
+ * ScanCache.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#include <cstring>
+#include <cstdio>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "headers/Hash.h"
+#include "ScanCache.h"
+
+#define CONTENT_SEED_1		0x5041434B69442031ULL		// second content hash, so a key is 128 bits of content
+#define RECORD_CHECK_SEED	0x5041434B69442032ULL
+
+#pragma pack(push, 1)
+typedef struct
+	{
+		char		Magic[8];
+		DWORD		Version;
+		DWORD		Reserved;
+		ULONGLONG	DbHash;
+	} ScanCacheHeader;
+
+// followed by ResultLen bytes of the result
+typedef struct
+	{
+		DWORD		Check;						// hash of the rest of the record, detects a torn write
+		DWORD		Mode;
+		ULONGLONG	Content[2];
+		ULONGLONG	Size;
+		ULONGLONG	Db;
+		WORD		ResultLen;
+	} ScanCacheRecord;
+#pragma pack(pop)
+
+ScanCache::ScanCache(size_t MemEntries) : Memory(MemEntries)
+{
+	Fd = -1;
+	LockFd = -1;
+	Map = NULL;
+	MapSize = 0;
+	Indexed = 0;
+}
+
+ScanCache::~ScanCache()
+{
+	close();
+}
+
+void ScanCache::makeKey(const BYTE* Data, size_t Size, ULONGLONG DbHash, DWORD Mode, ScanKey &Key)
+{
+	Key.Content[0] = hash64(Data, Size, 0);
+	Key.Content[1] = hash64(Data, Size, CONTENT_SEED_1);
+	Key.Size = Size;
+	Key.Db = DbHash;
+	Key.Mode = Mode;
+}
+
+bool ScanCache::lookup(const ScanKey &Key, string &Result)
+{
+	if(Memory.get(Key, Result))		return true;
+
+	if(lookupDisk(Key, Result)) {
+		Memory.put(Key, Result);
+		return true;
+	}
+
+	return false;
+}
+
+void ScanCache::insert(const ScanKey &Key, const string &Result)
+{
+	Memory.put(Key, Result);
+	appendDisk(Key, Result);
+}
+
+// takes a key off the scans in flight and wakes its waiters when the scan ends, also when it throws
+struct FlightEnd
+{
+	mutex									&Lock;
+	condition_variable						&Done;
+	unordered_set<ScanKey, ScanKeyHasher>	&InFlight;
+	const ScanKey							&Key;
+
+	~FlightEnd() {
+		{
+			lock_guard<mutex> Guard(Lock);
+			InFlight.erase(Key);
+		}
+		Done.notify_all();
+	}
+};
+
+string ScanCache::scanPE(PackiD &iD, PE &P, int Mode, int &Status)
+{
+	ScanKey Key;
+	string Result;
+
+	Status = SCAN_DONE;
+
+	// the bytes alone don't give the result of a mapped image, it depends on its layout and on its region map
+	if(P.isMapped())	return iD.scanPE(P, Mode, Status);
+
+	makeKey(P.LoadAddr, P.FileSize, iD.getDbHash(), iD.getResultTag(Mode), Key);
+
+	if(lookup(Key, Result))		return Result;
+
+	{
+		unique_lock<mutex> Guard(FlightLock);
+
+		// another worker is scanning the same content, wait for its result
+		while(InFlight.count(Key)) {
+			FlightDone.wait(Guard);
+			if(Memory.get(Key, Result))		return Result;
+		}
+
+		// it may have finished between the lookup and taking the lock
+		if(Memory.get(Key, Result))		return Result;
+
+		InFlight.insert(Key);
+	}
+
+	// the waiters find the result in Memory, or scan it themselves if this scan failed or was cut short
+	FlightEnd End = { FlightLock, FlightDone, InFlight, Key };
+	Result = iD.scanPE(P, Mode, Status);
+
+	// a result cut short by a time limit depends on the load of the machine, not only on the file
+	if(Status == SCAN_DONE)	insert(Key, Result);
+
+	return Result;
+}
+
+#ifdef __linux__
+
+bool ScanCache::open(const char* Path, ULONGLONG DbHash)
+{
+	close();
+
+	lock_guard<mutex> Guard(DiskLock);
+
+	// the lock is on a file of its own: the cache file is replaced below, a lock on it would stay on the old one
+	DiskPath = Path;
+	LockFd = ::open((DiskPath + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(LockFd < 0)	return false;
+
+	Fd = ::open(Path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if(Fd < 0)	return false;
+
+	// nobody appends while we check the file
+	flock(LockFd, LOCK_EX);
+
+	ScanCacheHeader Header;
+	struct stat st;
+	bool Valid = false;
+
+	if(pread(Fd, &Header, sizeof(Header), 0) == sizeof(Header))
+		Valid = !memcmp(Header.Magic, SCAN_CACHE_MAGIC, sizeof(Header.Magic)) && Header.Version == SCAN_CACHE_VERSION && Header.DbHash == DbHash;
+
+	Indexed = sizeof(ScanCacheHeader);
+	if(Valid)	refreshDisk();
+
+	// results of another database, or garbage of an interrupted write after the last record
+	if(!Valid || fstat(Fd, &st) != 0 || (size_t)st.st_size != Indexed)
+	{
+		/* Write the records we keep to a new file and rename it over the old one. The file is never truncated in place,
+		 * other processes may still have it mapped and would fault reading the truncated part.
+		 */
+		char Pid[16];
+		sprintf(Pid, ".tmp%d", (int)getpid());
+		string TmpPath = string(Path) + Pid;
+		int TmpFd = ::open(TmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bool Written = (TmpFd >= 0);
+
+		memset(&Header, 0, sizeof(Header));
+		memcpy(Header.Magic, SCAN_CACHE_MAGIC, sizeof(Header.Magic));
+		Header.Version = SCAN_CACHE_VERSION;
+		Header.DbHash = DbHash;
+
+		if(Written)
+			Written = (write(TmpFd, &Header, sizeof(Header)) == sizeof(Header));
+		if(Written && Valid && Indexed > sizeof(Header))
+			Written = (write(TmpFd, Map + sizeof(Header), Indexed - sizeof(Header)) == (ssize_t)(Indexed - sizeof(Header)));
+		if(TmpFd >= 0)
+			::close(TmpFd);
+		if(Written)
+			Written = (rename(TmpPath.c_str(), Path) == 0);
+
+		::close(Fd);
+		if(Map)	munmap(Map, MapSize);
+		Map = NULL;
+		MapSize = 0;
+		Indexed = sizeof(ScanCacheHeader);
+		DiskIndex.clear();
+
+		Fd = Written ? ::open(Path, O_RDWR | O_APPEND | O_CLOEXEC) : -1;
+		if(!Written)	unlink(TmpPath.c_str());
+		if(Fd >= 0)		refreshDisk();
+
+		flock(LockFd, LOCK_UN);
+		return Fd >= 0;
+	}
+
+	flock(LockFd, LOCK_UN);
+	return true;
+}
+
+void ScanCache::close()
+{
+	lock_guard<mutex> Guard(DiskLock);
+
+	if(Map)			munmap(Map, MapSize);
+	if(Fd >= 0)		::close(Fd);
+	if(LockFd >= 0)	::close(LockFd);
+
+	Map = NULL;
+	MapSize = 0;
+	Fd = -1;
+	LockFd = -1;
+	Indexed = 0;
+	DiskIndex.clear();
+}
+
+// maps the file again if it grew and indexes the new records, DiskLock must be held
+bool ScanCache::refreshDisk()
+{
+	struct stat st;
+	if(fstat(Fd, &st) != 0)		return false;
+
+	size_t Size = st.st_size;
+	if(Size == MapSize)			return false;
+
+	// truncated behind our back, index it again from the start
+	if(Size < Indexed) {
+		DiskIndex.clear();
+		Indexed = sizeof(ScanCacheHeader);
+	}
+
+	if(Map)	munmap(Map, MapSize);
+	Map = (LPBYTE) mmap(NULL, Size, PROT_READ, MAP_SHARED, Fd, 0);
+	if(Map == MAP_FAILED) {
+		Map = NULL;
+		MapSize = 0;
+		return false;
+	}
+	MapSize = Size;
+
+	while(Indexed + sizeof(ScanCacheRecord) <= MapSize) {
+		ScanCacheRecord Record;
+		memcpy(&Record, Map + Indexed, sizeof(Record));
+
+		size_t RecordSize = sizeof(Record) + Record.ResultLen;
+		if(Indexed + RecordSize > MapSize)		break;
+
+		DWORD Check = (DWORD) hash64(Map + Indexed + sizeof(Record.Check), RecordSize - sizeof(Record.Check), RECORD_CHECK_SEED);
+		if(Check != Record.Check)				break;
+
+		ScanKey Key;
+		Key.Content[0] = Record.Content[0];
+		Key.Content[1] = Record.Content[1];
+		Key.Size = Record.Size;
+		Key.Db = Record.Db;
+		Key.Mode = Record.Mode;
+		DiskIndex[Key] = Indexed;
+
+		Indexed += RecordSize;
+	}
+
+	return true;
+}
+
+/* If another process compacted the file, renaming a new one over it, opens the file at DiskPath again and indexes it
+ * from the start: the records appended to the old one would be lost. False if the file open is still current.
+ * DiskLock must be held.
+ */
+bool ScanCache::reopenDisk()
+{
+	struct stat Open, Current;
+	if(fstat(Fd, &Open) != 0 || stat(DiskPath.c_str(), &Current) != 0)		return false;
+	if(Open.st_dev == Current.st_dev && Open.st_ino == Current.st_ino)		return false;
+
+	int NewFd = ::open(DiskPath.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+	if(NewFd < 0)	return false;
+
+	::close(Fd);
+	Fd = NewFd;
+	if(Map)	munmap(Map, MapSize);
+	Map = NULL;
+	MapSize = 0;
+	Indexed = sizeof(ScanCacheHeader);
+	DiskIndex.clear();
+
+	refreshDisk();
+	return true;
+}
+
+bool ScanCache::lookupDisk(const ScanKey &Key, string &Result)
+{
+	lock_guard<mutex> Guard(DiskLock);
+	if(Fd < 0)	return false;
+
+	unordered_map<ScanKey, size_t, ScanKeyHasher>::iterator it = DiskIndex.find(Key);
+
+	// other processes may have appended it since we last looked
+	if(it == DiskIndex.end()) {
+		if(!reopenDisk() && !refreshDisk())		return false;
+		it = DiskIndex.find(Key);
+		if(it == DiskIndex.end())	return false;
+	}
+
+	ScanCacheRecord Record;
+	memcpy(&Record, Map + it->second, sizeof(Record));
+	Result.assign((const char*)Map + it->second + sizeof(Record), Record.ResultLen);
+
+	return true;
+}
+
+void ScanCache::appendDisk(const ScanKey &Key, const string &Result)
+{
+	lock_guard<mutex> Guard(DiskLock);
+	if(Fd < 0 || Result.length() > SCAN_CACHE_MAX_RESULT)	return;
+
+	ScanCacheRecord Record;
+	Record.Mode = Key.Mode;
+	Record.Content[0] = Key.Content[0];
+	Record.Content[1] = Key.Content[1];
+	Record.Size = Key.Size;
+	Record.Db = Key.Db;
+	Record.ResultLen = (WORD) Result.length();
+
+	string Buffer((const char*)&Record, sizeof(Record));
+	Buffer += Result;
+	Record.Check = (DWORD) hash64(Buffer.data() + sizeof(Record.Check), Buffer.length() - sizeof(Record.Check), RECORD_CHECK_SEED);
+	memcpy(&Buffer[0], &Record.Check, sizeof(Record.Check));
+
+	/* One write with O_APPEND, records of concurrent processes don't interleave. The shared lock only keeps out open(),
+	 * once it's held the file at DiskPath can't be replaced: append to that one, not to a file compacted away.
+	 */
+	flock(LockFd, LOCK_SH);
+	reopenDisk();
+	if(write(Fd, Buffer.data(), Buffer.length()) != (ssize_t)Buffer.length()) {}
+	flock(LockFd, LOCK_UN);
+}
+
+#else
+
+// the disk tier is not available on this platform, only the memory tier is used
+
+bool ScanCache::open(const char* Path, ULONGLONG DbHash)			{ return false; }
+void ScanCache::close()												{}
+bool ScanCache::refreshDisk()										{ return false; }
+bool ScanCache::reopenDisk()										{ return false; }
+bool ScanCache::lookupDisk(const ScanKey &Key, string &Result)		{ return false; }
+void ScanCache::appendDisk(const ScanKey &Key, const string &Result)	{}
+
+#endif
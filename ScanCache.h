@@ -0,0 +1,98 @@
+/*
+ * ScanCache.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ScanCache_
+#define _ScanCache_
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include "headers/PE.h"
+#include "ConcurrentLRU.h"
+#include "PackiD.h"
+
+#define SCAN_CACHE_MEM_ENTRIES	65536				// results kept in memory
+#define SCAN_CACHE_MAGIC		"PKDCACHE"
+#define SCAN_CACHE_VERSION		1
+#define SCAN_CACHE_MAX_RESULT	0xFFFF				// longest result stored on disk
+
+// What a scan result depends on: the file content, the loaded database and the scanning mode
+struct ScanKey
+{
+	ULONGLONG						Content[2];		// two hashes of the file with different seeds
+	ULONGLONG						Size;
+	ULONGLONG						Db;				// PackiD::getDbHash()
+	DWORD							Mode;			// PackiD::getResultTag()
+
+	bool operator==(const ScanKey &k) const {
+		return Content[0] == k.Content[0] && Content[1] == k.Content[1] && Size == k.Size && Db == k.Db && Mode == k.Mode;
+	}
+};
+
+struct ScanKeyHasher
+{
+	size_t operator()(const ScanKey &k) const {
+		return (size_t)(k.Content[0] ^ (k.Db * 31) ^ k.Mode);
+	}
+};
+
+/* Scan results by file content. Two tiers:
+ * - memory: a ConcurrentLRU of the most recent results.
+ * - disk (optional, linux only): an append-only file of results shared by runs and processes. It's memory mapped
+ *   and indexed when opened, and reindexed when other processes append to it. The database hash is in the file
+ *   header, a file written with another database is emptied when opened. Processes lock Path.lock rather than the
+ *   file itself, which open() may replace: writers check the file is still the one at Path before appending.
+ * Workers scanning the same content at the same time are collapsed: the first one scans, the others wait for its result.
+ */
+class ScanCache
+{
+private:
+	ConcurrentLRU<ScanKey, string, ScanKeyHasher>	Memory;
+
+	mutex											FlightLock;
+	condition_variable								FlightDone;
+	unordered_set<ScanKey, ScanKeyHasher>			InFlight;		// keys being scanned right now
+
+	mutex											DiskLock;
+	string											DiskPath;
+	int												Fd;
+	int												LockFd;			// Path.lock, flocked by open() and appendDisk()
+	LPBYTE											Map;
+	size_t											MapSize;
+	size_t											Indexed;		// end of the last record indexed
+	unordered_map<ScanKey, size_t, ScanKeyHasher>	DiskIndex;		// record offsets in the file
+
+	bool refreshDisk();
+	bool reopenDisk();
+	bool lookupDisk(const ScanKey &Key, string &Result);
+	void appendDisk(const ScanKey &Key, const string &Result);
+
+public:
+	ScanCache(size_t MemEntries = SCAN_CACHE_MEM_ENTRIES);
+	~ScanCache();
+
+	// opens (or creates) the disk tier for results of the database with hash DbHash
+	bool open(const char* Path, ULONGLONG DbHash);
+	void close();
+
+	static void makeKey(const BYTE* Data, size_t Size, ULONGLONG DbHash, DWORD Mode, ScanKey &Key);
+
+	bool lookup(const ScanKey &Key, string &Result);
+	void insert(const ScanKey &Key, const string &Result);
+
+	// iD.scanPE(P) through the cache
+	string scanPE(PackiD &iD, PE &P)				{ return scanPE(iD, P, iD.getMode()); }
+	string scanPE(PackiD &iD, PE &P, int Mode)		{ int Status; return scanPE(iD, P, Mode, Status); }
+
+	// Status as PackiD::scanPE(P, Mode, Status) gives it, results it reports as SCAN_TIMEOUT are not cached
+	string scanPE(PackiD &iD, PE &P, int Mode, int &Status);
+};
+
+#endif
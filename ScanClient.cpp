@@ -0,0 +1,111 @@
+/*
+ * ScanClient.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#ifdef __linux__
+
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ScanClient.h"
+
+ScanClient::ScanClient()
+{
+	Fd = -1;
+	NextId = 1;
+}
+
+ScanClient::~ScanClient()
+{
+	close();
+}
+
+bool ScanClient::connect(const char* SocketPath)
+{
+	struct sockaddr_un Addr;
+	if(strlen(SocketPath) >= sizeof(Addr.sun_path))	return false;
+
+	close();
+
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	strcpy(Addr.sun_path, SocketPath);
+
+	Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(Fd < 0)	return false;
+
+	if(::connect(Fd, (struct sockaddr*)&Addr, sizeof(Addr)) != 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void ScanClient::close()
+{
+	if(Fd >= 0)	::close(Fd);
+	Fd = -1;
+}
+
+DWORD ScanClient::send(DWORD Type, const string &Payload)
+{
+	if(Fd < 0 || Payload.length() > FRAME_MAX_PAYLOAD)	return 0;
+
+	DWORD Id = NextId++;
+	if(NextId == 0)	NextId = 1;
+
+	if(!writeFrame(Fd, Id, Type, Payload.data(), Payload.length()))	return 0;
+	return Id;
+}
+
+DWORD ScanClient::sendFd(int FileFd)
+{
+	if(Fd < 0 || FileFd < 0)	return 0;
+
+	DWORD Id = NextId++;
+	if(NextId == 0)	NextId = 1;
+
+	if(!writeFrame(Fd, Id, REQ_SCAN_FD, NULL, 0, FileFd))	return 0;
+	return Id;
+}
+
+DWORD ScanClient::sendBuffer(const void* Data, size_t Size)
+{
+	int MemFd = memfd_create("packid-sample", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(MemFd < 0)	return 0;
+
+	const char* p = (const char*)Data;
+	size_t Left = Size;
+	while(Left) {
+		ssize_t n = write(MemFd, p, Left);
+		if(n <= 0) {
+			::close(MemFd);
+			return 0;
+		}
+		p += n;
+		Left -= n;
+	}
+
+	// the daemon maps it, it must not shrink under the mapping
+	DWORD Id = 0;
+	if(fcntl(MemFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0)
+		Id = sendFd(MemFd);
+
+	::close(MemFd);
+	return Id;
+}
+
+bool ScanClient::receive(FrameHeader &Header, string &Payload)
+{
+	if(Fd < 0)	return false;
+	return readFrame(Fd, Header, Payload);
+}
+
+#endif
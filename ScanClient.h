@@ -0,0 +1,51 @@
+/*
+ * ScanClient.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ScanClient_
+#define _ScanClient_
+
+#ifdef __linux__
+
+#include <string>
+#include "ScanProtocol.h"
+
+#define CLIENT_PIPELINE		64				// requests sent before waiting for a response
+
+/* A connection to the scanning daemon. send() returns without waiting for the response, so requests can be
+ * pipelined: send many, then match the responses from receive() to the requests by Id.
+ */
+class ScanClient
+{
+private:
+	int			Fd;
+	DWORD		NextId;
+
+public:
+	ScanClient();
+	~ScanClient();
+
+	bool connect(const char* SocketPath);
+	void close();
+
+	// the Id of the request, 0 if it cannot be sent
+	DWORD send(DWORD Type, const string &Payload = "");
+
+	// REQ_SCAN_FD: the daemon scans the file behind FileFd, in place if it's a memfd sealed against shrinking and
+	// writing, from a copy otherwise. FileFd can be closed once this returns
+	DWORD sendFd(int FileFd);
+
+	// copies Data to a sealed memfd and sends it with sendFd()
+	DWORD sendBuffer(const void* Data, size_t Size);
+
+	// waits for the next response
+	bool receive(FrameHeader &Header, string &Payload);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * ScanManifest.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#include <cstring>
+#ifdef __linux__
+	#include <unistd.h>
+	#include <fcntl.h>
+#else
+	#include <io.h>
+	#include <fcntl.h>
+#endif
+#include "ScanManifest.h"
+#include "headers/Hash.h"
+
+ScanManifest::ScanManifest(const char* ListFile, const char* ResultsFile)
+	: ListPath(ListFile), ResultsPath(ResultsFile), CheckpointPath(string(ResultsFile) + ".checkpoint"), Results(NULL),
+	  Resumed(0), CheckpointFiles(MANIFEST_CHECKPOINT_FILES), CheckpointInterval(MANIFEST_CHECKPOINT_SECONDS), LastDone(0)
+{
+	memset(&State, 0, sizeof(State));
+}
+
+ScanManifest::~ScanManifest()
+{
+	if(Results)	fclose(Results);
+}
+
+void ScanManifest::setCheckpointInterval(ULONGLONG Files, unsigned int Seconds)
+{
+	if(Files)	CheckpointFiles = Files;
+	if(Seconds)	CheckpointInterval = chrono::seconds(Seconds);
+}
+
+bool ScanManifest::readEntry(string &Path)
+{
+	while(getline(List, Path))
+	{
+		if(Path.size() && Path[Path.size() - 1] == '\r')	Path.erase(Path.size() - 1);
+		if(Path.size())	return true;
+	}
+	return false;
+}
+
+bool ScanManifest::loadCheckpoint(ULONGLONG DbHash, DWORD Mode)
+{
+	ManifestCheckpoint Saved;
+	FILE* F = fopen(CheckpointPath.c_str(), "rb");
+	if(!F)	return false;
+
+	bool Valid = fread(&Saved, sizeof(Saved), 1, F) == 1;
+	fclose(F);
+
+	if(!Valid || memcmp(Saved.Magic, MANIFEST_MAGIC, sizeof(Saved.Magic)) || Saved.Version != MANIFEST_VERSION ||
+		Saved.DbHash != DbHash || Saved.Mode != Mode)
+		return false;
+
+	// the entries done must still be the first entries of the list
+	ULONGLONG ListHash = 0;
+	string Path;
+	for(ULONGLONG i = 0; i < Saved.Done; i++) {
+		if(!readEntry(Path))	return false;
+		ListHash = hash64(Path.data(), Path.size(), ListHash);
+	}
+	if(ListHash != Saved.ListHash)	return false;
+
+	// the results of the entries done must all be there, what follows them is cut off
+	ifstream Old(ResultsPath.c_str(), ios::in | ios::binary | ios::ate);
+	if(!Old || (ULONGLONG)Old.tellg() < Saved.ResultsSize)	return false;
+	Old.close();
+
+#ifdef __linux__
+	if(truncate(ResultsPath.c_str(), (off_t)Saved.ResultsSize) != 0)	return false;
+#else
+	int Fd = _open(ResultsPath.c_str(), _O_RDWR | _O_BINARY);
+	if(Fd < 0)	return false;
+	bool Truncated = _chsize_s(Fd, Saved.ResultsSize) == 0;
+	_close(Fd);
+	if(!Truncated)	return false;
+#endif
+
+	Results = fopen(ResultsPath.c_str(), "ab");
+	if(!Results)	return false;
+
+	State = Saved;
+	return true;
+}
+
+bool ScanManifest::open(ULONGLONG DbHash, DWORD Mode)
+{
+	List.open(ListPath.c_str(), ios::in | ios::binary);
+	if(!List)	return false;
+
+	if(loadCheckpoint(DbHash, Mode))
+		Resumed = State.Done;
+	else {
+		// start over, from the first entry and with no results
+		List.clear();
+		List.seekg(0);
+
+		memset(&State, 0, sizeof(State));
+		memcpy(State.Magic, MANIFEST_MAGIC, sizeof(State.Magic));
+		State.Version = MANIFEST_VERSION;
+		State.Mode = Mode;
+		State.DbHash = DbHash;
+		Resumed = 0;
+
+		Results = fopen(ResultsPath.c_str(), "wb");
+		if(!Results)	return false;
+	}
+
+	LastDone = State.Done;
+	LastTime = chrono::steady_clock::now();
+	return true;
+}
+
+bool ScanManifest::next(string &Path)
+{
+	return readEntry(Path);
+}
+
+bool ScanManifest::record(const string &Path, const string &Text)
+{
+	// buffered: the results reach the disk in large writes, at the latest at the next checkpoint
+	if(fwrite(Text.data(), 1, Text.size(), Results) != Text.size())	return false;
+
+	State.Done++;
+	State.ResultsSize += Text.size();
+	State.ListHash = hash64(Path.data(), Path.size(), State.ListHash);
+	return true;
+}
+
+bool ScanManifest::due()
+{
+	return State.Done - LastDone >= CheckpointFiles || chrono::steady_clock::now() - LastTime >= CheckpointInterval;
+}
+
+bool ScanManifest::syncFile(FILE* F)
+{
+	if(fflush(F) != 0)	return false;
+#ifdef __linux__
+	return fsync(fileno(F)) == 0;
+#else
+	return _commit(_fileno(F)) == 0;
+#endif
+}
+
+bool ScanManifest::checkpoint()
+{
+	LastDone = State.Done;
+	LastTime = chrono::steady_clock::now();
+
+	// the results first: the checkpoint must never count results that are not on disk
+	if(!syncFile(Results))	return false;
+
+	string TmpPath = CheckpointPath + ".tmp";
+	FILE* F = fopen(TmpPath.c_str(), "wb");
+	if(!F)	return false;
+
+	bool Written = fwrite(&State, sizeof(State), 1, F) == 1 && syncFile(F);
+	fclose(F);
+	if(!Written)	return false;
+
+#ifdef __linux__
+	if(rename(TmpPath.c_str(), CheckpointPath.c_str()) != 0)	return false;
+
+	// the rename itself is on disk once the directory is
+	size_t Slash = CheckpointPath.rfind('/');
+	string Dir = Slash == string::npos ? "." : CheckpointPath.substr(0, Slash + 1);
+	int DirFd = ::open(Dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if(DirFd >= 0) {
+		fsync(DirFd);
+		close(DirFd);
+	}
+	return true;
+#else
+	return MoveFileExA(TmpPath.c_str(), CheckpointPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#endif
+}
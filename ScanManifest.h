@@ -0,0 +1,100 @@
+/*
+ * ScanManifest.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ScanManifest_
+#define _ScanManifest_
+
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <chrono>
+#ifndef __linux__
+	#include <windows.h>
+#else
+	#include "headers/Typedef.h"
+#endif
+
+using namespace std;
+
+#define MANIFEST_MAGIC				"PKDMANIF"
+#define MANIFEST_VERSION			1
+#define MANIFEST_CHECKPOINT_FILES	4096			// entries between two checkpoints, at most
+#define MANIFEST_CHECKPOINT_SECONDS	30				// time between two checkpoints, at most
+
+// the checkpoint file, replaced as a whole at every checkpoint
+struct ManifestCheckpoint
+{
+	char							Magic[8];		// MANIFEST_MAGIC
+	DWORD							Version;
+	DWORD							Mode;			// PackiD::getResultTag(), hashed with the other options the results depend on
+	ULONGLONG						DbHash;			// PackiD::getDbHash()
+	ULONGLONG						Done;			// entries of the list with their results written
+	ULONGLONG						ResultsSize;	// bytes of results for those entries
+	ULONGLONG						ListHash;		// hash of the paths of those entries
+};
+
+/* A batch scan of a file list (a path per line, blank lines ignored) that survives being killed. The results are
+ * appended to an output file, and every few thousand entries or seconds a checkpoint records how many entries are
+ * done and how long their results are. The results are flushed to disk first, then the checkpoint is written to a
+ * temporary file and renamed over the previous one: a crash leaves either checkpoint whole, never a torn one.
+ * Reopened, the scan goes on after the last checkpoint and the results written after it are cut off. A checkpoint
+ * of another database or other scan options, or of a list whose first entries changed, starts the scan over.
+ * Each result is written once, a checkpoint adds a sync and a few bytes.
+ */
+class ScanManifest
+{
+private:
+	string							ListPath;
+	string							ResultsPath;
+	string							CheckpointPath;
+
+	ifstream						List;
+	FILE*							Results;
+	ManifestCheckpoint				State;
+	ULONGLONG						Resumed;		// entries done by previous runs
+
+	ULONGLONG						CheckpointFiles;
+	chrono::seconds					CheckpointInterval;
+	ULONGLONG						LastDone;		// Done at the last checkpoint
+	chrono::steady_clock::time_point	LastTime;
+
+	// the next non-blank line of the list, false at its end
+	bool readEntry(string &Path);
+
+	bool loadCheckpoint(ULONGLONG DbHash, DWORD Mode);
+
+	// writes the data to disk, not only to the OS cache
+	static bool syncFile(FILE* F);
+
+public:
+	// the checkpoint is kept next to the results, as Results.checkpoint
+	ScanManifest(const char* ListFile, const char* ResultsFile);
+	~ScanManifest();
+
+	// opens the list and the results, resuming after the last checkpoint taken with the same database and Mode, the tag
+	// of the scan options
+	bool open(ULONGLONG DbHash, DWORD Mode);
+
+	// 0 keeps the default
+	void setCheckpointInterval(ULONGLONG Files, unsigned int Seconds);
+
+	bool next(string &Path);
+
+	// appends the results of Path, the entry next() returned last
+	bool record(const string &Path, const string &Text);
+
+	// a checkpoint is due: enough entries or time since the last one
+	bool due();
+
+	bool checkpoint();
+
+	inline ULONGLONG getDone()		{ return State.Done; }
+	inline ULONGLONG getResumed()	{ return Resumed; }
+};
+
+#endif
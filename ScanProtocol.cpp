@@ -0,0 +1,136 @@
+/*
+ * ScanProtocol.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "ScanProtocol.h"
+
+// reads Size bytes, keeping the first descriptor passed along with them in PassedFd
+static bool readAll(int Fd, void* Buffer, size_t Size, int &PassedFd)
+{
+	char* p = (char*)Buffer;
+	char Control[CMSG_SPACE(sizeof(int))];
+
+	while(Size) {
+		struct iovec iov;
+		iov.iov_base = p;
+		iov.iov_len = Size;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = Control;
+		msg.msg_controllen = sizeof(Control);
+
+		ssize_t n = recvmsg(Fd, &msg, MSG_CMSG_CLOEXEC);
+		if(n == 0)	return false;
+		if(n < 0) {
+			if(errno == EINTR)	continue;
+			return false;
+		}
+
+		for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)	continue;
+
+			int Count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(int i = 0; i < Count; i++) {
+				int Received;
+				memcpy(&Received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if(PassedFd < 0)	PassedFd = Received;
+				else				close(Received);			// one descriptor per frame
+			}
+		}
+
+		p += n;
+		Size -= n;
+	}
+	return true;
+}
+
+bool readFrame(int Fd, FrameHeader &Header, string &Payload, int* PassedFd)
+{
+	int Received = -1;
+	bool Read = readAll(Fd, &Header, sizeof(Header), Received);
+
+	if(Read && Header.Size > FRAME_MAX_PAYLOAD)	Read = false;
+
+	if(Read) {
+		Payload.resize(Header.Size);
+		if(Header.Size)	Read = readAll(Fd, &Payload[0], Header.Size, Received);
+	}
+
+	if(PassedFd && Read)	*PassedFd = Received;
+	else if(Received >= 0)	close(Received);
+
+	return Read;
+}
+
+bool writeFrame(int Fd, DWORD Id, DWORD Type, const void* Payload, DWORD Size, int PassFd)
+{
+	FrameHeader Header;
+	Header.Size = Size;
+	Header.Id = Id;
+	Header.Type = Type;
+
+	struct iovec iov[2];
+	iov[0].iov_base = &Header;
+	iov[0].iov_len = sizeof(Header);
+	iov[1].iov_base = (void*)Payload;
+	iov[1].iov_len = Size;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = Size ? 2 : 1;
+
+	char Control[CMSG_SPACE(sizeof(int))];
+	if(PassFd >= 0) {
+		memset(Control, 0, sizeof(Control));
+		msg.msg_control = Control;
+		msg.msg_controllen = sizeof(Control);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &PassFd, sizeof(int));
+	}
+
+	// a peer that went away must not kill the daemon with SIGPIPE
+	while(msg.msg_iovlen) {
+		ssize_t n = sendmsg(Fd, &msg, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR)	continue;
+			return false;
+		}
+
+		// the descriptor went with the first bytes
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+
+		// partial send, skip what was sent
+		while(msg.msg_iovlen && (size_t)n >= msg.msg_iov[0].iov_len) {
+			n -= msg.msg_iov[0].iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if(msg.msg_iovlen) {
+			msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + n;
+			msg.msg_iov[0].iov_len -= n;
+		}
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * ScanProtocol.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ScanProtocol_
+#define _ScanProtocol_
+
+#include <string>
+#include "headers/PE.h"
+
+/* Frames exchanged by the daemon and its clients over a local socket, in host byte order:
+ * a FrameHeader followed by Size bytes of payload.
+ * Requests carry an Id chosen by the client, the response to a request carries the same Id. A client may send
+ * many requests before reading the responses, and responses come back in the order scans finish, not the order
+ * of the requests.
+ */
+
+#define FRAME_MAX_PAYLOAD		(64 << 20)
+
+// requests
+#define REQ_PING				1				// no payload
+#define REQ_SCAN_PATH			2				// payload: path of the file to scan, as seen by the daemon
+#define REQ_RELOAD				3				// no payload, reload the database from disk
+#define REQ_SCAN_FD				4				// no payload, the file descriptor to scan is passed with SCM_RIGHTS. A memfd sealed with
+												// F_SEAL_SHRINK and F_SEAL_WRITE is scanned in place, other regular files are read by the daemon first
+
+// responses
+#define RESP_OK					0x100			// ping or reload done
+#define RESP_MATCH				0x101			// payload: the tool
+#define RESP_NO_MATCH			0x102
+#define RESP_NOT_PE				0x103			// is not a PE or file cannot be opened
+#define RESP_ERROR				0x104			// payload: reason
+
+#pragma pack(push, 1)
+typedef struct
+	{
+		DWORD		Size;						// payload size
+		DWORD		Id;
+		DWORD		Type;						// REQ_* or RESP_*
+	} FrameHeader;
+#pragma pack(pop)
+
+#ifdef __linux__
+
+// false on a closed connection, an error or an oversized frame.
+// PassedFd gets the descriptor sent with the frame, -1 if none. Without PassedFd a received descriptor is closed.
+bool readFrame(int Fd, FrameHeader &Header, string &Payload, int* PassedFd = NULL);
+
+// the header and the payload in one send, callers writing from several threads serialize the calls.
+// PassFd (if not -1) is sent along with the header, the caller can close it once the call returns.
+bool writeFrame(int Fd, DWORD Id, DWORD Type, const void* Payload, DWORD Size, int PassFd = -1);
+
+#endif
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * ScanServer.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <thread>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ScanServer.h"
+
+static int SignalPipe[2] = { -1, -1 };		// the signal handler writes the signal number, run() reads it
+
+static void onSignal(int Signal)
+{
+	int Saved = errno;
+	char c = (char)Signal;
+	if(write(SignalPipe[1], &c, 1) < 0) {}
+	errno = Saved;
+}
+
+ScanServer::Connection::~Connection()
+{
+	::close(Fd);
+}
+
+ScanServer::ScanServer(unsigned int Threads) : Pool(Threads)
+{
+	Mode = MODE_DEEP;
+	ListenFd = -1;
+}
+
+ScanServer::~ScanServer()
+{
+	Pool.stop();
+
+	if(ListenFd >= 0) {
+		::close(ListenFd);
+		unlink(SocketPath.c_str());
+	}
+}
+
+shared_ptr<PackiD> ScanServer::getDB()
+{
+	lock_guard<mutex> Guard(DbLock);
+	return Db;
+}
+
+bool ScanServer::loadDB(const char* DbFile, const char* CacheFile)
+{
+	DbPath = DbFile;
+	if(CacheFile)	CachePath = CacheFile;
+
+	return reload();
+}
+
+bool ScanServer::reload()
+{
+	lock_guard<mutex> Reloading(ReloadLock);
+
+	shared_ptr<PackiD> New(new PackiD());
+	New->setMode(Mode);
+	New->setSectionThreads(1);						// the pool scans a file per thread already
+	if(!New->loadDB((char*)DbPath.c_str()))		return false;
+
+	shared_ptr<PackiD> Old = getDB();
+
+	// results on disk are kept for one database, start a new file if it changed
+	if(CachePath.length() && (!Old || Old->getDbHash() != New->getDbHash()))
+		Cache.open(CachePath.c_str(), New->getDbHash());
+
+	{
+		lock_guard<mutex> Guard(DbLock);
+		Db = New;
+	}
+
+	return true;
+}
+
+bool ScanServer::listen(const char* Path)
+{
+	struct sockaddr_un Addr;
+	if(strlen(Path) >= sizeof(Addr.sun_path))	return false;
+
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	strcpy(Addr.sun_path, Path);
+
+	ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(ListenFd < 0)	return false;
+
+	// a socket left by a previous daemon that didn't exit cleanly
+	unlink(Path);
+
+	if(::bind(ListenFd, (struct sockaddr*)&Addr, sizeof(Addr)) != 0 || ::listen(ListenFd, SERVER_BACKLOG) != 0) {
+		::close(ListenFd);
+		ListenFd = -1;
+		return false;
+	}
+
+	SocketPath = Path;
+	return true;
+}
+
+int ScanServer::run()
+{
+	if(ListenFd < 0 || !getDB())	return 1;
+
+	if(pipe2(SignalPipe, O_CLOEXEC) != 0)	return 1;
+
+	struct sigaction Action;
+	memset(&Action, 0, sizeof(Action));
+	Action.sa_handler = onSignal;
+	sigemptyset(&Action.sa_mask);
+	sigaction(SIGHUP, &Action, NULL);
+	sigaction(SIGINT, &Action, NULL);
+	sigaction(SIGTERM, &Action, NULL);
+
+	bool Running = true;
+	while(Running)
+	{
+		struct pollfd fds[2];
+		fds[0].fd = ListenFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = SignalPipe[0];
+		fds[1].events = POLLIN;
+
+		if(poll(fds, 2, -1) < 0) {
+			if(errno == EINTR)	continue;
+			break;
+		}
+
+		if(fds[1].revents & POLLIN) {
+			char Signal;
+			if(read(SignalPipe[0], &Signal, 1) == 1) {
+				if(Signal == SIGHUP)	reload();
+				else					Running = false;
+			}
+		}
+
+		if(Running && (fds[0].revents & POLLIN)) {
+			int Fd = accept4(ListenFd, NULL, NULL, SOCK_CLOEXEC);
+			if(Fd < 0)	continue;
+
+			shared_ptr<Connection> C(new Connection(Fd));
+			{
+				lock_guard<mutex> Guard(ConnLock);
+				Connections.insert(C.get());
+			}
+			thread(&ScanServer::serve, this, C).detach();
+		}
+	}
+
+	// stop taking requests, let the workers finish the ones already queued
+	::close(ListenFd);
+	ListenFd = -1;
+	unlink(SocketPath.c_str());
+
+	{
+		unique_lock<mutex> Guard(ConnLock);
+		for(set<Connection*>::iterator it = Connections.begin(); it != Connections.end(); ++it)
+			shutdown((*it)->Fd, SHUT_RD);
+		while(!Connections.empty())
+			ConnDone.wait(Guard);
+	}
+	Pool.stop();
+
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	::close(SignalPipe[0]);
+	::close(SignalPipe[1]);
+	SignalPipe[0] = SignalPipe[1] = -1;
+
+	return 0;
+}
+
+// reader thread of a connection
+void ScanServer::serve(shared_ptr<Connection> C)
+{
+	FrameHeader Header;
+	string Payload;
+	int PassedFd;
+
+	while(readFrame(C->Fd, Header, Payload, &PassedFd))
+	{
+		// wait for room when the client pipelines more than we take
+		{
+			unique_lock<mutex> Guard(C->PendingLock);
+			while(C->Pending >= SERVER_MAX_PIPELINE)
+				C->PendingDone.wait(Guard);
+			C->Pending++;
+		}
+
+		if(!Pool.submit(std::bind(&ScanServer::handle, this, C, Header, Payload, PassedFd))) {
+			if(PassedFd >= 0)	::close(PassedFd);
+			break;
+		}
+	}
+
+	// notified under the lock, run() may destroy the server as soon as it's released
+	lock_guard<mutex> Guard(ConnLock);
+	Connections.erase(C.get());
+	ConnDone.notify_all();
+}
+
+void ScanServer::handle(shared_ptr<Connection> C, FrameHeader Header, string Payload, int PassedFd)
+{
+	switch(Header.Type)
+	{
+	case REQ_PING:
+		respond(*C, Header.Id, RESP_OK, "");
+		break;
+
+	case REQ_RELOAD:
+		if(reload())	respond(*C, Header.Id, RESP_OK, "");
+		else			respond(*C, Header.Id, RESP_ERROR, "Cannot load the db");
+		break;
+
+	case REQ_SCAN_PATH:
+		{
+			PE P;
+			shared_ptr<PackiD> iD = getDB();
+
+			if(!P.loadPE(&Payload[0])) {
+				respond(*C, Header.Id, RESP_NOT_PE, "");
+				break;
+			}
+
+			string Result = Cache.scanPE(*iD, P);
+			if(Result.compare(NO_MATCH))	respond(*C, Header.Id, RESP_MATCH, Result);
+			else							respond(*C, Header.Id, RESP_NO_MATCH, "");
+		}
+		break;
+
+	case REQ_SCAN_FD:
+		if(PassedFd < 0)	respond(*C, Header.Id, RESP_ERROR, "No file descriptor");
+		else				scanDescriptor(*C, Header.Id, PassedFd);
+		break;
+
+	default:
+		respond(*C, Header.Id, RESP_ERROR, "Unknown request");
+	}
+
+	if(PassedFd >= 0)	::close(PassedFd);
+
+	{
+		lock_guard<mutex> Guard(C->PendingLock);
+		C->Pending--;
+	}
+	C->PendingDone.notify_one();
+}
+
+/* scans the file behind a descriptor passed by the client. Only a memfd sealed with both F_SEAL_SHRINK and F_SEAL_WRITE
+ * is scanned in place from a read only mapping. Anything else is read into a private buffer:
+ * - a mapping of a file the client shrinks faults with SIGBUS when we read past the new end, taking the daemon down.
+ * - bytes the client rewrites during the scan would be hashed for the cache key and matched differently, putting a
+ *   wrong result in the cache every client shares. F_SEAL_FUTURE_WRITE is not enough, it leaves the client's
+ *   writable mappings made before the seal.
+ */
+void ScanServer::scanDescriptor(Connection &C, DWORD Id, int Fd)
+{
+	struct stat st;
+	if(fstat(Fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		respond(C, Id, RESP_ERROR, "Not a regular file");
+		return;
+	}
+
+	if(st.st_size == 0) {
+		respond(C, Id, RESP_NOT_PE, "");
+		return;
+	}
+	if((ULONGLONG)st.st_size > (DWORD)-1) {
+		respond(C, Id, RESP_ERROR, "File too large");
+		return;
+	}
+
+	int Seals = fcntl(Fd, F_GET_SEALS);
+	bool Mapped = Seals >= 0 && (Seals & F_SEAL_SHRINK) && (Seals & F_SEAL_WRITE);
+	LPBYTE Data;
+	DWORD Size = (DWORD)st.st_size;
+
+	if(Mapped) {
+		Data = (LPBYTE) mmap(NULL, Size, PROT_READ, MAP_SHARED, Fd, 0);
+		if(Data == MAP_FAILED) {
+			respond(C, Id, RESP_ERROR, "Cannot map the file");
+			return;
+		}
+	}
+	else {
+		Data = new (nothrow) BYTE[Size];
+		if(!Data) {
+			respond(C, Id, RESP_ERROR, "Not enough memory");
+			return;
+		}
+
+		// the file may shrink or change while we read it, what was read is scanned: our copy is what gets hashed and matched
+		DWORD Read = 0;
+		while(Read < Size) {
+			ssize_t n = pread(Fd, Data + Read, Size - Read, Read);
+			if(n < 0 && errno == EINTR)	continue;
+			if(n <= 0)	break;
+			Read += (DWORD)n;
+		}
+		Size = Read;
+	}
+
+	{
+		PE P;
+		shared_ptr<PackiD> iD = getDB();
+
+		if(!Size || !P.loadBuffer(Data, Size))
+			respond(C, Id, RESP_NOT_PE, "");
+		else {
+			string Result = Cache.scanPE(*iD, P);
+			if(Result.compare(NO_MATCH))	respond(C, Id, RESP_MATCH, Result);
+			else							respond(C, Id, RESP_NO_MATCH, "");
+		}
+	}
+
+	if(Mapped)	munmap(Data, Size);
+	else		delete[] Data;
+}
+
+void ScanServer::respond(Connection &C, DWORD Id, DWORD Type, const string &Payload)
+{
+	lock_guard<mutex> Guard(C.WriteLock);
+	writeFrame(C.Fd, Id, Type, Payload.data(), Payload.length());
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * ScanServer.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ScanServer_
+#define _ScanServer_
+
+#ifdef __linux__
+
+#include <string>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "ScanCache.h"
+#include "ThreadPool.h"
+#include "ScanProtocol.h"
+#include "PackiD.h"
+
+#define SERVER_MAX_PIPELINE		256				// requests of one connection queued or being scanned, the rest wait in the socket
+#define SERVER_BACKLOG			64
+
+/* The scanning daemon: loads the database once and serves scan requests (see ScanProtocol.h) on a unix socket.
+ * Every connection has a reader thread that queues its requests to a pool of workers, the workers scan and write
+ * the responses. A reload loads the new database next to the old one and swaps them, scans already running finish
+ * with the database they started with.
+ * run() serves until SIGINT or SIGTERM, SIGHUP reloads the database.
+ */
+class ScanServer
+{
+private:
+	struct Connection
+	{
+		int							Fd;
+		mutex						WriteLock;			// one response at a time on the socket
+		mutex						PendingLock;
+		condition_variable			PendingDone;
+		unsigned int				Pending;			// requests queued or being scanned
+
+		Connection(int fd) : Fd(fd), Pending(0) {}
+		~Connection();
+	};
+
+	string							DbPath;
+	string							CachePath;
+	int								Mode;
+
+	mutex							DbLock;
+	shared_ptr<PackiD>				Db;					// current database, replaced by reload()
+	mutex							ReloadLock;			// one reload at a time
+
+	ScanCache						Cache;
+	ThreadPool						Pool;
+
+	string							SocketPath;
+	int								ListenFd;
+
+	mutex							ConnLock;
+	condition_variable				ConnDone;
+	set<Connection*>				Connections;		// open connections, shut down when the server stops
+
+	shared_ptr<PackiD> getDB();
+	void serve(shared_ptr<Connection> C);
+	void handle(shared_ptr<Connection> C, FrameHeader Header, string Payload, int PassedFd);
+	void scanDescriptor(Connection &C, DWORD Id, int Fd);
+	void respond(Connection &C, DWORD Id, DWORD Type, const string &Payload);
+
+public:
+	ScanServer(unsigned int Threads);
+	~ScanServer();
+
+	inline void setMode(int mode) {
+		Mode = mode;
+	}
+
+	// loads the database, the cache file (optional) keeps results across restarts of the daemon
+	bool loadDB(const char* DbFile, const char* CacheFile = NULL);
+
+	// loads the database file again, the current one stays in use if it fails
+	bool reload();
+
+	bool listen(const char* Path);
+	int run();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * TarReader.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#include <cstring>
+#include "TarReader.h"
+
+TarReader::TarReader(istream &In) : In(In), Compressed(false), Started(false), Failed(false)
+{
+#ifdef HAVE_ZLIB
+	memset(&Z, 0, sizeof(Z));
+#endif
+}
+
+TarReader::~TarReader()
+{
+#ifdef HAVE_ZLIB
+	if(Compressed)	inflateEnd(&Z);
+#endif
+}
+
+bool TarReader::start()
+{
+	Started = true;
+
+	// a tar header starts with the member name, it never starts with the gzip magic 1f 8b
+	if(In.peek() != 0x1f)	return true;
+
+#ifdef HAVE_ZLIB
+	// 15 + 32: the default window, the gzip or zlib header is detected
+	if(inflateInit2(&Z, 15 + 32) != Z_OK)	return false;
+	Compressed = true;
+	Input.resize(TAR_INPUT_CHUNK);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool TarReader::read(void* Dest, size_t Size)
+{
+	if(!Compressed) {
+		In.read((char*)Dest, Size);
+		return (size_t)In.gcount() == Size;
+	}
+
+#ifdef HAVE_ZLIB
+	Z.next_out = (Bytef*)Dest;
+	Z.avail_out = (uInt)Size;
+
+	while(Z.avail_out)
+	{
+		if(!Z.avail_in) {
+			In.read((char*)&Input[0], Input.size());
+			Z.next_in = &Input[0];
+			Z.avail_in = (uInt)In.gcount();
+			if(!Z.avail_in)		return false;
+		}
+
+		int Status = inflate(&Z, Z_NO_FLUSH);
+
+		// gzip members can be concatenated (cat a.gz b.gz), the next one goes on with the tar stream
+		if(Status == Z_STREAM_END) {
+			if(inflateReset(&Z) != Z_OK)	return false;
+		}
+		else if(Status != Z_OK && Status != Z_BUF_ERROR)
+			return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool TarReader::skip(ULONGLONG Size)
+{
+	if(!Compressed) {
+		while(Size)
+		{
+			streamsize Chunk = (streamsize)(Size < TAR_INPUT_CHUNK ? Size : TAR_INPUT_CHUNK);
+			In.ignore(Chunk);
+			if(In.gcount() != Chunk)	return false;
+			Size -= Chunk;
+		}
+		return true;
+	}
+
+	BYTE Discard[TAR_BLOCK * 16];
+	while(Size)
+	{
+		size_t Chunk = (size_t)(Size < sizeof(Discard) ? Size : sizeof(Discard));
+		if(!read(Discard, Chunk))	return false;
+		Size -= Chunk;
+	}
+	return true;
+}
+
+ULONGLONG TarReader::parseNumber(const char* Field, size_t Size)
+{
+	ULONGLONG Value = 0;
+
+	// GNU base-256: the high bit of the first byte is set, the rest is a big endian number
+	if((BYTE)Field[0] & 0x80) {
+		Value = (BYTE)Field[0] & 0x7f;
+		for(size_t i = 1; i < Size; i++)
+			Value = (Value << 8) | (BYTE)Field[i];
+		return Value;
+	}
+
+	size_t i = 0;
+	while(i < Size && (Field[i] == ' ' || Field[i] == '0'))	i++;
+	for(; i < Size && Field[i] >= '0' && Field[i] <= '7'; i++)
+		Value = (Value << 3) | (Field[i] - '0');
+	return Value;
+}
+
+int TarReader::next(string &Name, vector<BYTE> &Data)
+{
+	if(!Started && !start())	Failed = true;
+	if(Failed)	return TAR_ERROR;
+
+	string LongName;		// from a GNU 'L' or pax 'x' entry, it names the member that follows
+
+	for(;;)
+	{
+		BYTE Header[TAR_BLOCK];
+
+		// the archive ends with zero blocks, some writers leave them out
+		if(!read(Header, sizeof(Header)))	return In.gcount() || Compressed ? TAR_ERROR : TAR_END;
+
+		size_t Zero = 0;
+		while(Zero < sizeof(Header) && !Header[Zero])	Zero++;
+		if(Zero == sizeof(Header))	return TAR_END;
+
+		// the checksum is the byte sum of the header, taking its own field as spaces
+		ULONGLONG Sum = 0;
+		for(size_t i = 0; i < sizeof(Header); i++)
+			Sum += (i >= 148 && i < 156) ? ' ' : Header[i];
+		if(Sum != parseNumber((const char*)Header + 148, 8)) {
+			Failed = true;
+			return TAR_ERROR;
+		}
+
+		char Type = (char)Header[156];
+		ULONGLONG Size = parseNumber((const char*)Header + 124, 12);
+		ULONGLONG Padded = (Size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+		if(Type == 'L' || Type == 'x') {
+			// long names are small, anything bigger is a broken header
+			if(Size > 0x10000) {
+				Failed = true;
+				return TAR_ERROR;
+			}
+
+			string Extended((size_t)Padded, '\0');
+			if(Padded && !read(&Extended[0], (size_t)Padded)) {
+				Failed = true;
+				return TAR_ERROR;
+			}
+			Extended.resize((size_t)Size);
+
+			if(Type == 'L')
+				LongName = Extended.c_str();
+			else {
+				// pax records: "<length> <key>=<value>\n"
+				size_t Record = 0;
+				while(Record < Extended.size())
+				{
+					size_t Length = (size_t)strtoul(Extended.c_str() + Record, NULL, 10);
+					if(!Length || Record + Length > Extended.size())	break;
+
+					string Line = Extended.substr(Record, Length - 1);
+					size_t Key = Line.find(" path=");
+					if(Key != string::npos && Line.find(' ') == Key)
+						LongName = Line.substr(Key + 6);
+					Record += Length;
+				}
+			}
+			continue;
+		}
+
+		// only regular files are scanned: '0', its old form '\0', and contiguous files '7'
+		if(Type != '0' && Type != '\0' && Type != '7') {
+			if(!skip(Padded)) {
+				Failed = true;
+				return TAR_ERROR;
+			}
+			LongName.clear();
+			continue;
+		}
+
+		if(LongName.size())
+			Name = LongName;
+		else {
+			Name.clear();
+			// ustar splits long paths into a prefix and a name
+			if(!memcmp(Header + 257, "ustar", 5) && Header[345])
+				Name.append((const char*)Header + 345, strnlen((const char*)Header + 345, 155)).append("/");
+			Name.append((const char*)Header, strnlen((const char*)Header, 100));
+		}
+
+		if(Size >= 0xFFFFFFFFULL) {
+			if(!skip(Padded)) {
+				Failed = true;
+				return TAR_ERROR;
+			}
+			return TAR_TOO_LARGE;
+		}
+
+		Data.resize((size_t)Size);
+		if((Size && !read(&Data[0], (size_t)Size)) || !skip(Padded - Size)) {
+			Failed = true;
+			return TAR_ERROR;
+		}
+		return TAR_MEMBER;
+	}
+}
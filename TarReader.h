@@ -0,0 +1,69 @@
+/*
+ * TarReader.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _TarReader_
+#define _TarReader_
+
+#include <string>
+#include <vector>
+#include <iostream>
+#ifdef HAVE_ZLIB
+	#include <zlib.h>
+#endif
+#ifndef __linux__
+	#include <windows.h>
+#else
+	#include "headers/Typedef.h"
+#endif
+
+using namespace std;
+
+#define TAR_BLOCK			512					// tar headers and member data are in blocks of this size
+#define TAR_INPUT_CHUNK		0x40000				// compressed bytes read at once
+
+// TarReader::next() returns
+#define TAR_MEMBER			0					// Data holds the next regular file
+#define TAR_END				1					// end of the archive
+#define TAR_TOO_LARGE		2					// the next regular file is 4GB or more, it was skipped
+#define TAR_ERROR			3					// the archive is corrupted or truncated, or it's gzip and zlib is missing
+
+/* Reads the regular files of a tar archive from a stream, gzip compressed or not, one after the other without
+ * seeking: a pipe or stdin work as well as a file. A compressed archive is inflated straight into the buffer of
+ * the member, HAVE_ZLIB is needed for them. Other entries (directories, links...) are skipped.
+ */
+class TarReader
+{
+private:
+	istream							&In;
+	bool							Compressed;
+	bool							Started;
+	bool							Failed;				// inflating failed, or zlib is missing
+#ifdef HAVE_ZLIB
+	z_stream						Z;
+	vector<BYTE>					Input;
+#endif
+
+	// Size bytes of the tar stream, false if it ends first
+	bool read(void* Dest, size_t Size);
+	bool skip(ULONGLONG Size);
+
+	// finds out whether the stream is compressed, false if it is and it can't be inflated
+	bool start();
+
+	// the value of a numeric header field: octal digits, or base-256 for large values
+	static ULONGLONG parseNumber(const char* Field, size_t Size);
+
+public:
+	TarReader(istream &In);
+	~TarReader();
+
+	// the next regular file: its path in the archive and its data in Data, which is reused from one member to the next
+	int next(string &Name, vector<BYTE> &Data);
+};
+
+#endif
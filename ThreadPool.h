@@ -0,0 +1,89 @@
+/*
+ * ThreadPool.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ */
+
+#ifndef _ThreadPool_
+#define _ThreadPool_
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+/* A fixed set of worker threads running queued jobs in order of submission.
+ * stop() lets the workers finish every queued job before they exit.
+ */
+class ThreadPool
+{
+private:
+	vector<thread>					Workers;
+	deque<function<void()> >		Jobs;
+	mutex							Lock;
+	condition_variable				JobReady;
+	bool							Stopping;
+
+	void work() {
+		for(;;) {
+			function<void()> Job;
+			{
+				unique_lock<mutex> Guard(Lock);
+				while(Jobs.empty() && !Stopping)
+					JobReady.wait(Guard);
+
+				if(Jobs.empty())	return;			// stopping and drained
+
+				Job = Jobs.front();
+				Jobs.pop_front();
+			}
+			Job();
+		}
+	}
+
+public:
+	ThreadPool(unsigned int Threads) : Stopping(false) {
+		if(Threads == 0)	Threads = 1;
+		for(unsigned int i = 0; i < Threads; i++)
+			Workers.push_back(thread(&ThreadPool::work, this));
+	}
+
+	~ThreadPool() {
+		stop();
+	}
+
+	// false once stop() was called
+	bool submit(const function<void()> &Job) {
+		{
+			lock_guard<mutex> Guard(Lock);
+			if(Stopping)	return false;
+			Jobs.push_back(Job);
+		}
+		JobReady.notify_one();
+		return true;
+	}
+
+	void stop() {
+		{
+			lock_guard<mutex> Guard(Lock);
+			Stopping = true;
+		}
+		JobReady.notify_all();
+
+		for(size_t i = 0; i < Workers.size(); i++)
+			if(Workers[i].joinable())	Workers[i].join();
+		Workers.clear();
+	}
+
+	size_t size() {
+		return Workers.size();
+	}
+};
+
+#endif
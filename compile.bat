@@ -1 +1,2 @@
-g++ -static main.cpp PackiD.cpp headers/PE.cpp headers/Util.cpp -o PackiD.exe -std=gnu++11 -O3 -Wl,--strip-all -I./../ -I./../headers
\ No newline at end of file
+g++ -static main.cpp PackiD.cpp ScanCache.cpp AsyncScanner.cpp ScanProtocol.cpp ScanServer.cpp ScanClient.cpp DirWatcher.cpp TarReader.cpp ScanManifest.cpp headers/PE.cpp headers/Util.cpp headers/Hash.cpp headers/Entropy.cpp -o PackiD.exe -std=gnu++11 -O3 -Wl,--strip-all -I./../ -I./../headers
+g++ -static -shared libpackid.cpp PackiD.cpp ScanCache.cpp headers/PE.cpp headers/Util.cpp headers/Hash.cpp headers/Entropy.cpp -o PackiD.dll -std=gnu++11 -O3 -Wl,--strip-all -I./../ -I./../headers
\ No newline at end of file
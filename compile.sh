@@ -0,0 +1,16 @@
+#!/bin/sh
+# Linux build: the command line tool and libpackid.so (C interface in libpackid.h)
+SOURCES="PackiD.cpp ScanCache.cpp AsyncScanner.cpp headers/PE.cpp headers/Util.cpp headers/Hash.cpp headers/Entropy.cpp"
+# -tar reads .tar.gz archives when zlib is installed, plain .tar archives otherwise
+ZLIB=""
+if [ -f /usr/include/zlib.h ]; then ZLIB="-DHAVE_ZLIB -lz"; fi
+g++ main.cpp $SOURCES ScanProtocol.cpp ScanServer.cpp ScanClient.cpp DirWatcher.cpp TarReader.cpp ScanManifest.cpp -o PackiD -std=gnu++11 -O3 -pthread -s $ZLIB || exit 1
+g++ -shared -fPIC -fvisibility=hidden libpackid.cpp $SOURCES -o libpackid.so -std=gnu++11 -O3 -pthread -s || exit 1
+
+# ./compile.sh test also builds and runs the tests
+if [ "$1" = "test" ]; then
+	g++ tests/AnchorTest.cpp $SOURCES -o tests/AnchorTest -std=gnu++11 -O3 -pthread || exit 1
+	./tests/AnchorTest || exit 1
+	g++ tests/TokenTest.cpp $SOURCES -o tests/TokenTest -std=gnu++11 -O3 -pthread || exit 1
+	./tests/TokenTest || exit 1
+fi
@@ -0,0 +1,104 @@
+/*
+ * Entropy.cpp
+ *
+ *  Created on: October 19, 2026
+ *  Author: Moustafa
+ *  Version: 1.0
+ */
+
+#include <cmath>
+#include <cstring>
+#include "Entropy.h"
+
+#define HISTOGRAM_BANKS			4
+#define HISTOGRAM_MIN_BANKED	4096		// below this size, zeroing and merging the 4KB of banks costs more than it saves
+
+static vector<float> buildNLogNTable()
+{
+	vector<float> Table(ENTROPY_MAX_WINDOW + 1);
+
+	Table[0] = 0;
+	for(DWORD n = 1; n <= ENTROPY_MAX_WINDOW; n++)
+		Table[n] = (float)(n * log2((double)n));
+
+	return Table;
+}
+
+// Table of n*log2(n) for n = 0..ENTROPY_MAX_WINDOW, built on first use (the static init is thread safe)
+static const float* getNLogNTable()
+{
+	static const vector<float> Table = buildNLogNTable();
+	return Table.data();
+}
+
+static inline double nLogN(ULONGLONG n, const float* Table)
+{
+	if(n <= ENTROPY_MAX_WINDOW)	return Table[n];
+	return (double)n * log2((double)n);
+}
+
+/* Counting into a single table stalls when the same byte repeats (zero padding is common in PE files), as every
+ * increment waits for the previous store to the same counter. Spreading consecutive bytes over 4 banks breaks
+ * that chain, and reading 8 bytes at a time saves the loads. The banks only pay off on large ranges: the blocks of
+ * PE::getEntropyProfile() (512 bytes by default) are counted straight into Counts.
+ */
+void byteHistogram(const BYTE* Data, size_t Size, DWORD Counts[256])
+{
+	if(Size < HISTOGRAM_MIN_BANKED) {
+		for(size_t i = 0; i < Size; i++)
+			Counts[Data[i]]++;
+		return;
+	}
+
+	DWORD Banks[HISTOGRAM_BANKS][256];
+	memset(Banks, 0, sizeof(Banks));
+
+	size_t i = 0;
+	for(; i + 8 <= Size; i += 8) {
+		ULONGLONG v;
+		memcpy(&v, Data + i, sizeof(v));
+		Banks[0][(BYTE)(v)]++;
+		Banks[1][(BYTE)(v >> 8)]++;
+		Banks[2][(BYTE)(v >> 16)]++;
+		Banks[3][(BYTE)(v >> 24)]++;
+		Banks[0][(BYTE)(v >> 32)]++;
+		Banks[1][(BYTE)(v >> 40)]++;
+		Banks[2][(BYTE)(v >> 48)]++;
+		Banks[3][(BYTE)(v >> 56)]++;
+	}
+	for(; i < Size; i++)
+		Banks[0][Data[i]]++;
+
+	for(int s = 0; s < 256; s++)
+		Counts[s] += Banks[0][s] + Banks[1][s] + Banks[2][s] + Banks[3][s];
+}
+
+/* H = -sum(p * log2(p)) with p = c / N, rewritten as log2(N) - sum(c * log2(c)) / N
+ * so each symbol costs one table lookup.
+ */
+float histogramEntropy(const DWORD Counts[256], ULONGLONG Total)
+{
+	if(Total == 0)	return -1;
+
+	const float* Table = getNLogNTable();
+	double Sum = 0;
+	for(int s = 0; s < 256; s++)
+		Sum += nLogN(Counts[s], Table);
+
+	double Entropy = log2((double)Total) - Sum / (double)Total;
+	if(Entropy < 0)	Entropy = 0;			// rounding, a single symbol file
+
+	return (float)Entropy;
+}
+
+float getEntropy(LPVOID Mem, INT Size)
+{
+	if(Size == 0)	return -1;
+
+	DWORD SymbolsCount[256];
+	memset(SymbolsCount, 0, sizeof(SymbolsCount));
+
+	byteHistogram((const BYTE*)Mem, Size, SymbolsCount);
+
+	return histogramEntropy(SymbolsCount, Size);
+}
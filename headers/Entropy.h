@@ -0,0 +1,47 @@
+/*
+ * Entropy.h
+ *
+ *  Created on: October 19, 2026
+ *  Author: Moustafa
+ *  Version: 1.0
+ *
+ * Byte histograms and Shannon entropy of memory ranges.
+ */
+
+#ifndef _ENTROPY_
+#define _ENTROPY_
+
+#include <cstddef>
+#include <vector>
+#ifndef __linux__
+	#include <windows.h>
+#else
+	#include "Typedef.h"
+#endif
+
+using namespace std;
+
+#define ENTROPY_WINDOW_SIZE		2048			// default size of the sliding window of an entropy profile
+#define ENTROPY_WINDOW_STEP		512				// default distance between two consecutive windows
+#define ENTROPY_MAX_WINDOW		65536			// n*log2(n) is read from a table up to this count
+#define ENTROPY_MAX_CUTS		1024			// section boundaries tracked in one pass, more sections are computed separately
+
+// Entropy of the whole file, its sections, and a sliding window over the file, computed in one pass by PE::getEntropyProfile()
+typedef struct
+	{
+		float			FileEntropy;
+		vector<float>	SectionEntropy;			// in the order of PE::getSections(), with the same error values as PE::getSectionEntropy()
+		DWORD			WindowSize;
+		DWORD			WindowStep;
+		vector<float>	Windows;				// Windows[i] is the entropy of WindowSize bytes at offset i * WindowStep
+	} EntropyProfile;
+
+// adds the count of every byte value in Data to Counts
+void byteHistogram(const BYTE* Data, size_t Size, DWORD Counts[256]);
+
+// entropy in bits per byte of Total bytes counted in Counts
+float histogramEntropy(const DWORD Counts[256], ULONGLONG Total);
+
+float getEntropy(LPVOID Mem, INT Size);
+
+#endif
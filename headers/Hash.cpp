@@ -0,0 +1,258 @@
+/*
+ * Hash.cpp
+ *
+ *  Created on: October 19, 2026
+ *  Author: Moustafa
+ *  Version: 1.0
+ */
+
+#include <cstring>
+#include "Hash.h"
+
+#define MD5_F(x, y, z)	(((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z)	(((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z)	((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z)	((y) ^ ((x) | ~(z)))
+#define ROTL32(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s)	\
+	(a) += f((b), (c), (d)) + (x) + (DWORD)(t);	\
+	(a) = ROTL32((a), (s)) + (b);
+
+void MD5::init()
+{
+	State[0] = 0x67452301;
+	State[1] = 0xefcdab89;
+	State[2] = 0x98badcfe;
+	State[3] = 0x10325476;
+	Length = 0;
+}
+
+void MD5::transform(const BYTE* Data)
+{
+	DWORD X[16];
+	for(int i = 0; i < 16; i++)
+		X[i] = (DWORD)Data[i*4] | ((DWORD)Data[i*4+1] << 8) | ((DWORD)Data[i*4+2] << 16) | ((DWORD)Data[i*4+3] << 24);
+
+	DWORD a = State[0], b = State[1], c = State[2], d = State[3];
+
+	MD5_STEP(MD5_F, a, b, c, d, X[ 0], 0xd76aa478,  7)
+	MD5_STEP(MD5_F, d, a, b, c, X[ 1], 0xe8c7b756, 12)
+	MD5_STEP(MD5_F, c, d, a, b, X[ 2], 0x242070db, 17)
+	MD5_STEP(MD5_F, b, c, d, a, X[ 3], 0xc1bdceee, 22)
+	MD5_STEP(MD5_F, a, b, c, d, X[ 4], 0xf57c0faf,  7)
+	MD5_STEP(MD5_F, d, a, b, c, X[ 5], 0x4787c62a, 12)
+	MD5_STEP(MD5_F, c, d, a, b, X[ 6], 0xa8304613, 17)
+	MD5_STEP(MD5_F, b, c, d, a, X[ 7], 0xfd469501, 22)
+	MD5_STEP(MD5_F, a, b, c, d, X[ 8], 0x698098d8,  7)
+	MD5_STEP(MD5_F, d, a, b, c, X[ 9], 0x8b44f7af, 12)
+	MD5_STEP(MD5_F, c, d, a, b, X[10], 0xffff5bb1, 17)
+	MD5_STEP(MD5_F, b, c, d, a, X[11], 0x895cd7be, 22)
+	MD5_STEP(MD5_F, a, b, c, d, X[12], 0x6b901122,  7)
+	MD5_STEP(MD5_F, d, a, b, c, X[13], 0xfd987193, 12)
+	MD5_STEP(MD5_F, c, d, a, b, X[14], 0xa679438e, 17)
+	MD5_STEP(MD5_F, b, c, d, a, X[15], 0x49b40821, 22)
+
+	MD5_STEP(MD5_G, a, b, c, d, X[ 1], 0xf61e2562,  5)
+	MD5_STEP(MD5_G, d, a, b, c, X[ 6], 0xc040b340,  9)
+	MD5_STEP(MD5_G, c, d, a, b, X[11], 0x265e5a51, 14)
+	MD5_STEP(MD5_G, b, c, d, a, X[ 0], 0xe9b6c7aa, 20)
+	MD5_STEP(MD5_G, a, b, c, d, X[ 5], 0xd62f105d,  5)
+	MD5_STEP(MD5_G, d, a, b, c, X[10], 0x02441453,  9)
+	MD5_STEP(MD5_G, c, d, a, b, X[15], 0xd8a1e681, 14)
+	MD5_STEP(MD5_G, b, c, d, a, X[ 4], 0xe7d3fbc8, 20)
+	MD5_STEP(MD5_G, a, b, c, d, X[ 9], 0x21e1cde6,  5)
+	MD5_STEP(MD5_G, d, a, b, c, X[14], 0xc33707d6,  9)
+	MD5_STEP(MD5_G, c, d, a, b, X[ 3], 0xf4d50d87, 14)
+	MD5_STEP(MD5_G, b, c, d, a, X[ 8], 0x455a14ed, 20)
+	MD5_STEP(MD5_G, a, b, c, d, X[13], 0xa9e3e905,  5)
+	MD5_STEP(MD5_G, d, a, b, c, X[ 2], 0xfcefa3f8,  9)
+	MD5_STEP(MD5_G, c, d, a, b, X[ 7], 0x676f02d9, 14)
+	MD5_STEP(MD5_G, b, c, d, a, X[12], 0x8d2a4c8a, 20)
+
+	MD5_STEP(MD5_H, a, b, c, d, X[ 5], 0xfffa3942,  4)
+	MD5_STEP(MD5_H, d, a, b, c, X[ 8], 0x8771f681, 11)
+	MD5_STEP(MD5_H, c, d, a, b, X[11], 0x6d9d6122, 16)
+	MD5_STEP(MD5_H, b, c, d, a, X[14], 0xfde5380c, 23)
+	MD5_STEP(MD5_H, a, b, c, d, X[ 1], 0xa4beea44,  4)
+	MD5_STEP(MD5_H, d, a, b, c, X[ 4], 0x4bdecfa9, 11)
+	MD5_STEP(MD5_H, c, d, a, b, X[ 7], 0xf6bb4b60, 16)
+	MD5_STEP(MD5_H, b, c, d, a, X[10], 0xbebfbc70, 23)
+	MD5_STEP(MD5_H, a, b, c, d, X[13], 0x289b7ec6,  4)
+	MD5_STEP(MD5_H, d, a, b, c, X[ 0], 0xeaa127fa, 11)
+	MD5_STEP(MD5_H, c, d, a, b, X[ 3], 0xd4ef3085, 16)
+	MD5_STEP(MD5_H, b, c, d, a, X[ 6], 0x04881d05, 23)
+	MD5_STEP(MD5_H, a, b, c, d, X[ 9], 0xd9d4d039,  4)
+	MD5_STEP(MD5_H, d, a, b, c, X[12], 0xe6db99e5, 11)
+	MD5_STEP(MD5_H, c, d, a, b, X[15], 0x1fa27cf8, 16)
+	MD5_STEP(MD5_H, b, c, d, a, X[ 2], 0xc4ac5665, 23)
+
+	MD5_STEP(MD5_I, a, b, c, d, X[ 0], 0xf4292244,  6)
+	MD5_STEP(MD5_I, d, a, b, c, X[ 7], 0x432aff97, 10)
+	MD5_STEP(MD5_I, c, d, a, b, X[14], 0xab9423a7, 15)
+	MD5_STEP(MD5_I, b, c, d, a, X[ 5], 0xfc93a039, 21)
+	MD5_STEP(MD5_I, a, b, c, d, X[12], 0x655b59c3,  6)
+	MD5_STEP(MD5_I, d, a, b, c, X[ 3], 0x8f0ccc92, 10)
+	MD5_STEP(MD5_I, c, d, a, b, X[10], 0xffeff47d, 15)
+	MD5_STEP(MD5_I, b, c, d, a, X[ 1], 0x85845dd1, 21)
+	MD5_STEP(MD5_I, a, b, c, d, X[ 8], 0x6fa87e4f,  6)
+	MD5_STEP(MD5_I, d, a, b, c, X[15], 0xfe2ce6e0, 10)
+	MD5_STEP(MD5_I, c, d, a, b, X[ 6], 0xa3014314, 15)
+	MD5_STEP(MD5_I, b, c, d, a, X[13], 0x4e0811a1, 21)
+	MD5_STEP(MD5_I, a, b, c, d, X[ 4], 0xf7537e82,  6)
+	MD5_STEP(MD5_I, d, a, b, c, X[11], 0xbd3af235, 10)
+	MD5_STEP(MD5_I, c, d, a, b, X[ 2], 0x2ad7d2bb, 15)
+	MD5_STEP(MD5_I, b, c, d, a, X[ 9], 0xeb86d391, 21)
+
+	State[0] += a;
+	State[1] += b;
+	State[2] += c;
+	State[3] += d;
+}
+
+void MD5::update(const void* Data, size_t Size)
+{
+	const BYTE* p = (const BYTE*)Data;
+	size_t Used = (size_t)(Length & 63);
+	Length += Size;
+
+	// complete the pending block first
+	if(Used) {
+		size_t n = 64 - Used;
+		if(Size < n) {
+			memcpy(Block + Used, p, Size);
+			return;
+		}
+		memcpy(Block + Used, p, n);
+		transform(Block);
+		p += n;
+		Size -= n;
+	}
+
+	for(; Size >= 64; p += 64, Size -= 64)
+		transform(p);
+
+	if(Size)
+		memcpy(Block, p, Size);
+}
+
+void MD5::final(BYTE Digest[MD5_DIGEST_SIZE])
+{
+	BYTE Pad[72];
+	ULONGLONG Bits = Length * 8;
+	size_t Used = (size_t)(Length & 63);
+	size_t PadLen = (Used < 56) ? (56 - Used) : (120 - Used);
+
+	memset(Pad, 0, sizeof(Pad));
+	Pad[0] = 0x80;
+	for(int i = 0; i < 8; i++)
+		Pad[PadLen + i] = (BYTE)(Bits >> (i * 8));
+	update(Pad, PadLen + 8);
+
+	for(int i = 0; i < 4; i++) {
+		Digest[i*4]   = (BYTE)(State[i]);
+		Digest[i*4+1] = (BYTE)(State[i] >> 8);
+		Digest[i*4+2] = (BYTE)(State[i] >> 16);
+		Digest[i*4+3] = (BYTE)(State[i] >> 24);
+	}
+	init();
+}
+
+void digestToHex(const BYTE* Digest, size_t Size, char* Out)
+{
+	static const char Hex[] = "0123456789abcdef";
+	for(size_t i = 0; i < Size; i++) {
+		Out[i*2]   = Hex[Digest[i] >> 4];
+		Out[i*2+1] = Hex[Digest[i] & 0x0F];
+	}
+	Out[Size*2] = '\0';
+}
+
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+#define ROTL64(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline ULONGLONG read64(const BYTE* p)
+{
+	ULONGLONG v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline DWORD read32(const BYTE* p)
+{
+	DWORD v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline ULONGLONG xxhRound(ULONGLONG Acc, ULONGLONG Input)
+{
+	Acc += Input * XXH_PRIME64_2;
+	Acc = ROTL64(Acc, 31);
+	return Acc * XXH_PRIME64_1;
+}
+
+static inline ULONGLONG xxhMerge(ULONGLONG Acc, ULONGLONG Val)
+{
+	Acc ^= xxhRound(0, Val);
+	return Acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+ULONGLONG hash64(const void* Data, size_t Size, ULONGLONG Seed)
+{
+	const BYTE* p = (const BYTE*)Data;
+	const BYTE* End = p + Size;
+	ULONGLONG h;
+
+	if(Size >= 32) {
+		ULONGLONG v1 = Seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		ULONGLONG v2 = Seed + XXH_PRIME64_2;
+		ULONGLONG v3 = Seed;
+		ULONGLONG v4 = Seed - XXH_PRIME64_1;
+
+		for(; p + 32 <= End; p += 32) {
+			v1 = xxhRound(v1, read64(p));
+			v2 = xxhRound(v2, read64(p + 8));
+			v3 = xxhRound(v3, read64(p + 16));
+			v4 = xxhRound(v4, read64(p + 24));
+		}
+
+		h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	}
+	else
+		h = Seed + XXH_PRIME64_5;
+
+	h += (ULONGLONG)Size;
+
+	for(; p + 8 <= End; p += 8) {
+		h ^= xxhRound(0, read64(p));
+		h = ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+
+	if(p + 4 <= End) {
+		h ^= (ULONGLONG)read32(p) * XXH_PRIME64_1;
+		h = ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	for(; p < End; p++) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = ROTL64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
@@ -0,0 +1,47 @@
+/*
+ * Hash.h
+ *
+ *  Created on: October 19, 2026
+ *  Author: Moustafa
+ *  Version: 1.0
+ *
+ * Streaming hash functions used to fingerprint samples and their parts.
+ */
+
+#ifndef _HASH_
+#define _HASH_
+
+#include <cstddef>
+#ifndef __linux__
+	#include <windows.h>
+#else
+	#include "Typedef.h"
+#endif
+
+#define MD5_DIGEST_SIZE		16
+
+// Incremental MD5 (RFC 1321), no heap allocation. Used for the imphash which is MD5 by definition.
+class MD5
+{
+private:
+	DWORD		State[4];
+	ULONGLONG	Length;					// number of bytes hashed so far
+	BYTE		Block[64];				// pending partial block
+
+	void transform(const BYTE* Data);
+
+public:
+	MD5()	{ init(); }
+
+	void init();
+	void update(const void* Data, size_t Size);
+	void final(BYTE Digest[MD5_DIGEST_SIZE]);
+};
+
+// 64 bit non-cryptographic hash of a memory range (xxHash64 algorithm), fast enough to fingerprint whole samples
+ULONGLONG hash64(const void* Data, size_t Size, ULONGLONG Seed = 0);
+
+// writes the lower case hex of Size bytes into Out, Out must have room for Size*2 + 1 chars
+void digestToHex(const BYTE* Digest, size_t Size, char* Out);
+
+#endif
@@ -18,27 +18,35 @@
 #include <utility>
 #include <string>
 #include <sstream>
+#include <cstdio>
+#include <cctype>
+#include <new>
 #include "PE.h"
+#include "Entropy.h"
 #include "Util.h"
 
 #define EP_NOT_IN_SECTIONS	-1
 
-#define IMAGE_FIRST_SECTION64(h) ((PIMAGE_SECTION_HEADER) ((DWORD)h+FIELD_OFFSET(IMAGE_NT_HEADERS64,OptionalHeader)+((PIMAGE_NT_HEADERS64)(h))->FileHeader.SizeOfOptionalHeader))
-
 void PE::init()
 {
 	FileName			= NULL;
 	//FileHandle 		= 0;
 	LoadAddr	 		= NULL;
+	OwnsBuffer			= false;
+	Mapped				= false;
+	OutOfMemory			= false;
 
 	FileSize			= 0;
 	PEheader			= NULL;
+	PEheader64			= NULL;
 	Suspicious			= 0;
 	fImportByOrdinal	= false;
 	DoneImportScaning	= false;
 	DoneSectionParsing	= false;
 
 	EpSection			= NULL;
+	SectionsOverlap		= false;
+	memset(&Header, 0, sizeof(Header));
 }
 
 PE::PE()
@@ -65,6 +73,10 @@ DWORD PE::getOffsetFromRva(DWORD rva)
 	*/
 	DWORD offset = -1;
 	PIMAGE_SECTION_HEADER Section;
+
+	// a mapped image is laid out by RVA already
+	if (Mapped)	return (rva < FileSize && getReadableEnd(rva) > rva) ? rva : -1;
+
 	if (Section = getSection(rva)) {
 		// we could get a containing section, but still the rva outside the physical file in case of VirtualSize > SizeOfRawData
 		// so we need to check if rva > FileSize
@@ -74,31 +86,215 @@ DWORD PE::getOffsetFromRva(DWORD rva)
 	}
 
 	// if the file has no sections or the rva in the header
-	Section = getFirstSection();
-	if (!Section || rva < Section->VirtualAddress)	return rva;
+	if (Sections.empty() || rva < Sections[0]->VirtualAddress)	return rva;
 
 	return -1;
 }
 
-/* Loads the file ONLY if it's a PE file */
-LPVOID PE::loadPE(char* FileName)
+static bool compareSectionRange(const SectionRange &a, const SectionRange &b)
+{
+	return a.VirtualAddress < b.VirtualAddress;
+}
+
+/* Reads the section table once and builds the index used by every RVA lookup.
+ * Sections with no virtual size can't contain any RVA, so they are kept in Sections but not in the index.
+ */
+void PE::buildSectionIndex()
+{
+	Sections.clear();
+	SectionIndex.clear();
+	SectionsOverlap = false;
+
+	unsigned int NumberOfSections = Header.NumberOfSections;
+	PIMAGE_SECTION_HEADER Section = getFirstSection();
+
+	// don't read section headers past the end of the file
+	if((LPBYTE)Section < LoadAddr || (LPBYTE)Section > LoadAddr + FileSize)
+		NumberOfSections = 0;
+	else
+		NumberOfSections = min(NumberOfSections, (unsigned int)((LoadAddr + FileSize - (LPBYTE)Section) / sizeof(IMAGE_SECTION_HEADER)));
+
+	Sections.reserve(NumberOfSections);
+	SectionIndex.reserve(NumberOfSections);
+
+	for (unsigned int i = 0; i < NumberOfSections; i++, Section++)
+	{
+		Sections.push_back(Section);
+
+		SectionRange Range;
+		Range.VirtualAddress	= Section->VirtualAddress;
+		Range.VirtualEnd		= Section->VirtualAddress + Section->Misc.VirtualSize;
+		Range.RawStart			= min(getSectionOffset(Section), FileSize);
+		Range.RawEnd			= (getSectionDataSize(Section) > FileSize - Range.RawStart) ? FileSize : Range.RawStart + getSectionDataSize(Section);
+		Range.Header			= Section;
+
+		// empty, or wraps around 4GB (the section table walk never matched those either)
+		if(Range.VirtualEnd <= Range.VirtualAddress)	continue;
+
+		SectionIndex.push_back(Range);
+	}
+
+	stable_sort(SectionIndex.begin(), SectionIndex.end(), compareSectionRange);
+
+	for (unsigned int i = 1; i < SectionIndex.size(); i++)
+		if (SectionIndex[i].VirtualAddress < SectionIndex[i-1].VirtualEnd)
+			SectionsOverlap = true;
+}
+
+// drop whatever was cached from a previously loaded file
+void PE::reset()
 {
 	if(LoadAddr)
 		unloadFile();
 
-	LPVOID FH = loadFile(FileName);
-	if(!FH)				return NULL;
-	if(!isPE(FH))		return NULL;			// The file is not PE file
+	Suspicious			= 0;
+	fImportByOrdinal	= false;
+	DoneImportScaning	= false;
+	DoneSectionParsing	= false;
+	EpSection			= NULL;
+	Mapped				= false;
+	OutOfMemory			= false;
+	Modules.clear();
+	Sections.clear();
+	SectionIndex.clear();
+	Readable.clear();
+}
+
+// parses the headers of the file at LoadAddr
+LPVOID PE::parsePE()
+{
+	if(!isPE(LoadAddr))		return NULL;			// The file is not PE file
 
 	/* Load PE info */
 
 	// Get PE header offset
-	PEheader = (PIMAGE_NT_HEADERS) getPEoffset();
+	PEheader = (PIMAGE_NT_HEADERS32) getPEoffset();
 	PEheader64 = (PIMAGE_NT_HEADERS64) getPEoffset();
 
+	// the magic is right after the file header for both layouts
+	bool Parsed;
+	if(PEheader64->OptionalHeader.Magic == 0x20B)			// 64 bit file
+		Parsed = parseHeader<IMAGE_NT_HEADERS64>();
+	else
+		Parsed = parseHeader<IMAGE_NT_HEADERS32>();
+	if(!Parsed)			return NULL;
+
+	buildSectionIndex();
+
 	return PEheader;
 }
 
+/* Loads the file ONLY if it's a PE file */
+LPVOID PE::loadPE(char* FileName)
+{
+	reset();
+
+	LPVOID FH = loadFile(FileName);
+	if(!FH)				return NULL;
+
+	return parsePE();
+}
+
+/* Uses a file already in memory, e.g. a mapped file. The buffer is only read, never copied or freed,
+ * it must stay valid as long as the PE is used or until another file is loaded.
+ */
+LPVOID PE::loadBuffer(const BYTE* Buffer, DWORD Size)
+{
+	reset();
+
+	if(!Buffer)			return NULL;
+
+	LoadAddr = (LPBYTE) Buffer;
+	FileSize = Size;
+	OwnsBuffer = false;
+
+	return parsePE();
+}
+
+LPVOID PE::loadImage(const BYTE* Buffer, DWORD Size, const vector<pair<DWORD, DWORD> >* Ranges)
+{
+	reset();
+
+	if(!Buffer)			return NULL;
+
+	LoadAddr = (LPBYTE) Buffer;
+	FileSize = Size;
+	OwnsBuffer = false;
+	Mapped = true;
+
+	if(Ranges) {
+		for(size_t i = 0; i < Ranges->size(); i++) {
+			DWORD Start = (*Ranges)[i].first;
+			DWORD End = min((*Ranges)[i].second, Size);
+			if(Start < End)		Readable.push_back(make_pair(Start, End));
+		}
+		sort(Readable.begin(), Readable.end());
+
+		size_t n = 0;
+		for(size_t i = 0; i < Readable.size(); i++) {
+			if(n && Readable[i].first <= Readable[n - 1].second)
+				Readable[n - 1].second = max(Readable[n - 1].second, Readable[i].second);
+			else
+				Readable[n++] = Readable[i];
+		}
+		Readable.resize(n);
+
+		// the headers must be readable to be parsed, an empty map means all of it is
+		if(!n || Readable[0].first != 0)	return NULL;
+		FileSize = Readable[n - 1].second;
+		if(n == 1)	Readable.clear();
+	}
+
+	return parsePE();
+}
+
+LPVOID PE::loadImage(char* FileName)
+{
+	reset();
+
+	LPVOID FH = loadFile(FileName);
+	if(!FH)				return NULL;
+
+	Mapped = true;
+	return parsePE();
+}
+
+DWORD PE::getReadableEnd(DWORD Offset)
+{
+	if(Offset >= FileSize)	return Offset;
+	if(Readable.empty())	return FileSize;
+
+	// the last range starting at or before Offset
+	vector<pair<DWORD, DWORD> >::const_iterator it = upper_bound(Readable.begin(), Readable.end(), make_pair(Offset, (DWORD)-1));
+	if(it == Readable.begin())	return Offset;
+	--it;
+	return (Offset < it->second) ? it->second : Offset;
+}
+
+DWORD PE::getReadableStart(DWORD Offset)
+{
+	if(Readable.empty())	return Offset;
+
+	// the first range starting after Offset, unless the one before it holds Offset
+	vector<pair<DWORD, DWORD> >::const_iterator it = upper_bound(Readable.begin(), Readable.end(), make_pair(Offset, (DWORD)-1));
+	if(it != Readable.begin() && Offset < (it - 1)->second)	return Offset;
+	return (it == Readable.end()) ? FileSize : it->first;
+}
+
+DWORD PE::readableHistogram(DWORD Offset, DWORD Size, DWORD Counts[256])
+{
+	DWORD End = (Size > FileSize - min(Offset, FileSize)) ? FileSize : Offset + Size;
+	DWORD Counted = 0;
+
+	for(DWORD p = getReadableStart(Offset); p < End; p = getReadableStart(p)) {
+		DWORD q = min(getReadableEnd(p), End);
+		byteHistogram(LoadAddr + p, q - p, Counts);
+		Counted += q - p;
+		p = q;
+	}
+	return Counted;
+}
+
 LPVOID PE::loadFile(char* fn)
 {
 	FileName = fn;
@@ -110,6 +306,7 @@ LPVOID PE::loadFile(char* fn)
 	if(FileSize == INVALID_FILE_SIZE)		return NULL;
 
 	LoadAddr = (LPBYTE) new char [FileSize];
+	OwnsBuffer = true;
     FileHandle.seekg (0, ios::beg);
     FileHandle.read ((char *)LoadAddr, FileSize);
     FileHandle.close();
@@ -117,25 +314,114 @@ LPVOID PE::loadFile(char* fn)
 	return LoadAddr;
 }
 
+LPVOID PE::loadStream(istream &In, DWORD Size)
+{
+	reset();
+
+	// start small even if the size is known, a frame header may claim far more than ever arrives
+	DWORD Capacity = min((DWORD)STREAM_CHUNK, Size);
+	LoadAddr = (LPBYTE) new (nothrow) char [Capacity ? Capacity : 1];
+	OwnsBuffer = true;
+	FileSize = 0;
+
+	while(LoadAddr && FileSize < Size)
+	{
+		// double the buffer once it's full, up to Size or 4GB - 1
+		if(FileSize == Capacity) {
+			if(Capacity == (DWORD)-1)	return NULL;
+			Capacity = (Capacity > (DWORD)-1 / 2) ? (DWORD)-1 : Capacity * 2;
+			Capacity = min(Capacity, Size);
+
+			LPBYTE Grown = (LPBYTE) new (nothrow) char [Capacity];
+			if(Grown)	memcpy(Grown, LoadAddr, FileSize);
+			delete[] LoadAddr;
+			LoadAddr = Grown;
+			if(!LoadAddr)	break;
+		}
+
+		In.read((char*)LoadAddr + FileSize, Capacity - FileSize);
+		FileSize += (DWORD)In.gcount();
+		if(!In)		break;
+	}
+
+	if(!LoadAddr) {
+		// skip the rest of a sized file so In stays at the next one, FileSize still counts what was consumed
+		OutOfMemory = true;
+		OwnsBuffer = false;
+		if(Size != (DWORD)-1 && In) {
+			In.ignore((streamsize)(Size - FileSize));
+			FileSize += (DWORD)In.gcount();
+		}
+		return NULL;
+	}
+
+	if(Size != (DWORD)-1 && FileSize != Size)	return NULL;
+
+	return parsePE();
+}
+
 bool PE::isPE(LPVOID FileHandle)
 {
 	if(FileHandle == NULL) return false;
 
+	if(FileSize < sizeof(IMAGE_DOS_HEADER))	return false;
 	if(*(WORD *)LoadAddr != 0x5A4D)	return false;			// test for 'MZ'
 
-	// get PE header
+	// get PE header, it must have room for the signature, the file header and the optional header magic
 	DWORD *sig = (DWORD *) getPEoffset();
+	if(!sig)	return false;
+	if((LPBYTE)sig + FIELD_OFFSET(IMAGE_NT_HEADERS32, OptionalHeader) + sizeof(WORD) > LoadAddr + FileSize)	return false;
 
 	if(*sig == 0x00004550)	return true;					// test for 'PE\0\0'
 
 	return false;
 }
 
+/* Reads the header fields into Header, T is the layout matching the optional header magic.
+ * False if the end of file cuts the optional header or the section table.
+ */
+template <class T>		// T: IMAGE_NT_HEADERS64 or IMAGE_NT_HEADERS32
+bool PE::parseHeader()
+{
+	T NtHeaders;
+	LPBYTE NtAddr = (LPBYTE) getPEoffset();
+	size_t Available = LoadAddr + FileSize - NtAddr;
+
+	// the file header is there, isPE() checked it
+	WORD SizeOfOptionalHeader = ((PIMAGE_NT_HEADERS32)NtAddr)->FileHeader.SizeOfOptionalHeader;
+	WORD NumberOfSections = ((PIMAGE_NT_HEADERS32)NtAddr)->FileHeader.NumberOfSections;
+	size_t SectionTable = FIELD_OFFSET(T, OptionalHeader) + SizeOfOptionalHeader;
+	if(Available < SectionTable || Available - SectionTable < (size_t)NumberOfSections * sizeof(IMAGE_SECTION_HEADER))
+		return false;
+
+	memset(&NtHeaders, 0, sizeof(NtHeaders));
+	memcpy(&NtHeaders, NtAddr, min(Available, sizeof(NtHeaders)));
+
+	Header.Is64					= (sizeof(NtHeaders.OptionalHeader.ImageBase) == sizeof(ULONGLONG));
+	Header.Machine				= NtHeaders.FileHeader.Machine;
+	Header.Characteristics		= NtHeaders.FileHeader.Characteristics;
+	Header.NumberOfSections		= NtHeaders.FileHeader.NumberOfSections;
+	Header.EntryPoint			= NtHeaders.OptionalHeader.AddressOfEntryPoint;
+	Header.ImageBase			= NtHeaders.OptionalHeader.ImageBase;
+	Header.SectionAlignment		= NtHeaders.OptionalHeader.SectionAlignment;
+	Header.FileAlignment		= NtHeaders.OptionalHeader.FileAlignment;
+	Header.SizeOfImage			= NtHeaders.OptionalHeader.SizeOfImage;
+	Header.SizeOfHeaders		= NtHeaders.OptionalHeader.SizeOfHeaders;
+	Header.NumberOfRvaAndSizes	= NtHeaders.OptionalHeader.NumberOfRvaAndSizes;
+	memcpy(Header.DataDirectory, NtHeaders.OptionalHeader.DataDirectory, sizeof(Header.DataDirectory));
+
+	// section table follows the optional header, whatever its declared size is
+	Header.FirstSection = (PIMAGE_SECTION_HEADER)(NtAddr + SectionTable);
+
+	return true;
+}
+
 void PE::unloadFile()
 {
 	if(LoadAddr) {
-		delete[] LoadAddr;
+		if(OwnsBuffer)	delete[] LoadAddr;
 		LoadAddr = NULL;
+		OwnsBuffer = false;
 	}
 }
 
@@ -144,7 +430,7 @@ void PE::unloadPE()
 	unloadFile();
 }
 
-DWORD PE::getPEoffset()
+ULONG_PTR PE::getPEoffset()
 {
 	/*
 	// consider rewrite it as:
@@ -159,29 +445,7 @@ DWORD PE::getPEoffset()
 	char *handle = (char *)LoadAddr;
 	DWORD *sig = (DWORD *)&handle[index];
 
-	return (DWORD) sig;
-}
-
-// get RVA of EP
-DWORD PE::getEntryPoint()
-{
-	if(isPE64())
-		return PEheader64->OptionalHeader.AddressOfEntryPoint;
-	
-	return PEheader->OptionalHeader.AddressOfEntryPoint;
-	
-}
-
-PIMAGE_SECTION_HEADER PE::getFirstSection()
-{
-	PIMAGE_SECTION_HEADER Section;
-
-	if(isPE64())
-		Section = IMAGE_FIRST_SECTION64(PEheader);
-	else
-		Section = IMAGE_FIRST_SECTION(PEheader);
-
-	return Section;
+	return (ULONG_PTR) sig;
 }
 
 /* get the sections pointed by entry point, that is,
@@ -192,280 +456,419 @@ PIMAGE_SECTION_HEADER PE::getExecSection()
 	// return it if we already got it.
 	if(EpSection)	return EpSection;
 
-	// get entry point
-	unsigned int EP, NumberOfSections;
-	PIMAGE_SECTION_HEADER Section;
-
-	if(isPE64()) {
-		EP = PEheader64->OptionalHeader.AddressOfEntryPoint;		// get RVA of EP
-		Section = IMAGE_FIRST_SECTION64(PEheader);
-		NumberOfSections = PEheader64->FileHeader.NumberOfSections;
-	}
-	else {
-		EP = PEheader->OptionalHeader.AddressOfEntryPoint;			// get RVA of EP
-		Section = IMAGE_FIRST_SECTION(PEheader);
-		NumberOfSections = PEheader->FileHeader.NumberOfSections;
-	}
-
-	// check which section EP is pointing to
-	for (unsigned int i = 0; i < NumberOfSections; i++, Section++)
-	{
-		if ((EP >= Section->VirtualAddress) && (EP < Section->VirtualAddress+Section->Misc.VirtualSize))
-		{
-			if((strncmp((char *)Section->Name, ".text", IMAGE_SIZEOF_SHORT_NAME) != 0) && \
-				(strncmp((char *)Section->Name, "CODE", IMAGE_SIZEOF_SHORT_NAME) != 0) )
-					Suspicious |= EXEC_SECTION_IS_NOT_TEXT;
+	PIMAGE_SECTION_HEADER Section = getSection(getEntryPoint());
+	if(!Section)	return NULL;
 
-			// check bounds
-			if(Section->PointerToRawData + Section->SizeOfRawData > FileSize)		Suspicious |= SECTION_OUTOFBOUND;
+	if((strncmp((char *)Section->Name, ".text", IMAGE_SIZEOF_SHORT_NAME) != 0) && \
+		(strncmp((char *)Section->Name, "CODE", IMAGE_SIZEOF_SHORT_NAME) != 0) )
+			Suspicious |= EXEC_SECTION_IS_NOT_TEXT;
 
-			EpSection = Section;
-			return Section;
-		}
-	}
+	// check bounds
+	if(getSectionOffset(Section) + getSectionDataSize(Section) > FileSize)		Suspicious |= SECTION_OUTOFBOUND;
 
-	return NULL;
+	EpSection = Section;
+	return Section;
 }
 
 
-/* get the sections that contains the address RVA
+/* get the sections that contains the address RVA.
+ * If sections overlap, the first one in the section table wins, just like walking the table.
  * */
 PIMAGE_SECTION_HEADER PE::getSection(DWORD RVA)
 {
-	unsigned int NumberOfSections;
-	PIMAGE_SECTION_HEADER Section;
-
-	if(isPE64()) {
-		Section = IMAGE_FIRST_SECTION64(PEheader);
-		NumberOfSections = PEheader64->FileHeader.NumberOfSections;
-	}
-	else {
-		Section = IMAGE_FIRST_SECTION(PEheader);
-		NumberOfSections = PEheader64->FileHeader.NumberOfSections;
-	}
-
-	// check which section EP is pointing to
-	for (unsigned int i = 0; i < NumberOfSections; i++, Section++)
-	{
-		if ((RVA >= Section->VirtualAddress) && ( RVA < Section->VirtualAddress + Section->Misc.VirtualSize ))
-			return Section;
+	if(SectionsOverlap) {
+		for (unsigned int i = 0; i < Sections.size(); i++)
+			if ((RVA >= Sections[i]->VirtualAddress) && ( RVA < Sections[i]->VirtualAddress + Sections[i]->Misc.VirtualSize ))
+				return Sections[i];
+		return NULL;
 	}
 
-	return NULL;
-}
-
-// can be used by both 32 and 64 bit executables
-bool PE::isDLL()
-{
-	if(PEheader->FileHeader.Characteristics & IMAGE_FILE_DLL)
-		return true;
-	return false;
-}
-
-bool PE::isPE64()
-{
-	if(PEheader64->OptionalHeader.Magic == 0x20B)	return true;			// 64 bit file
-	return false;
+	const SectionRange* Range = getSectionRange(RVA);
+	return Range ? Range->Header : NULL;
 }
 
-template <class T>		// T: PIMAGE_THUNK_DATA64 or PIMAGE_THUNK_DATA32
-vector<string> PE::getModuleAPIs(T pThunk, PIMAGE_SECTION_HEADER IT)
+/* get the index entry of the section that contains the address RVA
+ * */
+const SectionRange* PE::getSectionRange(DWORD RVA)
 {
-	vector<string> APIs;
+	unsigned int n = SectionIndex.size();
 
-	// check if IMAGE_THUNK_DATA is within the section of Import directory, otherwise, most likely the file is packed or manualy manipulated.
-	if (((DWORD)pThunk < ((DWORD)LoadAddr + IT->PointerToRawData)) || ((DWORD)pThunk >((DWORD)LoadAddr + IT->PointerToRawData + IT->SizeOfRawData))) {
-		Suspicious |= SUSPICIOUS_IMPORTS;
+	if(n <= SECTION_INDEX_LINEAR) {
+		for (unsigned int i = 0; i < n; i++)
+			if ((RVA >= SectionIndex[i].VirtualAddress) && (RVA < SectionIndex[i].VirtualEnd))
+				return &SectionIndex[i];
+		return NULL;
 	}
 
-	// check if IMAGE_THUNK_DATA points out of file boundaries.
-	if (((DWORD)pThunk < ((DWORD)LoadAddr)) || ( ((DWORD)pThunk + sizeof(*pThunk)) > ((DWORD)LoadAddr + FileSize)) ) {
-		Suspicious |= CORRUPTED_IMPORTS;
-		return APIs;
+	// find the last section starting at or before RVA
+	unsigned int lo = 0, hi = n;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (SectionIndex[mid].VirtualAddress <= RVA)	lo = mid + 1;
+		else											hi = mid;
 	}
 
-	ULONGLONG iIMAGE_ORDINAL_FLAG;
-	if(isPE64())
-		iIMAGE_ORDINAL_FLAG = IMAGE_ORDINAL_FLAG64;
-	else
-		iIMAGE_ORDINAL_FLAG = IMAGE_ORDINAL_FLAG32;
-
-	if (pThunk->u1.Ordinal & iIMAGE_ORDINAL_FLAG) {
-		fImportByOrdinal = true;	pThunk->u1.Ordinal &= 0x0000FFFF;
-	}
-		
-	while(pThunk->u1.Ordinal)
-	{
-		string API;
+	if (lo == 0)	return NULL;
 
-		// if import by name
-		if(!(pThunk->u1.Ordinal & iIMAGE_ORDINAL_FLAG)) {
-			// Yup, ApiNameOffset is DWORD, 32bit, for both 32bit and 64bit executables, assuming we've not yet seen an 64bit executable > 4GB.
-			DWORD ApiNameOffset = getOffsetFromRva(pThunk->u1.AddressOfData) + FIELD_OFFSET(IMAGE_IMPORT_BY_NAME, Name);
+	const SectionRange* Range = &SectionIndex[lo - 1];
+	if (RVA < Range->VirtualEnd)	return Range;
 
-			// within file boundaries ?
-			if (ApiNameOffset > FileSize) {
-				Suspicious |= CORRUPTED_IMPORTS;
-			}
-			else {
-				DWORD i = ApiNameOffset;
-				while (i < FileSize && LoadAddr[i] != 0 && (i - ApiNameOffset < MAX_API_NAME)) i++;	// There is no unallowed chars for API name.	
-				/*
-				* There are three cases here:
-				* 
-				* 1- If the size = MAX_API_NAME, Win loader's RtlInitString() will take the first MAX_API_NAME name regardless of the "real" size. That would be the API that will be looked for.
-				* 2- If the Name was shorter that MAX_API_NAME but passes the file size, most likely the memory location at the offset "file size"
-				* will be 0, so the loader will read the zero and terminates the string. 
-				* Unless in very rare condition that the file ends exactly at the boundary of a memory page and accessing next page will fire an exception.
-				* For those two cases, we'll get the string up until the boundary, MAX_API_NAME or FileSize.
-				* 3- The file we're scanning is a good file that respects itself and has a normal API name, which is a case we don't usually encounter when dealing with malware :)
-				*/
-				if ((i >= FileSize) || (i - ApiNameOffset >= MAX_API_NAME))
-					Suspicious |= SUSPICIOUS_IMPORTS;
-				
-				API = string((char*) &LoadAddr[ApiNameOffset], i - ApiNameOffset);
-			}
-		}
-		// else if import by ordinal
-		else {
-			int n = pThunk->u1.Ordinal & 0x00FF;		// get ordinal number
-			API = "Ord(" + numToStr(n) + ")";
-		}
-		
-		APIs.push_back(API);
-		pThunk++;
-	}
+	return NULL;
+}
 
-	return APIs;
+/* Returns the RVA of the thunk array describing the imported names of the module (OriginalFirstThunk).
+ * Some files compiled with Borland compiler have imd->Characteristics = 0, then FirstThunk is used instead.
+ * Why not always use imd->FirstThunk? because microsoft "optimized" some system DLLs so that fields pointed to
+ * by imd->FirstThunk contains absolute addresses rather than pointers.
+ */
+static inline DWORD getNamesThunk(const IMAGE_IMPORT_DESCRIPTOR* imd)
+{
+	if ((signed)imd->Characteristics <= 0 && imd->FirstThunk != 0)
+		return imd->FirstThunk;
+	return imd->Characteristics;
 }
 
-vector<Module> PE::getImports()
+ImportIterator::ImportIterator(PE &Pe) : P(Pe)
 {
-	unsigned int ImportOffset;
-	unsigned int ImportSize;
+	IT					= NULL;
+	imd					= NULL;
+	pThunk				= NULL;
+	ThunkEnd			= NULL;
+	DescEnd				= NULL;
+	CurModule.ptr		= NULL;
+	CurModule.len		= 0;
+	Suspicious			= 0;
+	fImportByOrdinal	= false;
+	Done				= true;
 
-	if(isPE64()) {
-		ImportOffset = PEheader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
-		ImportSize = PEheader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size;
+	// pick the thunk layout once, the walk itself doesn't check the bitness again
+	if(P.isPE64()) {
+		ThunkSize = sizeof(IMAGE_THUNK_DATA64);
+		NextAPI = &ImportIterator::nextAPI<IMAGE_THUNK_DATA64>;
 	}
 	else {
-		ImportOffset = PEheader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
-		ImportSize = PEheader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size;
+		ThunkSize = sizeof(IMAGE_THUNK_DATA32);
+		NextAPI = &ImportIterator::nextAPI<IMAGE_THUNK_DATA32>;
 	}
 
+	init();
+}
+
+// validates the import directory and points to the first descriptor
+void ImportIterator::init()
+{
+	unsigned int ImportOffset = P.Header.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
+	unsigned int ImportSize = P.Header.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size;
+
 	
 	if(ImportOffset == 0 && ImportSize == 0) {
 		Suspicious |= NO_IMPORTS;
-		return Modules;		// no imports
+		return;		// no imports
 	}
 
 	if(ImportOffset == 0 || ImportSize == 0) {
 		Suspicious |= CORRUPTED_IMPORTS;
-		return Modules;		// no imports
+		return;		// no imports
 	}
 
-	if(ImportSize > FileSize) {
+	if(ImportSize > P.FileSize) {
 		Suspicious |= CORRUPTED_IMPORTS;
-		return Modules;		// no imports
+		return;		// no imports
 	}
 
-	PIMAGE_SECTION_HEADER IT;
-	IT = getSection(ImportOffset);
+	IT = P.getSection(ImportOffset);
 
 	
-	if( !IT || (IT->SizeOfRawData < ImportSize) || (IT->PointerToRawData + IT->SizeOfRawData) >  FileSize )	{
+	if( !IT || (P.getSectionDataSize(IT) < ImportSize) || (P.getSectionOffset(IT) + P.getSectionDataSize(IT)) >  P.FileSize )	{
 		Suspicious |= CORRUPTED_IMPORTS;
-		return Modules;
+		return;
 	}
 
-	PIMAGE_IMPORT_DESCRIPTOR  imd = (PIMAGE_IMPORT_DESCRIPTOR)(LoadAddr + getOffsetFromRva(ImportOffset));
+	DWORD DescOffset = P.getOffsetFromRva(ImportOffset);
 	
-	if( ((DWORD)imd < ((DWORD)LoadAddr + IT->PointerToRawData)) || ((DWORD)imd > ((DWORD)LoadAddr + IT->PointerToRawData + IT->SizeOfRawData)) ) {
+	if( (DescOffset < P.getSectionOffset(IT)) || (DescOffset > P.getSectionOffset(IT) + P.getSectionDataSize(IT)) ) {
 		Suspicious |= SUSPICIOUS_IMPORTS;
 	}
 
-	// outside the file boundaries
-	if (((DWORD)imd < ((DWORD)LoadAddr)) || ( ((DWORD)imd + sizeof(IMAGE_IMPORT_DESCRIPTOR)) >((DWORD)LoadAddr + FileSize))) {
+	// outside the file boundaries, or the readable bytes of an image with holes
+	if ((ULONGLONG)DescOffset + sizeof(IMAGE_IMPORT_DESCRIPTOR) > P.getReadableEnd(DescOffset)) {
 		Suspicious |= CORRUPTED_IMPORTS;
-		return Modules;
+		return;
 	}
 
-	// some files compiled with Borland compiler have imd->Characteristics = 0.
-	if ((signed)imd->Characteristics <= 0 && imd->FirstThunk != 0)	imd->Characteristics = imd->FirstThunk;
+	imd = (const IMAGE_IMPORT_DESCRIPTOR*)(P.LoadAddr + DescOffset);
+	DescEnd = P.LoadAddr + P.getReadableEnd(DescOffset);
 
-	if (imd == 0 || imd->Name == 0 || (signed)imd->Characteristics <= 0)
+	if (imd->Name == 0 || (signed)getNamesThunk(imd) <= 0)
 	{
 		Suspicious |= CORRUPTED_IMPORTS;
-		return Modules;
+		return;
 	}
-	
-	// get modules
-	while (imd != 0 && imd->Name != 0 && imd->FirstThunk != 0) {
-		
+
+	Done = false;
+}
+
+// moves to the next descriptor with a valid module name and prepares its thunks
+bool ImportIterator::nextModule(ImportEntry &Entry)
+{
+	while (!Done) {
+		if (imd->Name == 0 || imd->FirstThunk == 0) {
+			Done = true;
+			break;
+		}
+
+		const IMAGE_IMPORT_DESCRIPTOR* Desc = imd;
+
+		imd++;
+		if ((LPBYTE)(imd + 1) >= DescEnd)
+			Done = true;
+
 		// within section ?
-		if( (imd->Name < IT->VirtualAddress) || (imd->Name > (IT->VirtualAddress + IT->SizeOfRawData)) ) {
+		if( (Desc->Name < IT->VirtualAddress) || (Desc->Name > (IT->VirtualAddress + P.getSectionDataSize(IT))) ) {
 			Suspicious |= SUSPICIOUS_IMPORTS;
 		}
 
-		DWORD ModuleNameOffset = getOffsetFromRva(imd->Name);
-		Module mod;
+		DWORD ModuleNameOffset = P.getOffsetFromRva(Desc->Name);
+		DWORD NameLen = 0;
 
 		// within file boundaries ?
-		if (ModuleNameOffset >= FileSize) {
+		if (ModuleNameOffset >= P.FileSize) {
 			Suspicious |= CORRUPTED_IMPORTS;
 		}
 		else {
 			// check that name ends within region 
 			DWORD i = ModuleNameOffset;
+			DWORD NameEnd = P.getReadableEnd(ModuleNameOffset);
 			/*	Tip: why not just checking for zero at the end of string? Because if the last non null char of the string was the last byte in the file.
 				windows loader will consider the name valid and load the module. Check fbd90df9cc16cc5b2b24271dfb5bb9e7aad950ccd72c154804b286ebc5b8e21d as example
 			*/
-			while (i < FileSize && LoadAddr[i] != 0 && (i - ModuleNameOffset < MAX_API_NAME)) i++;
-			if ((i >= FileSize) || (i - ModuleNameOffset >= MAX_PATH))
+			while (i < NameEnd && P.LoadAddr[i] != 0 && (i - ModuleNameOffset < MAX_API_NAME)) i++;
+			if ((i >= NameEnd) || (i - ModuleNameOffset >= MAX_PATH))
 				Suspicious |= SUSPICIOUS_IMPORTS;
 
 			else {
-				mod.name = string((char*)&LoadAddr[ModuleNameOffset], i - ModuleNameOffset);
-				if (!isValidPath(mod.name))		mod.name = "";
+				NameLen = i - ModuleNameOffset;
+				NameCheck.assign((char*)&P.LoadAddr[ModuleNameOffset], NameLen);
+				if (!isValidPath(NameCheck))		NameLen = 0;
 			}
 		}
 		// end name checking
 
-		vector<string> APIs;
 		// check if valid length
-		if(mod.name.length() == 0) {
+		if(NameLen == 0) {
 			Suspicious |= CORRUPTED_IMPORTS;
+			continue;
 		}
-		else {			
-			// get APIs inside each module
-			if(isPE64()) {
-				PIMAGE_THUNK_DATA64 pThunk = (PIMAGE_THUNK_DATA64) (LoadAddr + getOffsetFromRva(imd->Characteristics));
-				APIs = getModuleAPIs(pThunk, IT);
-			}
-			else {
-				PIMAGE_THUNK_DATA32 pThunk = (PIMAGE_THUNK_DATA32) (LoadAddr + getOffsetFromRva(imd->Characteristics));
-				APIs = getModuleAPIs(pThunk, IT);
-			}
-			mod.APIs = APIs;
-			Modules.push_back(mod);
-		}		
-		
-		imd++;
 
-		if ((DWORD)imd + sizeof(*imd) >= (DWORD)LoadAddr + FileSize)
-			break;
+		CurModule.ptr = (const char*)&P.LoadAddr[ModuleNameOffset];
+		CurModule.len = NameLen;
+
+		// get APIs inside the module
+		DWORD ThunkOffset = P.getOffsetFromRva(getNamesThunk(Desc));
+
+		// check if IMAGE_THUNK_DATA is within the section of Import directory, otherwise, most likely the file is packed or manualy manipulated.
+		if ((ThunkOffset < P.getSectionOffset(IT)) || (ThunkOffset > P.getSectionOffset(IT) + P.getSectionDataSize(IT))) {
+			Suspicious |= SUSPICIOUS_IMPORTS;
+		}
+
+		// check if IMAGE_THUNK_DATA points out of file boundaries, or of the readable bytes of an image with holes.
+		if ((ULONGLONG)ThunkOffset + ThunkSize > P.getReadableEnd(ThunkOffset)) {
+			Suspicious |= CORRUPTED_IMPORTS;
+			pThunk = NULL;
+		}
+		else {
+			pThunk = P.LoadAddr + ThunkOffset;
+			ThunkEnd = P.LoadAddr + P.getReadableEnd(ThunkOffset);
+		}
+
+		Entry.Type		= IMPORT_MODULE;
+		Entry.Module	= CurModule;
+		Entry.API.ptr	= NULL;
+		Entry.API.len	= 0;
+		Entry.ByOrdinal	= false;
+		Entry.Ordinal	= 0;
+		return true;
+	}
+
+	return false;
+}
+
+template <class T>		// T: IMAGE_THUNK_DATA64 or IMAGE_THUNK_DATA32
+bool ImportIterator::nextAPI(ImportEntry &Entry)
+{
+	// the ordinal flag is the top bit of the thunk
+	const ULONGLONG OrdinalFlag = (ULONGLONG)1 << (sizeof(T) * 8 - 1);
+	ULONGLONG Thunk = ((const T*)pThunk)->u1.Ordinal;
+
+	if (!Thunk) {
+		pThunk = NULL;
+		return false;
+	}
+
+	Entry.Type		= IMPORT_API;
+	Entry.Module	= CurModule;
+	Entry.API.ptr	= NULL;
+	Entry.API.len	= 0;
+	Entry.ByOrdinal	= false;
+	Entry.Ordinal	= 0;
+
+	// if import by name
+	if(!(Thunk & OrdinalFlag)) {
+		// Yup, ApiNameOffset is DWORD, 32bit, for both 32bit and 64bit executables, assuming we've not yet seen an 64bit executable > 4GB.
+		DWORD ApiNameOffset = P.getOffsetFromRva((DWORD)Thunk) + FIELD_OFFSET(IMAGE_IMPORT_BY_NAME, Name);
+
+		// within file boundaries ?
+		if (ApiNameOffset > P.FileSize) {
+			Suspicious |= CORRUPTED_IMPORTS;
+		}
+		else {
+			DWORD i = ApiNameOffset;
+			DWORD NameEnd = P.getReadableEnd(ApiNameOffset);
+			while (i < NameEnd && P.LoadAddr[i] != 0 && (i - ApiNameOffset < MAX_API_NAME)) i++;	// There is no unallowed chars for API name.	
+			/*
+			* There are three cases here:
+			* 
+			* 1- If the size = MAX_API_NAME, Win loader's RtlInitString() will take the first MAX_API_NAME name regardless of the "real" size. That would be the API that will be looked for.
+			* 2- If the Name was shorter that MAX_API_NAME but passes the file size, most likely the memory location at the offset "file size"
+			* will be 0, so the loader will read the zero and terminates the string. 
+			* Unless in very rare condition that the file ends exactly at the boundary of a memory page and accessing next page will fire an exception.
+			* For those two cases, we'll get the string up until the boundary, MAX_API_NAME or FileSize.
+			* 3- The file we're scanning is a good file that respects itself and has a normal API name, which is a case we don't usually encounter when dealing with malware :)
+			*/
+			if ((i >= NameEnd) || (i - ApiNameOffset >= MAX_API_NAME))
+				Suspicious |= SUSPICIOUS_IMPORTS;
+			
+			Entry.API.ptr = (const char*)&P.LoadAddr[ApiNameOffset];
+			Entry.API.len = i - ApiNameOffset;
+		}
+	}
+	// else if import by ordinal
+	else {
+		fImportByOrdinal = true;
+		Entry.ByOrdinal = true;
+		Entry.Ordinal = (WORD)(Thunk & 0xFFFF);
+	}
+
+	pThunk += sizeof(T);
+
+	// the thunk array runs off the end of the file, or of its readable bytes, without a terminating null thunk
+	if (pThunk + sizeof(T) > ThunkEnd) {
+		Suspicious |= CORRUPTED_IMPORTS;
+		pThunk = NULL;
+	}
+
+	return true;
+}
+
+bool ImportIterator::next(ImportEntry &Entry)
+{
+	if (pThunk && (this->*NextAPI)(Entry))
+		return true;
+
+	return nextModule(Entry);
+}
+
+void ImpHash::updateLower(const char* s, DWORD len)
+{
+	char Buf[64];
+
+	while (len) {
+		DWORD n = min(len, (DWORD)sizeof(Buf));
+		for (DWORD i = 0; i < n; i++)
+			Buf[i] = (char)tolower((unsigned char)s[i]);
+		Ctx.update(Buf, n);
+		s += n;
+		len -= n;
+	}
+}
+
+/* Same normalization as pefile's get_imphash(): the module extension is dropped if it's dll, ocx or sys,
+ * APIs without a name are skipped, and ordinals are written as "ordN" (no ordinal to name tables here).
+ */
+void ImpHash::update(const ImportEntry &Entry)
+{
+	if (Entry.Type != IMPORT_API)					return;
+	if (!Entry.ByOrdinal && Entry.API.len == 0)		return;
+
+	DWORD ModLen = Entry.Module.len;
+	if (ModLen > 4 && Entry.Module.ptr[ModLen - 4] == '.') {
+		const char* Ext = Entry.Module.ptr + ModLen - 3;
+		char e[3] = { (char)tolower((unsigned char)Ext[0]), (char)tolower((unsigned char)Ext[1]), (char)tolower((unsigned char)Ext[2]) };
+		if (!strncmp(e, "dll", 3) || !strncmp(e, "ocx", 3) || !strncmp(e, "sys", 3))
+			ModLen -= 4;
+	}
+
+	if (!First)	Ctx.update(",", 1);
+	First = false;
 
-		// some files compiled with Borland compiler have imd->Characteristics = 0. But in all PEs if FirstThunk = 0, that means the end of imports
-		// so why not I use imd->FirstThunk instead of imd->Characteristics?, because microsoft "optimized" some system DLLs so that fields pointed to by imd->FirstThunk
-		// contains absolute addresses rather than pointers.
-		if ((signed)imd->Characteristics <= 0 && imd->FirstThunk != 0)	
-			imd->Characteristics = imd->FirstThunk; 
+	updateLower(Entry.Module.ptr, ModLen);
+	Ctx.update(".", 1);
 
+	if (Entry.ByOrdinal) {
+		char Ord[16];
+		int n = sprintf(Ord, "ord%u", (unsigned)Entry.Ordinal);
+		Ctx.update(Ord, n);
 	}
+	else
+		updateLower(Entry.API.ptr, Entry.API.len);
+}
+
+/* Parses the import directory into Modules. The file buffer is only read, so the same buffer can be parsed
+ * by several PE objects at once. The result is cached, calling it again returns the same modules.
+ * Use ImportIterator directly to walk the imports without copying the names.
+ */
+const vector<Module>& PE::getImports()
+{
+	if(DoneImportScaning)	return Modules;
+
+	Modules.clear();
+
+	ImportIterator Imports(*this);
+	ImportEntry Entry;
+
+	while(Imports.next(Entry))
+	{
+		if(Entry.Type == IMPORT_MODULE) {
+			Modules.push_back(Module());
+			Modules.back().name.assign(Entry.Module.ptr, Entry.Module.len);
+		}
+		else if(Entry.ByOrdinal) {
+			char API[16];
+			sprintf(API, "Ord(%u)", (unsigned)(Entry.Ordinal & 0x00FF));
+			Modules.back().APIs.push_back(API);
+		}
+		else
+			Modules.back().APIs.push_back(string(Entry.API.ptr, Entry.API.len));
+	}
+
+	Suspicious |= Imports.Suspicious;
+	fImportByOrdinal = Imports.fImportByOrdinal;
+	DoneImportScaning = true;
 	
 	return Modules;
 }
 
+/* Computes the imphash of the file in a single walk over the imports, without allocating.
+ * Returns false if the file has no imports to hash.
+ */
+bool PE::getImpHash(BYTE Digest[MD5_DIGEST_SIZE])
+{
+	ImportIterator Imports(*this);
+	ImportEntry Entry;
+	ImpHash Hash;
+	bool Found = false;
+
+	while(Imports.next(Entry)) {
+		if(Entry.Type == IMPORT_API)	Found = true;
+		Hash.update(Entry);
+	}
+
+	Suspicious |= Imports.Suspicious;
+	Hash.final(Digest);
+
+	return Found;
+}
+
 bool PE::isImportByOrdinal()
 {
 	if(!DoneImportScaning)
@@ -473,41 +876,21 @@ bool PE::isImportByOrdinal()
 	return fImportByOrdinal;
 }
 
-vector<PIMAGE_SECTION_HEADER> PE::getSections()
+/* returns the sections in the section table order.
+ * The table is read once when the file is loaded, this only sets the suspicious flags on the first call.
+ * */
+const vector<PIMAGE_SECTION_HEADER>& PE::getSections()
 {
 	if(DoneSectionParsing)	return Sections;
 
-	// get entry point
-	unsigned int EP, NumberOfSections;
-	PIMAGE_SECTION_HEADER Section;
-
-	if(isPE64()) {
-		EP = PEheader64->OptionalHeader.AddressOfEntryPoint;		// get RVA of EP
-		Section = IMAGE_FIRST_SECTION64(PEheader);
-		NumberOfSections = PEheader64->FileHeader.NumberOfSections;
-	}
-	else {
-		EP = PEheader->OptionalHeader.AddressOfEntryPoint;			// get RVA of EP
-		Section = IMAGE_FIRST_SECTION(PEheader);
-		NumberOfSections = PEheader->FileHeader.NumberOfSections;
-	}
-
-	for (unsigned int i = 0; i < NumberOfSections; i++, Section++)
-	{		
-		Sections.push_back(Section);
+	for (unsigned int i = 0; i < Sections.size(); i++)
+	{
 		// check bounds
-		if (Section->PointerToRawData + Section->SizeOfRawData > FileSize)	Suspicious |= SECTION_OUTOFBOUND;
-
-		// if it's EP section
-		if ((EP >= Section->VirtualAddress) && (EP < Section->VirtualAddress+Section->Misc.VirtualSize))
-		{
-			if((strncmp((char *)Section->Name, ".text", IMAGE_SIZEOF_SHORT_NAME) != 0) && \
-				(strncmp((char *)Section->Name, "CODE", IMAGE_SIZEOF_SHORT_NAME) != 0) )
-					Suspicious |= EXEC_SECTION_IS_NOT_TEXT;
-				
-			EpSection = Section;
-		}
+		if (getSectionOffset(Sections[i]) + getSectionDataSize(Sections[i]) > FileSize)	Suspicious |= SECTION_OUTOFBOUND;
 	}
+
+	// if it's EP section
+	getExecSection();
 	
 	DoneSectionParsing = true;
 	return Sections;
@@ -515,52 +898,200 @@ vector<PIMAGE_SECTION_HEADER> PE::getSections()
 
 // ##### File's derived information #############
 
-float getEntropy(LPVOID Mem, INT Size)
+float PE::getFileEntropy()
 {
-	if(Size == 0)	return -1;
-
-	UINT SymbolsCount[256];
-	float Entropy = 0;
-
-	for(int i = 0; i < 256; i++)
-		SymbolsCount[i] = 0;
+	if(!LoadAddr || FileSize == 0)	return -1;
 
-	for(int i = 0; i < Size; i++) 
-		SymbolsCount[ *((BYTE*)((UINT)Mem+i)) ]++;
-	
-	float p;
-	for(int i = 0; i < 256; i++) {
-		p = ((float)SymbolsCount[i] / (float)Size);
-		if(p > 0.0)	
-			Entropy = Entropy - p * (float) (log(p) / log(2));
-	}
+	DWORD SymbolsCount[256];
+	memset(SymbolsCount, 0, sizeof(SymbolsCount));
+	DWORD Counted = readableHistogram(0, FileSize, SymbolsCount);
 
-	return Entropy;
+	return histogramEntropy(SymbolsCount, Counted);
 }
 
-float PE::getFileEntropy()
+/* The overlay is what the loader doesn't map: everything after the headers and the raw data of the section that ends last
+ * in the file. Sections with no raw data don't count. Every section header is looked at, also those SectionIndex leaves
+ * out for their VirtualSize of 0: the loader still maps their SizeOfRawData.
+ * */
+bool PE::getOverlay(DWORD &Offset, DWORD &Size)
 {
-	if(!LoadAddr)	return -1;
+	Offset = min(Header.SizeOfHeaders, FileSize);
+	Size = 0;
+	if(!LoadAddr)	return false;
+
+	// the loader maps no overlay
+	if(Mapped) {
+		Offset = FileSize;
+		return false;
+	}
+
+	for(unsigned int i = 0; i < Sections.size(); i++) {
+		DWORD RawStart = min(getSectionOffset(Sections[i]), FileSize);
+		DWORD RawEnd = (getSectionDataSize(Sections[i]) > FileSize - RawStart) ? FileSize : RawStart + getSectionDataSize(Sections[i]);
+		if(RawEnd > RawStart)
+			Offset = max(Offset, RawEnd);
+	}
 
-	return getEntropy(LoadAddr, FileSize);
+	Size = FileSize - Offset;
+	return Size != 0;
 }
 
 float PE::getSectionEntropy(PIMAGE_SECTION_HEADER Section)
 {
 	if(!LoadAddr || !Section)	return -1;
 
-	LPVOID Addr = 0;
+	DWORD Offset = getSectionOffset(Section);
+	DWORD Size = getSectionDataSize(Section);
 
-	if( (Section->PointerToRawData > FileSize)	|| 
-		(Section->SizeOfRawData > FileSize)		|| 
-		(Section->PointerToRawData + Section->SizeOfRawData > FileSize)) {
+	if( (Offset > FileSize)	|| 
+		(Size > FileSize)		|| 
+		(Offset + Size > FileSize)) {
 			Suspicious |= SECTION_OUTOFBOUND;
 			return -2;
 	}
 
-	Addr = LoadAddr + Section->PointerToRawData;
-	DWORD Size = Section->SizeOfRawData;
 	if(Size == 0)	return -3;
 
-	return getEntropy(Addr, Size);
+	// only the bytes of the region map in an image with holes
+	DWORD SymbolsCount[256];
+	memset(SymbolsCount, 0, sizeof(SymbolsCount));
+	DWORD Counted = readableHistogram(Offset, Size, SymbolsCount);
+
+	return histogramEntropy(SymbolsCount, Counted);
+}
+
+/* Computes the entropy of the file, of every section, and of a window sliding over the file, in one pass over the file.
+ * The file is histogrammed in blocks of WindowStep bytes: the window is the sum of its last WindowSize / WindowStep blocks,
+ * and the running histogram is saved at every section boundary so a section is the difference of two of them.
+ * Only full windows are reported, a file smaller than WindowSize has no windows.
+ */
+bool PE::getEntropyProfile(EntropyProfile &Profile, DWORD WindowSize, DWORD WindowStep)
+{
+	if(!LoadAddr || Readable.size())	return false;
+
+	if(WindowStep == 0 || WindowStep > ENTROPY_MAX_WINDOW)	WindowStep = ENTROPY_WINDOW_STEP;
+	WindowSize = roundUp(max(WindowSize, WindowStep), WindowStep);
+	if(WindowSize > ENTROPY_MAX_WINDOW)		WindowSize = roundDown((DWORD)ENTROPY_MAX_WINDOW, WindowStep);
+
+	Profile.WindowSize = WindowSize;
+	Profile.WindowStep = WindowStep;
+	Profile.Windows.clear();
+	Profile.SectionEntropy.clear();
+
+	// section boundaries where the running histogram is saved. Invalid sections get the errors of getSectionEntropy().
+	const vector<PIMAGE_SECTION_HEADER>& Secs = getSections();
+	vector<DWORD> Cuts;
+	Profile.SectionEntropy.resize(Secs.size(), 0);
+
+	for(unsigned int i = 0; i < Secs.size(); i++) {
+		DWORD Offset = getSectionOffset(Secs[i]);
+		DWORD Size = getSectionDataSize(Secs[i]);
+
+		if( (Offset > FileSize)	|| 
+			(Size > FileSize)		|| 
+			(Offset + Size > FileSize)) {
+				Suspicious |= SECTION_OUTOFBOUND;
+				Profile.SectionEntropy[i] = -2;
+		}
+		else if(Size == 0)
+			Profile.SectionEntropy[i] = -3;
+		else {
+			Cuts.push_back(Offset);
+			Cuts.push_back(Offset + Size);
+		}
+	}
+
+	sort(Cuts.begin(), Cuts.end());
+	Cuts.erase(unique(Cuts.begin(), Cuts.end()), Cuts.end());
+
+	// too many sections to keep a histogram per boundary, they are scanned one by one at the end
+	bool SeparateSections = (Cuts.size() > ENTROPY_MAX_CUTS);
+	if(SeparateSections)	Cuts.clear();
+
+	vector<DWORD> Snapshots(Cuts.size() * 256);
+	size_t NextCut = 0;
+
+	DWORD Prefix[256], Block[256], Window[256];
+	memset(Prefix, 0, sizeof(Prefix));
+	memset(Window, 0, sizeof(Window));
+
+	unsigned int RingSlots = WindowSize / WindowStep;
+	unsigned int RingPos = 0, BlocksInWindow = 0;
+	vector<DWORD> Ring(RingSlots * 256);
+
+	Profile.Windows.reserve(FileSize / WindowStep);
+
+	for(DWORD b = 0; b < FileSize; b += WindowStep)
+	{
+		DWORD e = b + min(WindowStep, FileSize - b);
+		DWORD p = b;
+		memset(Block, 0, sizeof(Block));
+
+		for(;;) {
+			// save the running histogram at every boundary reached
+			while(NextCut < Cuts.size() && Cuts[NextCut] == p) {
+				DWORD* Snap = &Snapshots[NextCut * 256];
+				for(int s = 0; s < 256; s++)
+					Snap[s] = Prefix[s] + Block[s];
+				NextCut++;
+			}
+
+			if(p >= e)	break;
+
+			DWORD q = e;
+			if(NextCut < Cuts.size() && Cuts[NextCut] < q)
+				q = Cuts[NextCut];
+
+			byteHistogram(LoadAddr + p, q - p, Block);
+			p = q;
+		}
+
+		for(int s = 0; s < 256; s++)
+			Prefix[s] += Block[s];
+
+		// slide the window by one block
+		DWORD* Slot = &Ring[RingPos * 256];
+		if(BlocksInWindow == RingSlots) {
+			for(int s = 0; s < 256; s++)
+				Window[s] -= Slot[s];
+		}
+		else BlocksInWindow++;
+
+		for(int s = 0; s < 256; s++) {
+			Slot[s] = Block[s];
+			Window[s] += Block[s];
+		}
+		RingPos = (RingPos + 1) % RingSlots;
+
+		if(BlocksInWindow == RingSlots && e - b == WindowStep)
+			Profile.Windows.push_back(histogramEntropy(Window, WindowSize));
+	}
+
+	// boundaries at the end of the file
+	for(; NextCut < Cuts.size(); NextCut++)
+		memcpy(&Snapshots[NextCut * 256], Prefix, sizeof(Prefix));
+
+	Profile.FileEntropy = (FileSize == 0) ? -1 : histogramEntropy(Prefix, FileSize);
+
+	for(unsigned int i = 0; i < Secs.size(); i++) {
+		if(Profile.SectionEntropy[i] < 0)	continue;
+
+		if(SeparateSections) {
+			Profile.SectionEntropy[i] = getSectionEntropy(Secs[i]);
+			continue;
+		}
+
+		DWORD Start = getSectionOffset(Secs[i]);
+		DWORD End = Start + getSectionDataSize(Secs[i]);
+		const DWORD* First = &Snapshots[(lower_bound(Cuts.begin(), Cuts.end(), Start) - Cuts.begin()) * 256];
+		const DWORD* Last = &Snapshots[(lower_bound(Cuts.begin(), Cuts.end(), End) - Cuts.begin()) * 256];
+
+		DWORD Counts[256];
+		for(int s = 0; s < 256; s++)
+			Counts[s] = Last[s] - First[s];
+
+		Profile.SectionEntropy[i] = histogramEntropy(Counts, End - Start);
+	}
+
+	return true;
 }
@@ -18,6 +18,8 @@
 #define SECTION_OUTOFBOUND			0X08			// Section size passes file size
 #define SUSPICIOUS_IMPORTS			0X10			// if import is valid and not corrupted but exist in unusual place, such as outside the section of import directory.
 
+#define STREAM_CHUNK				0x100000		// first buffer size of loadStream(), it doubles as the data comes
+
 #define MAX_USHORT					((USHORT)-1)
 // max number of characters in API name, excluding terminating NULL (That's 0xFFFE 65,534 .. a limit by RtlInitString, Thank you Peter Ferrie!.)
 #define MAX_API_NAME				MAX_USHORT-1
@@ -30,6 +32,8 @@
 #else
 	#include "Typedef.h"
 #endif
+#include "Hash.h"
+#include "Entropy.h"
 
 using namespace std;
 typedef vector<pair<string, vector<string> > >	ArrStrArr;		// Array of strings to arrays
@@ -42,17 +46,137 @@ typedef struct
 		vector<string>		APIs;
 	} Module;
 
-class PE
+// A view into the loaded file, it's not null terminated and it's valid as long as the file is loaded.
+typedef struct
+	{
+		const char*			ptr;
+		DWORD				len;
+	} StrView;
+
+// Type of entries returned by ImportIterator
+#define IMPORT_MODULE				0				// start of a new module, only Module is set
+#define IMPORT_API					1				// an API imported from the last module
+
+typedef struct
+	{
+		int					Type;
+		StrView				Module;
+		StrView				API;					// empty if imported by ordinal, or the name is corrupted
+		bool				ByOrdinal;
+		WORD				Ordinal;
+	} ImportEntry;
+
+// An entry of the section index. Sections are sorted by VirtualAddress so RVA lookups can binary search them.
+typedef struct
+	{
+		DWORD					VirtualAddress;
+		DWORD					VirtualEnd;			// VirtualAddress + VirtualSize
+		DWORD					RawStart;			// PointerToRawData, clamped to the file size
+		DWORD					RawEnd;				// PointerToRawData + SizeOfRawData, clamped to the file size
+		PIMAGE_SECTION_HEADER	Header;
+	} SectionRange;
+
+/* The parts of the PE header used by the parser and the scanner, read once when the file is loaded.
+ * It's the same for PE32 and PE32+ files, so accessors don't need to check the bitness again.
+ */
+typedef struct
+	{
+		bool					Is64;
+		WORD					Machine;
+		WORD					Characteristics;
+		WORD					NumberOfSections;
+		DWORD					EntryPoint;				// RVA of the entry point
+		ULONGLONG				ImageBase;
+		DWORD					SectionAlignment;
+		DWORD					FileAlignment;
+		DWORD					SizeOfImage;
+		DWORD					SizeOfHeaders;
+		DWORD					NumberOfRvaAndSizes;
+		IMAGE_DATA_DIRECTORY	DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+		PIMAGE_SECTION_HEADER	FirstSection;
+	} PEHeaderInfo;
+
+#define SECTION_INDEX_LINEAR		4				// up to this number of sections, a linear walk is faster than binary search
+
+class PE;
+
+/* Walks the import directory without copying anything out of the file, every name is a view into the loaded buffer.
+ * Modules are returned as an IMPORT_MODULE entry followed by an IMPORT_API entry for each of its APIs.
+ * Flags found while walking are collected in Suspicious/fImportByOrdinal, the PE object itself is not touched
+ * so several iterators can walk the same file at once.
+ */
+class ImportIterator
 {
 private:
-	template <class T>		// T: PIMAGE_THUNK_DATA64 or PIMAGE_THUNK_DATA32
-	vector<string> getModuleAPIs(T pThunk, PIMAGE_SECTION_HEADER IT);
+	PE&						P;
+	PIMAGE_SECTION_HEADER	IT;						// section of the import directory
+	const IMAGE_IMPORT_DESCRIPTOR* imd;				// current descriptor
+	LPBYTE					pThunk;					// next thunk of the current module, NULL if not inside a module
+	LPBYTE					ThunkEnd;				// end of the readable bytes holding the thunks
+	LPBYTE					DescEnd;				// end of the readable bytes holding the descriptors
+	DWORD					ThunkSize;
+	bool					(ImportIterator::*NextAPI)(ImportEntry &Entry);		// nextAPI() for the thunk layout of the file
+	StrView					CurModule;
+	string					NameCheck;				// reused buffer for path validation of module names
+	bool					Done;
 
+	void init();
+	bool nextModule(ImportEntry &Entry);
+
+	template <class T>		// T: IMAGE_THUNK_DATA64 or IMAGE_THUNK_DATA32
+	bool nextAPI(ImportEntry &Entry);
+
+public:
+	char					Suspicious;
+	bool					fImportByOrdinal;
+
+	ImportIterator(PE &P);
+
+	// fills Entry with the next import, returns false at the end of imports.
+	bool next(ImportEntry &Entry);
+};
+
+// imphash (MD5 of "module.api" pairs in lower case, separated by commas) computed incrementally from ImportIterator entries.
+class ImpHash
+{
+private:
+	MD5						Ctx;
+	bool					First;
+
+	void updateLower(const char* s, DWORD len);
+
+public:
+	ImpHash()	{ First = true; }
+
+	void update(const ImportEntry &Entry);
+	void final(BYTE Digest[MD5_DIGEST_SIZE])		{ Ctx.final(Digest); First = true; }
+};
+
+class PE
+{
+	friend class ImportIterator;
+
+private:
 	//==== cached elements. Used to avoid recalculating parts of the PE ===//
 	PIMAGE_SECTION_HEADER	EpSection;
+	vector<SectionRange>	SectionIndex;			// sections sorted by VirtualAddress, built once when the file is loaded
+	bool					SectionsOverlap;		// set if two sections share virtual addresses, lookups then follow the section table order
+
+	bool				OwnsBuffer;				// LoadAddr was allocated by loadFile(), not given to loadBuffer()
+	bool				Mapped;					// loaded by loadImage(), offsets are RVAs
+	vector<pair<DWORD, DWORD> >	Readable;		// loadImage() region map, sorted and merged. Empty if all of the buffer is readable
 
 	void init();
 
+	void reset();
+
+	LPVOID parsePE();
+
+	template <class T>		// T: IMAGE_NT_HEADERS64 or IMAGE_NT_HEADERS32
+	bool parseHeader();
+
+	void buildSectionIndex();
+
 	DWORD getOffsetFromRva(DWORD rva);
 
 public:
@@ -60,14 +184,16 @@ public:
 	ifstream			FileHandle;
 	LPBYTE				LoadAddr;				// address of where the file loaded in memory now
 	DWORD				FileSize;
+	bool				OutOfMemory;			// set by loadStream() if the buffer could not grow to the size of the file
 
 												// so other functions use it directly without loading it.
-	PIMAGE_NT_HEADERS	PEheader;
+	PIMAGE_NT_HEADERS32	PEheader;
 	PIMAGE_NT_HEADERS64	PEheader64;
+	PEHeaderInfo		Header;					// header fields parsed once at load time, use it rather than PEheader/PEheader64
 	char 				Suspicious;				// group of flags set if any suspicious sysmptoms noticed in PE structure
 	bool				fImportByOrdinal;		// flag is set if the file does any import by ordinal
 	vector<Module>		Modules;				// an array that holds imported modules structs
-	vector<PIMAGE_SECTION_HEADER> Sections;		// an array that contains sections info
+	vector<PIMAGE_SECTION_HEADER> Sections;		// an array that contains sections info, in section table order
 	bool				DoneImportScaning;		// set if import scanning is done
 	bool				DoneSectionParsing;		// set if section parsing is done
 
@@ -79,6 +205,24 @@ public:
 	LPVOID loadPE()		{ return loadPE(FileName); }
 	LPVOID loadPE(char* FileName);
 
+	LPVOID loadBuffer(const BYTE* Buffer, DWORD Size);
+
+	/* Uses an image as the loader maps it, e.g. a loaded module or a process memory dump, starting at the image base:
+	 * offsets in the buffer are RVAs and sections are at their VirtualAddress. Readable is the region map, the ranges
+	 * [first, second) of the buffer that could be read, nothing outside them is parsed or matched. NULL if all of it was.
+	 * The buffer is only read, like by loadBuffer().
+	 */
+	LPVOID loadImage(const BYTE* Buffer, DWORD Size, const vector<pair<DWORD, DWORD> >* Readable = NULL);
+
+	// an image dumped to a file, read like loadPE() reads a file
+	LPVOID loadImage(char* FileName);
+
+	/* Reads the file from In, e.g. stdin or a pipe, rather than opening it: Size bytes, or up to the end of In if Size is
+	 * (DWORD)-1. In is never seeked, the buffer grows as the data comes. NULL if In ends early or it's not a PE file.
+	 * If the buffer can't grow, OutOfMemory is set and the rest of the Size bytes is skipped, NULL as well.
+	 */
+	LPVOID loadStream(istream &In, DWORD Size = (DWORD)-1);
+
 	LPVOID loadFile()		{ return loadPE(FileName); }
 	LPVOID loadFile(char* FileName);
 
@@ -86,36 +230,72 @@ public:
 
 	void unloadPE();
 
-	DWORD getPEoffset();
+	ULONG_PTR getPEoffset();
 
-	DWORD getEntryPoint();
+	inline DWORD getEntryPoint()						{ return Header.EntryPoint; }
 
-	PIMAGE_SECTION_HEADER getFirstSection();
+	inline PIMAGE_SECTION_HEADER getFirstSection()		{ return Header.FirstSection; }
 
 	PIMAGE_SECTION_HEADER getExecSection();
 
 	PIMAGE_SECTION_HEADER getSection(DWORD RVA);
 
-	vector<PIMAGE_SECTION_HEADER> getSections();
+	const SectionRange* getSectionRange(DWORD RVA);
 
-	vector<Module> getImports();
+	const vector<PIMAGE_SECTION_HEADER>& getSections();
+
+	const vector<Module>& getImports();
+
+	bool getImpHash(BYTE Digest[MD5_DIGEST_SIZE]);
 
 	//-------- checks (boolean functions) -----------
 
 	bool isPE(LPVOID FileHandle);
 
-	bool isDLL();
+	inline bool isDLL()			{ return (Header.Characteristics & IMAGE_FILE_DLL) != 0; }		// can be used by both 32 and 64 bit executables
 
-	bool isPE64();
+	inline bool isPE64()		{ return Header.Is64; }
+
+	inline bool isMapped()		{ return Mapped; }
 
 	bool isImportByOrdinal();
 
+	//-------- layout ------------
+
+	// where the data of Section is in the loaded buffer: its raw data in a file, its virtual range in a mapped image. Not clamped to the buffer
+	inline DWORD getSectionOffset(PIMAGE_SECTION_HEADER Section) {
+		return Mapped ? Section->VirtualAddress : Section->PointerToRawData;
+	}
+
+	inline DWORD getSectionDataSize(PIMAGE_SECTION_HEADER Section) {
+		if(!Mapped)		return Section->SizeOfRawData;
+		return Section->Misc.VirtualSize ? Section->Misc.VirtualSize : Section->SizeOfRawData;
+	}
+
+	// the region map of loadImage(), empty if all of the buffer is readable
+	inline const vector<pair<DWORD, DWORD> >& getReadable()	{ return Readable; }
+
+	// end of the readable bytes from Offset on, Offset if it's not readable. FileSize if there's no region map
+	DWORD getReadableEnd(DWORD Offset);
+
+	// first readable offset at or after Offset, FileSize if there is none. Offset if there's no region map
+	DWORD getReadableStart(DWORD Offset);
+
+	// adds the counts of the readable bytes of [Offset, Offset + Size) to Counts, returns how many bytes were counted
+	DWORD readableHistogram(DWORD Offset, DWORD Size, DWORD Counts[256]);
+
 	//-------- extras ------------
 
 	float getFileEntropy();
 
+	// Offset gets the end of the raw data of the last section, Size the bytes appended after it. false if there are none
+	bool getOverlay(DWORD &Offset, DWORD &Size);
+
 	float getSectionEntropy(PIMAGE_SECTION_HEADER Section);
 
+	// false for an image with a region map, its windows would cross the holes
+	bool getEntropyProfile(EntropyProfile &Profile, DWORD WindowSize = ENTROPY_WINDOW_SIZE, DWORD WindowStep = ENTROPY_WINDOW_STEP);
+
 	inline DWORD getSectionExactSize(PIMAGE_SECTION_HEADER Section)
 	{
 		if(Section->SizeOfRawData > Section->Misc.VirtualSize)
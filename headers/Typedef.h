@@ -65,8 +65,8 @@ typedef void VOID;
 
 typedef char CHAR;
 typedef short SHORT;
-typedef long LONG;
-typedef unsigned long       DWORD;
+typedef int32_t LONG;						// 32 bits as on Windows, long is 64 bits on LP64
+typedef uint32_t            DWORD;
 typedef int                 BOOL;
 typedef unsigned char       BYTE;
 typedef BYTE				BOOLEAN;
@@ -100,13 +100,13 @@ typedef uint64_t ULONGLONG;
 #if defined(_WIN64)
  typedef uint64_t ULONG_PTR;
 #else
- typedef unsigned long ULONG_PTR;
+ typedef uintptr_t ULONG_PTR;
 #endif
 
 #if defined(_WIN64)
- typedefint64_t LONG_PTR; 
+ typedef int64_t LONG_PTR; 
 #else
- typedef long LONG_PTR;
+ typedef intptr_t LONG_PTR;
 #endif
 
 typedef uint64_t UINT64;
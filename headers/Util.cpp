@@ -68,7 +68,7 @@ string getFileName(string path)
 // untested, check the other getLineFromMem() which is tested.
 DWORD getLineFromMem(LPVOID ReadAddr, LPVOID Bound, char* &Line)
 {
-	DWORD LimitSize = (DWORD)Bound - (DWORD)ReadAddr;
+	DWORD LimitSize = (ULONG_PTR)Bound - (ULONG_PTR)ReadAddr;
 	BYTE x = *(BYTE *)ReadAddr;
 	DWORD i = 0, StrLen = 0;
 
@@ -88,14 +88,14 @@ DWORD getLineFromMem(LPVOID ReadAddr, LPVOID Bound, char* &Line)
 	if(x == EOF || x == 0)	
 		ReadAddr = Bound;
 	Line =  new char[StrLen+1];
-	memcpy(Line, (LPVOID)((DWORD)ReadAddr + i - StrLen), StrLen);
+	memcpy(Line, (LPVOID)((ULONG_PTR)ReadAddr + i - StrLen), StrLen);
 	Line[StrLen] = '\0';
 	return i;
 }
 
 string getLineFromMem(LPVOID &ReadAddr, LPVOID Bound)
 {
-	int LimitSize = (DWORD)Bound - (DWORD)ReadAddr;
+	int LimitSize = (ULONG_PTR)Bound - (ULONG_PTR)ReadAddr;
 
 	BYTE x = *(BYTE *)ReadAddr;
 	int i = 1, StrLen = 0;
@@ -117,10 +117,10 @@ string getLineFromMem(LPVOID &ReadAddr, LPVOID Bound)
 	// if end of file
 	if(x == EOF || x == 0)	
 		ReadAddr = Bound;
-	ReadAddr = (LPVOID) ((DWORD) ReadAddr + i);				// update memory pointer
+	ReadAddr = (LPVOID) ((ULONG_PTR)ReadAddr + i);				// update memory pointer
 	if(StrLen) {
 		Line =  new char[StrLen+1];
-		memcpy(Line, (LPVOID)((DWORD)ReadAddr - 1 - StrLen), StrLen);
+		memcpy(Line, (LPVOID)((ULONG_PTR)ReadAddr - 1 - StrLen), StrLen);
 		Line[StrLen] = '\0';
 		string s = string(Line);
 		delete[] Line;
@@ -139,6 +139,19 @@ string removeSpaces(string s)
 	return s2;
 }
 
+/* checks the characters of a Windows path, e.g. an imported module name: no control characters and
+ * none of the characters Windows doesn't allow in file names, except the drive and directory separators */
+bool isValidPath(const string &path)
+{
+	if(path.empty())	return false;
+
+	for(unsigned int i = 0; i < path.length(); i++) {
+		unsigned char c = path[i];
+		if(c < 0x20 || strchr("<>\"|?*", c))	return false;
+	}
+	return true;
+}
+
 #ifdef __linux__
 
 bool isFile(char* path) {
@@ -69,12 +69,15 @@ static inline std::string &trim(std::string &s) {
 template <typename T>
 string numToStr(T number)
 {
-	string s = dynamic_cast<stringstream *> (&(stringstream() << std::uppercase << number))->str();
-	return (s);
+	stringstream s;
+	s << std::uppercase << number;
+	return s.str();
 }
 
 string removeSpaces(string s);
 
+bool isValidPath(const string &path);
+
 inline int hexStr2int(string s)
 {
 	//return std::stoul(s, nullptr, 16);
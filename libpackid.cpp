@@ -0,0 +1,237 @@
+/*
+ * libpackid.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ * C interface of the library, see libpackid.h
+ */
+
+#define PACKID_BUILD
+
+#include <cstring>
+#include <memory>
+#include <new>
+#include "libpackid.h"
+#include "ScanCache.h"
+#include "headers/PE.h"
+#include "PackiD.h"
+
+// a loaded database, shared by the caller's handle and by every scanner created from it
+struct SharedDb
+{
+	PackiD			iD;
+	ScanCache		Cache;					// PACKID_FLAG_CACHE, memory tier only
+};
+
+struct packid_db
+{
+	shared_ptr<SharedDb>	Db;
+};
+
+struct packid_scanner
+{
+	shared_ptr<SharedDb>	Db;
+	PE						P;				// reused by every scan of this scanner
+	atomic<bool>			Cancel;
+
+	packid_scanner() : Cancel(false) {}
+};
+
+// the scanner's callback and context, for a PackiD::scanPE() callback
+struct MatchForwarder
+{
+	packid_match_cb			Callback;
+	void*					Context;
+	bool					Called;
+};
+
+static int forwardMatch(const SignatureMatch &Match, void* Context)
+{
+	MatchForwarder* f = (MatchForwarder*)Context;
+	packid_match m;
+
+	m.signature_id = Match.SignatureId;
+	m.tool = Match.Tool;
+	m.region = Match.Region;
+	m.offset = Match.Offset;
+	m.section = Match.Section;
+
+	f->Called = true;
+	return f->Callback(&m, f->Context);
+}
+
+// the first match, without the cost of building a string
+static int keepFirstMatch(const SignatureMatch &Match, void* Context)
+{
+	*(const char**)Context = Match.Tool;
+	return MATCH_STOP;
+}
+
+// the caller's buffer, as a file or as a loaded image
+static bool loadData(PE &P, const uint8_t* data, size_t size, uint32_t flags)
+{
+	if(flags & PACKID_FLAG_IMAGE)	return P.loadImage(data, (DWORD)size) != NULL;
+	return P.loadBuffer(data, (DWORD)size) != NULL;
+}
+
+uint32_t packid_abi_version(void)
+{
+	return PACKID_ABI_VERSION;
+}
+
+packid_db* packid_db_open(const char* path)
+{
+	if(!path)	return NULL;
+
+	// nothing may unwind into a C caller
+	try {
+		shared_ptr<SharedDb> Db(new SharedDb);
+		if(!Db->iD.loadDB((char*)path))		return NULL;
+
+		packid_db* db = new packid_db;
+		db->Db = Db;
+		return db;
+	}
+	catch(...) {
+		return NULL;
+	}
+}
+
+void packid_db_close(packid_db* db)
+{
+	delete db;
+}
+
+uint64_t packid_db_hash(const packid_db* db)
+{
+	if(!db)		return 0;
+	return db->Db->iD.getDbHash();
+}
+
+packid_scanner* packid_scanner_create(packid_db* db)
+{
+	if(!db)		return NULL;
+
+	packid_scanner* scanner = new (nothrow) packid_scanner;
+	if(!scanner)	return NULL;
+
+	scanner->Db = db->Db;
+	return scanner;
+}
+
+void packid_scanner_destroy(packid_scanner* scanner)
+{
+	delete scanner;
+}
+
+void packid_scanner_cancel(packid_scanner* scanner)
+{
+	if(scanner)	scanner->Cancel.store(true);
+}
+
+void packid_scanner_reset(packid_scanner* scanner)
+{
+	if(scanner)	scanner->Cancel.store(false);
+}
+
+int packid_scan_buffer(packid_scanner* scanner, const uint8_t* data, size_t size, int mode, uint32_t flags, packid_result* result)
+{
+	if(!scanner || !result || result->struct_size < sizeof(packid_result) || (!data && size))
+		return PACKID_ERROR_ARGS;
+
+	uint32_t struct_size = result->struct_size;
+	memset(result, 0, sizeof(packid_result));
+	result->struct_size = struct_size;
+
+	if((ULONGLONG)size > (DWORD)-1) {
+		result->status = PACKID_ERROR_TOO_LARGE;
+		return result->status;
+	}
+
+	PE &P = scanner->P;
+	SharedDb &Db = *scanner->Db;
+	string Tool = NO_MATCH;
+	const char* First = NULL;
+	int Scan = SCAN_DONE;
+
+	try {
+		if(!size || !loadData(P, data, size, flags)) {
+			P.unloadFile();
+			result->status = PACKID_NOT_PE;
+			return result->status;
+		}
+
+		result->entry_point = P.getEntryPoint();
+		result->is_pe64 = P.isPE64();
+		result->is_dll = P.isDLL();
+
+		// a cached scan can't be cancelled once started, it's only checked before
+		if(scanner->Cancel.load())			Scan = SCAN_CANCELLED;
+		else if(flags & PACKID_FLAG_CACHE)	Tool = Db.Cache.scanPE(Db.iD, P, mode);
+		else {
+			Scan = Db.iD.scanPE(P, mode, keepFirstMatch, &First, &scanner->Cancel);
+			if(First)	Tool = First;
+		}
+	}
+	catch(...) {
+		// nothing may unwind into a C caller. A failed scan is not a clean file
+		P.unloadFile();
+		result->status = PACKID_ERROR_INTERNAL;
+		return result->status;
+	}
+
+	// the caller's buffer isn't ours after the call
+	P.unloadFile();
+
+	if(Scan == SCAN_CANCELLED) {
+		result->status = PACKID_CANCELLED;
+		return result->status;
+	}
+
+	if(!Tool.compare(NO_MATCH)) {
+		result->status = PACKID_NO_MATCH;
+		return result->status;
+	}
+
+	result->tool_len = Tool.length();
+	size_t n = min(Tool.length(), (size_t)PACKID_MAX_TOOL - 1);
+	memcpy(result->tool, Tool.data(), n);
+	result->tool[n] = 0;
+
+	result->status = PACKID_MATCH;
+	return result->status;
+}
+
+int packid_scan_buffer_matches(packid_scanner* scanner, const uint8_t* data, size_t size, int mode, uint32_t flags,
+							   packid_match_cb callback, void* context)
+{
+	if(!scanner || !callback || (!data && size))	return PACKID_ERROR_ARGS;
+	if((ULONGLONG)size > (DWORD)-1)				return PACKID_ERROR_TOO_LARGE;
+
+	PE &P = scanner->P;
+	MatchForwarder Forwarder;
+	Forwarder.Callback = callback;
+	Forwarder.Context = context;
+	Forwarder.Called = false;
+	int Scan = SCAN_DONE;
+
+	try {
+		if(!size || !loadData(P, data, size, flags)) {
+			P.unloadFile();
+			return PACKID_NOT_PE;
+		}
+
+		Scan = scanner->Db->iD.scanPE(P, mode, forwardMatch, &Forwarder, &scanner->Cancel);
+	}
+	catch(...) {
+		// matches already reported stay reported, but the rest of the buffer was not scanned
+		P.unloadFile();
+		return PACKID_ERROR_INTERNAL;
+	}
+
+	P.unloadFile();
+
+	if(Scan == SCAN_CANCELLED)	return PACKID_CANCELLED;
+	return Forwarder.Called ? PACKID_MATCH : PACKID_NO_MATCH;
+}
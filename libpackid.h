@@ -0,0 +1,145 @@
+/*
+ * libpackid.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ *
+ * C interface of libpackid.so (PackiD.dll on Windows), for callers in other languages.
+ *
+ * A database is opened once and shared by any number of scanners, one scanner per thread. Scans read a buffer
+ * owned by the caller, which is never modified or kept after the call returns, and write the result into a
+ * packid_result owned by the caller.
+ *
+ *	packid_db* db = packid_db_open("userdb.txt");
+ *	packid_scanner* s = packid_scanner_create(db);
+ *	packid_db_close(db);							// the scanner keeps the database alive
+ *
+ *	packid_result r;
+ *	r.struct_size = sizeof(r);
+ *	if(packid_scan_buffer(s, data, size, PACKID_MODE_DEEP, 0, &r) == PACKID_MATCH)
+ *		printf("%s\n", r.tool);
+ *
+ *	packid_scanner_destroy(s);
+ */
+
+#ifndef _libpackid_
+#define _libpackid_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+	#ifdef PACKID_BUILD
+		#define PACKID_API __declspec(dllexport)
+	#else
+		#define PACKID_API __declspec(dllimport)
+	#endif
+#else
+	#define PACKID_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PACKID_ABI_VERSION			1			// changes only when existing functions or structs change incompatibly
+
+// scan results (return value and packid_result.status)
+#define PACKID_MATCH				0
+#define PACKID_NO_MATCH				1
+#define PACKID_NOT_PE				2
+#define PACKID_CANCELLED			3			// packid_scanner_cancel() was called
+#define PACKID_ERROR_ARGS			-1			// null handle or result, or unknown struct_size
+#define PACKID_ERROR_TOO_LARGE		-2			// buffers are limited to 4GB - 1
+#define PACKID_ERROR_INTERNAL		-3			// the scan failed, e.g. out of memory. The buffer was not fully scanned
+
+// modes, as PackiD.h
+#define PACKID_MODE_NORMAL			0
+#define PACKID_MODE_DEEP			1
+#define PACKID_MODE_HARDCORE		2
+#define PACKID_MODE_ADAPTIVE		3			// normal, then deep, then hardcore, each only if the one before matched nothing
+#define PACKID_MODE_EXEC_SECTIONS	4			// deep over every code section, the sections scanned in parallel
+#define PACKID_MODE_OVERLAY			5			// only the data after the last section, with scope = overlay signatures
+#define PACKID_MODE_WITH_OVERLAY	0x100		// or'ed with another mode: the overlay too, when that mode found nothing
+
+// flags
+#define PACKID_FLAG_CACHE			0x1			// remember results by content in the database, shared by its scanners
+#define PACKID_FLAG_IMAGE			0x2			// data is an image as loaded in memory, e.g. a module or a memory dump: offsets are RVAs. Not cached
+
+// regions, as PackiD.h
+#define PACKID_REGION_EP			0			// at the entry point
+#define PACKID_REGION_EP_SECTION	1			// the section of the entry point
+#define PACKID_REGION_FILE			2			// the whole file
+#define PACKID_REGION_EXEC_SECTION	3			// a code section or the section of the entry point
+#define PACKID_REGION_OVERLAY		4			// the data after the last section
+
+// return values of a packid_match_cb
+#define PACKID_CONTINUE				0
+#define PACKID_STOP					1
+#define PACKID_SKIP_REGION			2
+
+#define PACKID_MAX_TOOL				256
+
+typedef struct packid_db packid_db;
+typedef struct packid_scanner packid_scanner;
+
+typedef struct
+	{
+		uint32_t	struct_size;				// set by the caller to sizeof(packid_result) before the call
+		int32_t		status;						// same as the return value
+		uint32_t	tool_len;					// length of the matched tool name, it may be longer than tool
+		char		tool[PACKID_MAX_TOOL];		// matched tool name, NUL terminated and truncated if needed
+		uint32_t	entry_point;				// RVA, valid unless status is PACKID_NOT_PE
+		uint8_t		is_pe64;
+		uint8_t		is_dll;
+		uint8_t		reserved[2];
+	} packid_result;
+
+typedef struct
+	{
+		uint32_t	signature_id;				// index of the signature in the database
+		const char*	tool;						// valid as long as the database is loaded
+		int32_t		region;						// PACKID_REGION_*
+		uint32_t	offset;						// offset of the match in the buffer
+		int32_t		section;					// index in the section table of the section holding the match, -1 if none
+	} packid_match;
+
+// called for every match, returns PACKID_CONTINUE, PACKID_STOP or PACKID_SKIP_REGION
+typedef int (*packid_match_cb)(const packid_match* match, void* context);
+
+PACKID_API uint32_t packid_abi_version(void);
+
+// loads a signature database (userdb.txt format), NULL on failure
+PACKID_API packid_db* packid_db_open(const char* path);
+
+// releases the caller's reference, the database is freed once its scanners are destroyed too
+PACKID_API void packid_db_close(packid_db* db);
+
+// hash of the database file, changes when the signatures change
+PACKID_API uint64_t packid_db_hash(const packid_db* db);
+
+// a scanner must not be used by two threads at the same time, create one per thread
+PACKID_API packid_scanner* packid_scanner_create(packid_db* db);
+PACKID_API void packid_scanner_destroy(packid_scanner* scanner);
+
+// scans size bytes at data, returns PACKID_MATCH, PACKID_NO_MATCH, PACKID_NOT_PE, PACKID_CANCELLED or PACKID_ERROR_*
+PACKID_API int packid_scan_buffer(packid_scanner* scanner, const uint8_t* data, size_t size, int mode, uint32_t flags, packid_result* result);
+
+/* calls callback for every match rather than keeping the first one. Returns PACKID_MATCH if it was called at least once,
+ * otherwise as packid_scan_buffer(). Only PACKID_FLAG_IMAGE is used, results reported one by one are not cached.
+ */
+PACKID_API int packid_scan_buffer_matches(packid_scanner* scanner, const uint8_t* data, size_t size, int mode, uint32_t flags,
+									  packid_match_cb callback, void* context);
+
+/* Aborts the scan running on the scanner, from any thread. The scan returns PACKID_CANCELLED soon after.
+ * The scanner stays cancelled, a cancel that arrives between two scans cancels the next one, until
+ * packid_scanner_reset() is called.
+ */
+PACKID_API void packid_scanner_cancel(packid_scanner* scanner);
+PACKID_API void packid_scanner_reset(packid_scanner* scanner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
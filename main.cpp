@@ -16,57 +16,601 @@
 #include <iostream>
 #include <ctime>
 #include <fstream>
-#include "headers/Util.h"
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <sstream>
+#include <csignal>
+#include "ScanCache.h"
+#include "ScanServer.h"
+#include "ScanClient.h"
+#include "DirWatcher.h"
+#include "TarReader.h"
+#include "ScanManifest.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "headers/PE.h"
+#include "headers/Util.h"
+#include "headers/Hash.h"
 #include "PackiD.h"
 
 using namespace std;
 
+// keeps the first match
+static int keepFirst(const SignatureMatch &Match, void* Context)
+{
+	*(string*)Context = Match.Tool;
+	return MATCH_STOP;
+}
+
+/* -frames reads many samples from stdin, each one as:
+ *	name length		4 bytes, little endian
+ *	data length		4 bytes, little endian
+ *	name			shown in the results, not a path
+ *	data			the file
+ */
+#define FRAME_MAX_NAME	4096
+
+// reads the header and the name of the next sample of a framed stream, false at the end of the stream
+static bool readFrame(istream &In, string &Name, DWORD &Size)
+{
+	BYTE Lengths[8];
+	if(!In.read((char*)Lengths, sizeof(Lengths)))	return false;
+
+	DWORD NameLen = Lengths[0] | Lengths[1] << 8 | Lengths[2] << 16 | (DWORD)Lengths[3] << 24;
+	Size = Lengths[4] | Lengths[5] << 8 | Lengths[6] << 16 | (DWORD)Lengths[7] << 24;
+	if(NameLen > FRAME_MAX_NAME)	return false;
+
+	Name.resize(NameLen);
+	return !NameLen || In.read(&Name[0], NameLen);
+}
+
+/* writes the result of the loaded file to Out, true if it matched. A result cut short by a limit, or by the time of an
+ * adaptive tier, is marked as such and CutShort is set
+ */
+static bool reportScan(PackiD &iD, ScanCache &Cache, PE &P, const ScanLimits &Limits, ostream &Out = cout, bool* CutShort = NULL)
+{
+	string result = NO_MATCH;
+	ScanCoverage Coverage;
+	int Status = SCAN_DONE;
+	bool Matched = false;
+	bool Limited = Limits.TimeMs || Limits.Bytes;
+
+	if(Limited)		Status = iD.scanPE(P, iD.getMode(), Limits, keepFirst, &result, Coverage);
+	else			result = Cache.scanPE(iD, P, iD.getMode(), Status);
+
+	if(result.compare(NO_MATCH)) {
+		Out << result;
+		Matched = true;
+	}			
+	else	Out << "mismatch!";
+
+	if(Status == SCAN_TIMEOUT || Status == SCAN_BUDGET) {
+		Out << " (" << (Status == SCAN_TIMEOUT ? "timed out" : "out of budget");
+		if(Limited)		Out << ", " << Coverage.Bytes << " bytes scanned";
+		Out << ")";
+		if(CutShort)	*CutShort = true;
+	}
+	Out << endl;
+
+	vector<EmbeddedImage> Images;
+	iD.carvePE(P, iD.getMode(), Images);
+	for(size_t e = 0; e < Images.size(); e++) {
+		Out << string(Images[e].Depth * 2, ' ') << "embedded PE at 0x" << hex << Images[e].Offset << dec << ": ";
+		Out << (Images[e].Tool.compare(NO_MATCH) ? Images[e].Tool : "mismatch!") << endl;
+	}
+
+	return Matched;
+}
+
+/* scans the regular files of a tar archive (gzip compressed or not) in place of extracting it, each one is reported
+ * as 'archive:member'. Returns the number of matches, Members gets the number of files seen.
+ */
+static int scanArchive(PackiD &iD, ScanCache &Cache, const ScanLimits &Limits, istream &In, const string &Archive, int &Members)
+{
+	TarReader Tar(In);
+	string Name;
+	vector<BYTE> Data;			// the buffer of every member, the PE reads it in place
+	int Matches = 0;
+	int Status;
+
+	while((Status = Tar.next(Name, Data)) != TAR_END)
+	{
+		if(Status == TAR_ERROR) {
+			cout << "Processing file '" << Archive << "': the archive is corrupted, truncated or cannot be decompressed!" << endl;
+			break;
+		}
+
+		PE P;
+		Members++;
+		cout << "Processing file '" << Archive << ":" << Name << "': ";
+
+		if(Status == TAR_TOO_LARGE) {
+			cout << "is too large!" << endl;
+			continue;
+		}
+
+		if(!P.loadBuffer(Data.data(), (DWORD)Data.size())) {
+			cout << "is not a PE or file cannot be opened!" << endl;
+			continue;
+		}
+
+		if(reportScan(iD, Cache, P, Limits))	Matches++;
+	}
+
+	return Matches;
+}
+
+static volatile sig_atomic_t StopManifest = 0;
+
+static void onStopManifest(int)
+{
+	StopManifest = 1;
+}
+
+/* scans the files listed in ListFile into OutFile, checkpointing as it goes. Run again after being stopped or killed,
+ * it goes on after the last checkpoint. SIGINT or SIGTERM finish the current file, checkpoint and exit.
+ */
+static int runManifest(char* ListFile, char* OutFile, char* CacheFile, int Mode, unsigned int CarveDepth, bool Image,
+	const ScanLimits &Limits, unsigned int CheckpointSeconds)
+{
+	cout << "Loading signature database." << endl;
+	PackiD iD((char*)"userdb.txt");
+	if(!iD.isDbLoaded()) {
+		cout << "Cannot load the db" << endl;
+		return 1;
+	}
+	iD.setMode(Mode);
+	iD.setCarveLimits(CarveDepth, CARVE_MAX_IMAGES);
+
+	ScanCache Cache;
+	if(CacheFile && !Cache.open(CacheFile, iD.getDbHash()))
+		cout << "Cannot open the cache file, results will not be saved" << endl;
+
+	// the results depend on these options too, a run with other ones starts over rather than resuming on stale results
+	DWORD Options[] = { iD.getResultTag(Mode), CarveDepth, (DWORD)Image, Limits.TimeMs, (DWORD)Limits.Bytes,
+						(DWORD)(Limits.Bytes >> 32), (DWORD)Limits.Prioritize };
+
+	ScanManifest Manifest(ListFile, OutFile);
+	Manifest.setCheckpointInterval(0, CheckpointSeconds);
+	if(!Manifest.open(iD.getDbHash(), (DWORD)hash64(Options, sizeof(Options)))) {
+		cout << "Cannot open the list '" << ListFile << "' or the results '" << OutFile << "'" << endl;
+		return 1;
+	}
+	if(Manifest.getResumed())
+		cout << "Resuming after " << Manifest.getResumed() << " files already scanned" << endl;
+
+	signal(SIGINT, onStopManifest);
+	signal(SIGTERM, onStopManifest);
+
+	string Path;
+	ULONGLONG CutShort = 0;
+	while(!StopManifest && Manifest.next(Path))
+	{
+		PE P;
+		ostringstream Out;
+		bool Partial = false;
+		Out << "Processing file '" << Path << "': ";
+
+		if((Image ? P.loadImage((char*)Path.c_str()) : P.loadPE((char*)Path.c_str())) != NULL) {
+			reportScan(iD, Cache, P, Limits, Out, &Partial);
+			if(Partial)	CutShort++;
+		}
+		else
+			Out << "is not a PE or file cannot be opened!" << endl;
+
+		if(!Manifest.record(Path, Out.str()) || (Manifest.due() && !Manifest.checkpoint())) {
+			cout << "Cannot write the results to '" << OutFile << "'" << endl;
+			return 1;
+		}
+	}
+
+	if(!Manifest.checkpoint()) {
+		cout << "Cannot write the results to '" << OutFile << "'" << endl;
+		return 1;
+	}
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	cout << (StopManifest ? "Stopped" : "Finished") << " after " << Manifest.getDone() << " files" << endl;
+	if(CutShort)
+		cout << CutShort << " of them were cut short by a limit, their results are marked (timed out) or (out of budget)" << endl;
+	return 0;
+}
+
+#ifdef __linux__
+
+// serves scan requests on SocketPath until SIGINT or SIGTERM, SIGHUP reloads the database
+static int runDaemon(char* SocketPath, unsigned int Threads, char* CacheFile, int Mode)
+{
+	ScanServer Server(Threads);
+	Server.setMode(Mode);
+
+	cout << "Loading signature database." << endl;
+	if(!Server.loadDB("userdb.txt", CacheFile)) {
+		cout << "Cannot load the db" << endl;
+		return 1;
+	}
+
+	if(!Server.listen(SocketPath)) {
+		cout << "Cannot listen on '" << SocketPath << "'" << endl;
+		return 1;
+	}
+
+	cout << "Listening on '" << SocketPath << "'" << endl;
+	return Server.run();
+}
+
+// the sink of -watch: a line per file, written as soon as its scan is done
+static void writeResult(const string &Path, const ScanCompletion &Result, void* Context)
+{
+	ostream &Out = *(ostream*)Context;
+
+	Out << "Processing file '" << Path << "': ";
+	switch(Result.Status) {
+	case ASYNC_MATCH:		Out << Result.Tool << endl;	break;
+	case ASYNC_NO_MATCH:	Out << "mismatch!" << endl;	break;
+	case ASYNC_NOT_PE:		Out << "is not a PE or file cannot be opened!" << endl;	break;
+	default:				Out << "cancelled" << endl;
+	}
+}
+
+// scans the files dropped into the directories until SIGINT or SIGTERM
+static int runWatcher(const vector<char*> &Dirs, unsigned int Threads, char* CacheFile, int Mode, char* OutFile)
+{
+	cout << "Loading signature database." << endl;
+	PackiD iD((char*)"userdb.txt");
+	if(!iD.isDbLoaded()) {
+		cout << "Cannot load the db" << endl;
+		return 1;
+	}
+	iD.setSectionThreads(1);						// the pool scans a file per thread already
+
+	ScanCache Cache;
+	if(CacheFile && !Cache.open(CacheFile, iD.getDbHash()))
+		cout << "Cannot open the cache file, results will not be saved" << endl;
+
+	ofstream File;
+	if(OutFile) {
+		File.open(OutFile, ios::out | ios::app);
+		if(!File.is_open()) {
+			cout << "Cannot open '" << OutFile << "'" << endl;
+			return 1;
+		}
+	}
+
+	DirWatcher Watcher(iD, Threads, Mode, writeResult, OutFile ? (ostream*)&File : &cout, &Cache);
+	for(size_t i = 0; i < Dirs.size(); i++) {
+		if(!Watcher.watch(Dirs[i])) {
+			cout << "Cannot watch '" << Dirs[i] << "'" << endl;
+			return 1;
+		}
+		cout << "Watching '" << Dirs[i] << "'" << endl;
+	}
+
+	return Watcher.run();
+}
+
+// sends the files to a running daemon, keeping up to CLIENT_PIPELINE requests in flight.
+// PassFd sends open descriptors rather than paths, the daemon reads the files without opening them.
+static int runClient(char* SocketPath, bool Reload, bool PassFd, int argc, char* argv[], int first)
+{
+	ScanClient Client;
+	FrameHeader Header;
+	string Payload;
+	int matches = 0;
+
+	if(!Client.connect(SocketPath)) {
+		cout << "Cannot connect to the daemon at '" << SocketPath << "'" << endl;
+		return 1;
+	}
+
+	if(Reload) {
+		if(!Client.send(REQ_RELOAD) || !Client.receive(Header, Payload)) {
+			cout << "Connection to the daemon lost" << endl;
+			return 1;
+		}
+		cout << (Header.Type == RESP_OK ? "Database reloaded" : "Cannot load the db") << endl;
+		if(first >= argc)	return 0;
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	map<DWORD, char*> Pending;			// request id -> file
+	int next = first;
+
+	while(next < argc || !Pending.empty())
+	{
+		while(next < argc && Pending.size() < CLIENT_PIPELINE) {
+			DWORD Id;
+
+			if(PassFd) {
+				int FileFd = open(argv[next], O_RDONLY | O_CLOEXEC);
+				if(FileFd < 0) {
+					cout << "Processing file '" << getFileName(argv[next++]).c_str() << "': is not a PE or file cannot be opened!" << endl;
+					continue;
+				}
+				Id = Client.sendFd(FileFd);
+				close(FileFd);
+			}
+			else {
+				// the daemon may run in another directory
+				char FullPath[PATH_MAX];
+				char* Path = realpath(argv[next], FullPath) ? FullPath : argv[next];
+				Id = Client.send(REQ_SCAN_PATH, Path);
+			}
+
+			if(!Id) {
+				cout << "Connection to the daemon lost" << endl;
+				return 1;
+			}
+			Pending[Id] = argv[next++];
+		}
+
+		if(Pending.empty())	continue;
+
+		if(!Client.receive(Header, Payload)) {
+			cout << "Connection to the daemon lost" << endl;
+			return 1;
+		}
+
+		map<DWORD, char*>::iterator it = Pending.find(Header.Id);
+		if(it == Pending.end())	continue;
+
+		cout << "Processing file '" << getFileName(it->second).c_str() << "': ";
+		switch(Header.Type) {
+		case RESP_MATCH:	cout << Payload << endl; matches++;	break;
+		case RESP_NO_MATCH:	cout << "mismatch!" << endl;	break;
+		case RESP_NOT_PE:	cout << "is not a PE or file cannot be opened!" << endl;	break;
+		default:			cout << "error: " << Payload << endl;
+		}
+		Pending.erase(it);
+	}
+
+	double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << endl << "Finished scanning in: " << elapsed << "ms - matched " << matches << " of " << argc - first << " files." << endl;
+
+	return 0;
+}
+
+#endif
+
+static void printUsage(const char* Program)
+{
+	cout << "Usage: " << Program << " [-m normal|deep|hardcore|adaptive|exec|overlay] [-overlay] [-carve depth] [-image] [-timeout ms] [-budget bytes] [-prioritize] [-frames] [-tar] [-cache file] [file(s) | -]" << endl;
+	cout << "       " << Program << " -manifest list -out file [-checkpoint seconds] [-m mode] [-overlay] [-carve depth] [-image] [-timeout ms] [-budget bytes] [-cache file]" << endl;
+#ifdef __linux__
+	cout << "       " << Program << " -daemon socket [-m mode] [-overlay] [-threads n] [-cache file]" << endl;
+	cout << "       " << Program << " -client socket [-reload] [-fd] [file(s)]" << endl;
+	cout << "       " << Program << " -watch dir [-watch dir...] [-out file] [-m mode] [-overlay] [-threads n] [-cache file]" << endl;
+#endif
+}
+
 int main(int argc, char* argv[])
 {
 
 	clock_t start_s = clock();
 
-	if( argc < 2 )
+	// options
+	int first = 1;
+	char* CacheFile = NULL;				// results of previous runs, reused for files with the same content
+	char* DaemonSocket = NULL;			// serve scans on this socket
+	char* ClientSocket = NULL;			// send the files to the daemon on this socket
+	unsigned int Threads = thread::hardware_concurrency();
+	bool Reload = false;
+	bool PassFd = false;
+	int Mode = MODE_DEEP;
+	bool Overlay = false;				// scan the overlay too when the mode finds nothing
+	unsigned int CarveDepth = 0;		// also scan the executables embedded in each file, this deep
+	bool Image = false;					// the files are images dumped from memory, not files on disk
+	ScanLimits Limits;					// per file, results cut short by them are not cached
+	bool Frames = false;				// read a framed stream of samples from stdin, after the files
+	bool Tar = false;					// the files are tar archives of samples, .tar or .tar.gz
+	vector<char*> WatchDirs;			// scan the files dropped into these directories, until stopped
+	char* OutFile = NULL;				// results of -watch (stdout if not given) and of -manifest
+	char* ManifestFile = NULL;			// a list of files to scan with checkpoints, resumed if interrupted
+	unsigned int CheckpointSeconds = 0;	// time between the checkpoints of -manifest, 0 for the default
+
+	while(first < argc && argv[first][0] == '-')
 	{
-	  cout << "Usage: " << argv[0] << " [file(s)]" << endl;
+		if(!strcmp(argv[first], "-cache") && first + 1 < argc) {
+			CacheFile = argv[first + 1];
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-daemon") && first + 1 < argc) {
+			DaemonSocket = argv[first + 1];
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-client") && first + 1 < argc) {
+			ClientSocket = argv[first + 1];
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-watch") && first + 1 < argc) {
+			WatchDirs.push_back(argv[first + 1]);
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-out") && first + 1 < argc) {
+			OutFile = argv[first + 1];
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-manifest") && first + 1 < argc) {
+			ManifestFile = argv[first + 1];
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-checkpoint") && first + 1 < argc) {
+			CheckpointSeconds = atoi(argv[first + 1]);
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-threads") && first + 1 < argc) {
+			Threads = atoi(argv[first + 1]);
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-m") && first + 1 < argc) {
+			const char* Modes[] = { "normal", "deep", "hardcore", "adaptive", "exec", "overlay" };
+			for(Mode = MODE_NORMAL; Mode <= MODE_OVERLAY && strcmp(argv[first + 1], Modes[Mode]); Mode++);
+			if(Mode > MODE_OVERLAY) {
+				cout << "Unknown mode '" << argv[first + 1] << "'" << endl;
+				return 1;
+			}
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-carve") && first + 1 < argc) {
+			CarveDepth = atoi(argv[first + 1]);
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-timeout") && first + 1 < argc) {
+			Limits.TimeMs = atoi(argv[first + 1]);
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-budget") && first + 1 < argc) {
+			Limits.Bytes = strtoull(argv[first + 1], NULL, 0);
+			first += 2;
+		}
+		else if(!strcmp(argv[first], "-prioritize")) {
+			Limits.Prioritize = true;
+			first++;
+		}
+		else if(!strcmp(argv[first], "-frames")) {
+			Frames = true;
+			first++;
+		}
+		else if(!strcmp(argv[first], "-tar")) {
+			Tar = true;
+			first++;
+		}
+		else if(!strcmp(argv[first], "-image")) {
+			Image = true;
+			first++;
+		}
+		else if(!strcmp(argv[first], "-overlay")) {
+			Overlay = true;
+			first++;
+		}
+		else if(!strcmp(argv[first], "-reload")) {
+			Reload = true;
+			first++;
+		}
+		else if(!strcmp(argv[first], "-fd")) {
+			PassFd = true;
+			first++;
+		}
+		else break;
+	}
+
+	if(Overlay)	Mode |= MODE_WITH_OVERLAY;
+
+	if(ManifestFile && OutFile)	return runManifest(ManifestFile, OutFile, CacheFile, Mode, CarveDepth, Image, Limits, CheckpointSeconds);
+
+	// without -out the list would be taken for a sample to scan
+	if(ManifestFile) {
+		cout << "-manifest needs -out file" << endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+#ifdef __linux__
+	if(DaemonSocket)	return runDaemon(DaemonSocket, Threads, CacheFile, Mode);
+	if(WatchDirs.size())	return runWatcher(WatchDirs, Threads, CacheFile, Mode, OutFile);
+	if(ClientSocket && (Reload || argc - first > 0))	return runClient(ClientSocket, Reload, PassFd, argc, argv, first);
+#endif
+
+	if( argc - first < 1 && !Frames )
+	{
+	  printUsage(argv[0]);
 	  return 0;
 	}
 
-	int TotalFiles = argc - 1;
+	int TotalFiles = argc - first;
+
+#ifndef __linux__
+	// samples read from stdin are binary, line ends must not be translated
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
 	int matches = 0;
 
 	cout << "Loading signature database." << endl;
 
 	PackiD iD((char*)"userdb.txt");
-	iD.setMode(MODE_DEEP);
+	iD.setMode(Mode);
+	iD.setCarveLimits(CarveDepth, CARVE_MAX_IMAGES);
 
 	if(!iD.isDbLoaded())	{
 		cout << "Cannot load the db" << endl;
 		return 0;
 	}
 
+	// identical files of this batch are scanned once, the cache file also skips files scanned by previous runs
+	ScanCache Cache;
+	if(CacheFile && !Cache.open(CacheFile, iD.getDbHash()))
+		cout << "Cannot open the cache file, results will not be saved" << endl;
+
 	clock_t stop_s = clock();
 	cout << "Database loaded in: " << (double)(stop_s-start_s)/double(CLOCKS_PER_SEC)*1000 << "ms" << endl;
 	start_s = clock();
 
 
-	for(int i = 1; i < argc; i++)
+	for(int i = first; i < argc; i++)
 	{
+		// the archive itself is not counted, its members are
+		if(Tar) {
+			TotalFiles--;
+			if(!strcmp(argv[i], "-")) {
+				matches += scanArchive(iD, Cache, Limits, cin, "-", TotalFiles);
+				continue;
+			}
+
+			ifstream Archive(argv[i], ios::in | ios::binary);
+			if(!Archive) {
+				cout << "Processing file '" << getFileName(argv[i]).c_str() << "': file cannot be opened!" << endl;
+				continue;
+			}
+			matches += scanArchive(iD, Cache, Limits, Archive, getFileName(argv[i]), TotalFiles);
+			continue;
+		}
+
 		PE P;
 		cout << "Processing file '" << getFileName(argv[i]).c_str() << "': ";
 
-		if(!P.loadPE(argv[i])) {
-			cout << "is not a PE or file cannot be opened!" << endl;
+		// - is stdin, read as it comes: a pipe can't be reopened or seeked
+		bool Loaded;
+		if(!strcmp(argv[i], "-"))	Loaded = P.loadStream(cin) != NULL;
+		else						Loaded = (Image ? P.loadImage(argv[i]) : P.loadPE(argv[i])) != NULL;
+
+		if(!Loaded) {
+			cout << (P.OutOfMemory ? "the file is too big to load!" : "is not a PE or file cannot be opened!") << endl;
+			continue;
+		}
+
+		if(reportScan(iD, Cache, P, Limits))	matches++;
+	}
+
+	string Name;
+	DWORD Size;
+	while(Frames && readFrame(cin, Name, Size))
+	{
+		PE P;
+		TotalFiles++;
+		cout << "Processing file '" << Name << "': ";
+
+		if(!P.loadStream(cin, Size)) {
+			if(P.FileSize != Size) {
+				cout << "the stream ended inside this sample!" << endl;
+				break;
+			}
+			cout << (P.OutOfMemory ? "the sample is too big to load!" : "is not a PE or file cannot be opened!") << endl;
 			continue;
 		}
 
-		string result = iD.scanPE(P);
-		if(result.compare(NO_MATCH)) {
-			cout << result << endl;
-			matches++;
-		}			
-		else	cout << "mismatch!" << endl;
+		if(reportScan(iD, Cache, P, Limits))	matches++;
 	}
 
 	stop_s = clock();
@@ -0,0 +1,96 @@
+/*
+ * AnchorTest.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+/* anchor = and range = lines at the entry point: MODE_NORMAL, the first tier of MODE_ADAPTIVE and scanBatch() try a
+ * constrained signature at the entry point only if its anchor and range allow the entry point. Built and run by
+ * ./compile.sh test
+ */
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include "TestPE.h"
+#include "../PackiD.h"
+
+using namespace std;
+
+#define TEST_DB			"AnchorTest.db"
+#define EP_OFFSET		TEST_EP_OFFSET
+#define TEXT_SIZE		0x1000
+#define OVERLAY_SIZE	0x100
+
+static const BYTE EPBytes[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0x11, 0x22, 0x33, 0x44 };
+
+// the test PE with the signature bytes at its entry point
+static vector<BYTE> makePE()
+{
+	vector<BYTE> File = makeTestPE(TEXT_SIZE, OVERLAY_SIZE);
+	memcpy(&File[EP_OFFSET], EPBytes, sizeof(EPBytes));
+	return File;
+}
+
+// true if a database holding only the signature of the bytes at the entry point with Constraint matches the file
+static bool matches(vector<BYTE> &File, const char* Constraint, int Mode, bool Batch)
+{
+	ofstream Db(TEST_DB, ios::out | ios::binary | ios::trunc);
+	Db << "[Anchored]" << endl << "signature = DE AD BE EF 11 22 33 44" << endl << "ep_only = false" << endl;
+	Db << Constraint << endl;
+	Db.close();
+
+	PackiD iD((char*)TEST_DB);
+	PE P;
+	if(!iD.isDbLoaded() || !P.loadBuffer(File.data(), (DWORD)File.size())) {
+		cout << "cannot load the database or the file" << endl;
+		return false;
+	}
+
+	if(!Batch)	return iD.scanPE(P, Mode).compare(NO_MATCH) != 0;
+
+	vector<PE*> Files(1, &P);
+	vector<string> Results;
+	iD.scanBatch(Files, Mode, Results);
+	return Results[0].compare(NO_MATCH) != 0;
+}
+
+int main()
+{
+	vector<BYTE> File = makePE();
+	int Failures = 0;
+
+	static const struct { const char* Constraint; bool Expected; } Cases[] = {
+		{ "anchor = ep",				true },
+		{ "anchor = ep+4",				false },
+		{ "anchor = section_start",		true },			// .text starts at the entry point
+		{ "anchor = section_start+4",	false },
+		{ "anchor = section_end",		false },
+		{ "anchor = overlay",			false },
+		{ "anchor = imports",			false },		// the file has no import directory
+		{ "range = 0x200-0x201",		true },
+		{ "range = 0x5000-0x6000",		false },
+	};
+
+	static const struct { const char* Name; int Mode; bool Batch; } Scans[] = {
+		{ "normal",			MODE_NORMAL,	false },
+		{ "adaptive",		MODE_ADAPTIVE,	false },
+		{ "batch normal",	MODE_NORMAL,	true },
+	};
+
+	for(unsigned int c = 0; c < sizeof(Cases) / sizeof(Cases[0]); c++)
+		for(unsigned int s = 0; s < sizeof(Scans) / sizeof(Scans[0]); s++) {
+			bool Matched = matches(File, Cases[c].Constraint, Scans[s].Mode, Scans[s].Batch);
+			if(Matched == Cases[c].Expected)	continue;
+
+			cout << "FAIL " << Scans[s].Name << ", " << Cases[c].Constraint << ": " << (Matched ? "matched" : "no match") << endl;
+			Failures++;
+		}
+
+	remove(TEST_DB);
+
+	if(Failures)	return 1;
+	cout << "All anchor tests passed" << endl;
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * TestPE.h
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+#ifndef _TestPE_
+#define _TestPE_
+
+#include <vector>
+#include <cstring>
+#include "../headers/PE.h"
+
+using namespace std;
+
+#define TEST_EP_OFFSET		0x200				// file offset of the entry point, the start of .text
+
+template <class T>
+static void put(vector<BYTE> &File, size_t Offset, T Value)
+{
+	memcpy(&File[Offset], &Value, sizeof(Value));
+}
+
+// a 32 bit PE with one section, .text at file offset 0x200 holding the entry point, no imports and a zero overlay
+static vector<BYTE> makeTestPE(DWORD TextSize, DWORD OverlaySize)
+{
+	vector<BYTE> File(TEST_EP_OFFSET + TextSize + OverlaySize, 0);
+	size_t Nt = 0x80, Opt = Nt + 4 + 20, Sec = Opt + 0xE0;
+
+	put<WORD>(File, 0, 0x5A4D);
+	put<DWORD>(File, 0x3C, (DWORD)Nt);
+	put<DWORD>(File, Nt, 0x00004550);
+	put<WORD>(File, Nt + 4, 0x14C);						// Machine
+	put<WORD>(File, Nt + 6, 1);							// NumberOfSections
+	put<WORD>(File, Nt + 20, 0xE0);						// SizeOfOptionalHeader
+	put<WORD>(File, Nt + 22, 0x102);					// Characteristics
+	put<WORD>(File, Opt, 0x10B);
+	put<DWORD>(File, Opt + 16, 0x1000);					// AddressOfEntryPoint
+	put<DWORD>(File, Opt + 28, 0x400000);				// ImageBase
+	put<DWORD>(File, Opt + 32, 0x1000);					// SectionAlignment
+	put<DWORD>(File, Opt + 36, 0x200);					// FileAlignment
+	put<DWORD>(File, Opt + 56, 0x1000 + ((TextSize + 0xFFF) & ~0xFFF));		// SizeOfImage
+	put<DWORD>(File, Opt + 60, 0x200);					// SizeOfHeaders
+	put<DWORD>(File, Opt + 92, 16);						// NumberOfRvaAndSizes
+
+	memcpy(&File[Sec], ".text", 5);
+	put<DWORD>(File, Sec + 8, TextSize);				// VirtualSize
+	put<DWORD>(File, Sec + 12, 0x1000);					// VirtualAddress
+	put<DWORD>(File, Sec + 16, TextSize);				// SizeOfRawData
+	put<DWORD>(File, Sec + 20, TEST_EP_OFFSET);			// PointerToRawData
+	put<DWORD>(File, Sec + 36, 0x60000020);
+
+	return File;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * TokenTest.cpp
+ *
+ *  Author: Moustafa Saleh
+ *  Email: msaleh83@gmail.com
+ */
+
+/* Gaps and alternations after the prefix of a signature: what they match, and that wide ones on data that almost
+ * matches everywhere end quickly rather than trying every combination of gap lengths. Built and run by
+ * ./compile.sh test
+ */
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include "TestPE.h"
+#include "../PackiD.h"
+
+using namespace std;
+
+#define TEST_DB			"TokenTest.db"
+#define TEXT_SIZE		0x1000
+#define MAX_SCAN_MS		5000				// the slow case takes longer than anyone waits, a linear one a few ms
+
+static const BYTE EPBytes[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0x11, 0x22, 0x33, 0x44 };
+
+// true if a database holding only Sig matches the file in Mode
+static bool matches(vector<BYTE> &File, const char* Sig, int Mode)
+{
+	ofstream Db(TEST_DB, ios::out | ios::binary | ios::trunc);
+	Db << "[Tokens]" << endl << "signature = " << Sig << endl << "ep_only = false" << endl;
+	Db.close();
+
+	PackiD iD((char*)TEST_DB);
+	PE P;
+	if(!iD.isDbLoaded() || !P.loadBuffer(File.data(), (DWORD)File.size())) {
+		cout << "cannot load the database or the file" << endl;
+		return false;
+	}
+
+	return iD.scanPE(P, Mode).compare(NO_MATCH) != 0;
+}
+
+int main()
+{
+	int Failures = 0;
+
+	// the bytes at the entry point, in normal and hardcore mode
+	vector<BYTE> File = makeTestPE(TEXT_SIZE, 0);
+	memcpy(&File[TEST_EP_OFFSET], EPBytes, sizeof(EPBytes));
+
+	static const struct { const char* Sig; bool Expected; } Cases[] = {
+		{ "DE AD [2] 11 22",						true },
+		{ "DE AD [1-3] 11",							true },
+		{ "DE AD [3-5] 11",							false },
+		{ "DE AD ( 00 | BE EF ) 11",				true },
+		{ "DE AD ( 00 | 01 02 ) 11",				false },
+		{ "DE AD ( BE | ) EF 11",					true },
+		{ "DE AD ( 00 | ) BE",						true },
+		{ "DE AD [0-2] ( EF | 00 ) 11 [1] 33",		true },
+		{ "DE AD [0-2] ( EF | 00 ) 11 [2] 33",		false },
+	};
+
+	static const struct { const char* Name; int Mode; } Scans[] = {
+		{ "normal",			MODE_NORMAL },
+		{ "hardcore",		MODE_HARDCORE },
+	};
+
+	for(unsigned int c = 0; c < sizeof(Cases) / sizeof(Cases[0]); c++)
+		for(unsigned int s = 0; s < sizeof(Scans) / sizeof(Scans[0]); s++) {
+			bool Matched = matches(File, Cases[c].Sig, Scans[s].Mode);
+			if(Matched == Cases[c].Expected)	continue;
+
+			cout << "FAIL " << Scans[s].Name << ", " << Cases[c].Sig << ": " << (Matched ? "matched" : "no match") << endl;
+			Failures++;
+		}
+
+	// every byte of .text starts the prefix and fits every gap length and alternative, only the last byte never matches
+	vector<BYTE> Nops = makeTestPE(TEXT_SIZE, 0);
+	memset(&Nops[TEST_EP_OFFSET], 0x90, TEXT_SIZE);
+
+	static const char* Wide[] = {
+		"90 [0-255] 90 [0-255] 90 [0-255] 90 [0-255] 90 [0-255] CC",
+		"90 ( 90 | 90 90 | 90 90 90 | ) ( 90 | 90 90 | 90 90 90 | ) ( 90 | 90 90 | 90 90 90 | ) ( 90 | 90 90 | 90 90 90 | ) "
+			"( 90 | 90 90 | 90 90 90 | ) ( 90 | 90 90 | 90 90 90 | ) ( 90 | 90 90 | 90 90 90 | ) ( 90 | 90 90 | 90 90 90 | ) CC",
+		"90 [0-255] ( 90 | 90 90 | ) [0-255] ( 90 | 90 90 | ) [0-255] ( 90 | 90 90 | ) [0-255] CC",
+	};
+
+	for(unsigned int w = 0; w < sizeof(Wide) / sizeof(Wide[0]); w++) {
+		chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+		bool Matched = matches(Nops, Wide[w], MODE_HARDCORE);
+		long long Ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - Start).count();
+
+		if(!Matched && Ms < MAX_SCAN_MS)	continue;
+
+		cout << "FAIL wide " << w << ": " << (Matched ? "matched" : "no match") << " in " << Ms << "ms" << endl;
+		Failures++;
+	}
+
+	remove(TEST_DB);
+
+	if(Failures)	return 1;
+	cout << "All token tests passed" << endl;
+	return 0;
+}